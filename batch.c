@@ -0,0 +1,238 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "rpmcpio.h"
+
+// Each worker has a deque of packages, sorted by compressed size, largest
+// first.  Initially, the packages are dealt out to the workers round-robin,
+// so that the biggest ones are started right away.  A worker takes packages
+// from the front of its own deque; once the deque is empty, it steals from
+// the back of the deque which has the most work left.  The deques are locked
+// with a mutex, which is taken once per package, and is hardly contended.
+struct deque {
+    pthread_mutex_t mutex;
+    unsigned *pkg;
+    unsigned head, tail;
+    // The compressed size of the packages still in the deque.
+    unsigned long long left;
+};
+
+struct batch {
+    int dirfd;
+    const char *const *rpmfnames;
+    const struct rpmcpio_opt *opt;
+    const struct rpmcpio_batch *b;
+    unsigned long long *size;
+    struct deque *dq;
+    unsigned nworkers;
+    // Set when the callback asks to stop the batch.
+    bool stop;
+    unsigned failed;
+};
+
+struct worker {
+    struct batch *bt;
+    unsigned id;
+    pthread_t thread;
+};
+
+static bool pop(struct batch *bt, struct deque *dq, bool front, unsigned *pkg)
+{
+    bool ok = false;
+    pthread_mutex_lock(&dq->mutex);
+    // The stores are atomic for the sake of the readers in take().
+    if (dq->head < dq->tail) {
+	if (front) {
+	    *pkg = dq->pkg[dq->head];
+	    __atomic_store_n(&dq->head, dq->head + 1, __ATOMIC_RELAXED);
+	}
+	else {
+	    *pkg = dq->pkg[dq->tail - 1];
+	    __atomic_store_n(&dq->tail, dq->tail - 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&dq->left, dq->left - bt->size[*pkg], __ATOMIC_RELAXED);
+	ok = true;
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return ok;
+}
+
+// Get the next package for the worker.  Returns false when there is no work
+// left anywhere.
+static bool take(struct batch *bt, unsigned id, unsigned *pkg)
+{
+    if (pop(bt, &bt->dq[id], true, pkg))
+	return true;
+    while (1) {
+	// The victim is chosen without locking, the numbers are only a hint.
+	unsigned victim = -1;
+	unsigned long long most = 0;
+	for (unsigned i = 0; i < bt->nworkers; i++) {
+	    struct deque *dq = &bt->dq[i];
+	    unsigned long long left = __atomic_load_n(&dq->left, __ATOMIC_RELAXED);
+	    bool busy = __atomic_load_n(&dq->head, __ATOMIC_RELAXED) <
+			__atomic_load_n(&dq->tail, __ATOMIC_RELAXED);
+	    if (busy && (victim == -1 || left > most))
+		victim = i, most = left;
+	}
+	if (victim == -1)
+	    return false;
+	if (pop(bt, &bt->dq[victim], false, pkg))
+	    return true;
+    }
+}
+
+static void process(struct batch *bt, struct rpmcpio **cpiop, unsigned pkg)
+{
+    const struct rpmcpio_batch *b = bt->b;
+    const char *rpmfname = bt->rpmfnames[pkg];
+    char errbuf[RPMCPIO_ERRSIZE];
+    const char *err = NULL;
+    // The handle is created for the first package, and then reused.
+    struct rpmcpio *cpio = *cpiop;
+    if (cpio) {
+	if (rpmcpio_reopen2(cpio, bt->dirfd, rpmfname, NULL, bt->opt) < 0)
+	    err = rpmcpio_strerror(cpio);
+    }
+    else {
+	cpio = *cpiop = rpmcpio_open2(bt->dirfd, rpmfname, NULL, bt->opt, errbuf);
+	if (!cpio)
+	    err = errbuf;
+    }
+    if (!err) {
+	int rc;
+	const struct cpioent *ent;
+	while ((rc = rpmcpio_next2(cpio, &ent)) > 0) {
+	    int ret = b->entry(b->arg, pkg, cpio, ent);
+	    if (ret < 0)
+		__atomic_store_n(&bt->stop, true, __ATOMIC_RELAXED);
+	    if (ret)
+		break;
+	}
+	if (rc < 0)
+	    err = rpmcpio_strerror(cpio);
+    }
+    if (err)
+	__atomic_fetch_add(&bt->failed, 1, __ATOMIC_RELAXED);
+    if (b->done)
+	b->done(b->arg, pkg, err);
+}
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    struct batch *bt = w->bt;
+    struct rpmcpio *cpio = NULL;
+    unsigned pkg;
+    while (!__atomic_load_n(&bt->stop, __ATOMIC_RELAXED) && take(bt, w->id, &pkg))
+	process(bt, &cpio, pkg);
+    if (cpio)
+	rpmcpio_close(cpio);
+    return NULL;
+}
+
+// Sort the packages by size, descending.
+static int cmpsize(const void *a, const void *b, void *size)
+{
+    unsigned long long sa = ((unsigned long long *) size)[*(const unsigned *) a];
+    unsigned long long sb = ((unsigned long long *) size)[*(const unsigned *) b];
+    return (sa < sb) - (sa > sb);
+}
+
+int rpmcpio_batch_run(int dirfd, const char *const *rpmfnames, unsigned n,
+		      const struct rpmcpio_opt *opt, const struct rpmcpio_batch *b)
+{
+    unsigned nworkers = b->nthreads;
+    if (nworkers == 0) {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = ncpu > 0 ? ncpu : 1;
+    }
+    if (nworkers > n)
+	nworkers = n;
+    if (n == 0)
+	return 0;
+
+    struct batch bt = {
+	dirfd, rpmfnames, opt, b,
+	.nworkers = nworkers,
+    };
+    unsigned *order = malloc(n * sizeof *order);
+    unsigned *pkg = malloc(n * sizeof *pkg);
+    bt.size = malloc(n * sizeof *bt.size);
+    bt.dq = malloc(nworkers * sizeof *bt.dq);
+    struct worker *w = malloc(nworkers * sizeof *w);
+    if (!(order && pkg && bt.size && bt.dq && w)) {
+	free(order), free(pkg), free(bt.size), free(bt.dq), free(w);
+	return errno = ENOMEM, -1;
+    }
+
+    // Packages which cannot be stat'd go last, and fail when opened.
+    for (unsigned i = 0; i < n; i++) {
+	struct stat st;
+	order[i] = i;
+	bt.size[i] = fstatat(dirfd, rpmfnames[i], &st, 0) == 0 ? st.st_size : 0;
+    }
+    qsort_r(order, n, sizeof *order, cmpsize, bt.size);
+
+    // Deal out the packages; worker i gets order[i], order[i+nworkers], etc.,
+    // which are laid out contiguously in the order[] array.
+    for (unsigned i = 0, k = 0; i < nworkers; i++) {
+	struct deque *dq = &bt.dq[i];
+	pthread_mutex_init(&dq->mutex, NULL);
+	dq->pkg = pkg + k;
+	dq->head = dq->tail = 0;
+	dq->left = 0;
+	for (unsigned j = i; j < n; j += nworkers) {
+	    dq->pkg[dq->tail++] = order[j];
+	    dq->left += bt.size[order[j]];
+	}
+	k += dq->tail;
+    }
+    free(order);
+
+    // The calling thread is worker 0.  Should some threads fail to start,
+    // their packages get stolen by the others.
+    for (unsigned i = 0; i < nworkers; i++)
+	w[i] = (struct worker) { &bt, i };
+    unsigned started = 1;
+    while (started < nworkers) {
+	if (pthread_create(&w[started].thread, NULL, worker, &w[started]))
+	    break;
+	started++;
+    }
+    worker(&w[0]);
+    for (unsigned i = 1; i < started; i++)
+	pthread_join(w[i].thread, NULL);
+
+    for (unsigned i = 0; i < nworkers; i++)
+	pthread_mutex_destroy(&bt.dq[i].mutex);
+    free(pkg), free(bt.size), free(bt.dq), free(w);
+    if (bt.stop)
+	return errno = ECANCELED, -1;
+    return bt.failed;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
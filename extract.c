@@ -0,0 +1,1077 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include "rpmcpio.h"
+#include "uring.h"
+
+// Defined in rpmcpio.c.
+bool rpmcpio_seterr(struct rpmcpio *cpio, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3), visibility("hidden")));
+void rpmcpio_addtime(struct rpmcpio *cpio, unsigned long long write_ns,
+		     unsigned long long wait_ns)
+	__attribute__((visibility("hidden")));
+
+// With io_uring, file data is copied to the staging area, because the
+// rpmcpio_peek window is reused.  The area is split in two halves: while
+// the writes from one half are in flight, the other half is being filled.
+#define STAGESIZE (8 << 20)
+#define HALFSIZE (STAGESIZE / 2)
+// The size of the rings, and the number of files with writes in flight.
+#define NENTRIES 256
+#define NSLOT 64
+
+// With the writer threads, the entries and file data are passed in messages
+// of up to MSGSIZE bytes, at most NMSG of which are allocated: once they are
+// all queued, the decompressing thread waits for the writers to catch up.
+#define MSGSIZE (64 << 10)
+#define NMSG 256
+// The messages are queued in batches, so that the writer is not woken up
+// for each message.  Small files go to the same writer in a batch.
+#define BATCH 16
+
+// With RPMCPIO_EXTRACT_SPARSE, the blocks of this size which are all zeros
+// are skipped, leaving holes.
+#define BLKSIZE 4096
+
+// A file being written.
+struct slot {
+    int fd;
+    unsigned mtime;
+    unsigned long long size;
+    // The current offset, and the end of the data written so far
+    // (which is short of the offset if the file ends with a hole).
+    unsigned long long off, end;
+    // The requests in flight, and whether the writes are all queued.
+    unsigned nreq;
+    bool used, done;
+    char *fname;
+};
+
+// The completions are told apart by user_data: the length of the write
+// in the lower half, then the slot number, the kind of the request, and
+// the half of the staging area.
+enum { REQ_WRITE, REQ_FALLOCATE, REQ_CLOSE };
+#define USERDATA(len, slot, req, half) \
+	((len) | (uint64_t)(slot) << 32 | (uint64_t)(req) << 40 | (uint64_t)(half) << 48)
+
+// The parent directory of the last entry, kept open: the entries in the
+// same directory usually come in a row.
+struct dcache {
+    int fd;
+    // Set if openat2 is not supported by the kernel.
+    bool noat2;
+    size_t len;
+    char name[PATH_MAX];
+};
+
+// A message to a writer thread.  The kinds which start a new entry come
+// with its path in data, followed by the hardlink target.  Directories,
+// symlinks and fifos are created by the decompressing thread itself, before
+// any file under them is handed over, whichever writer it goes to.
+enum { MSG_FILE, MSG_OPEN, MSG_DATA, MSG_END, MSG_LINK };
+
+struct msg {
+    struct msg *next;
+    unsigned kind, mode, mtime;
+    unsigned long long size;
+    size_t len;
+    char data[MSGSIZE];
+};
+
+struct writer {
+    struct extract *x;
+    pthread_t thread;
+    // The queue, protected by the pool mutex.
+    pthread_cond_t cond;
+    struct msg *head, *tail;
+    unsigned nq;
+    struct dcache dc;
+    // The file being written, fd = -1 if none.
+    struct slot s;
+    unsigned long long write_ns;
+};
+
+struct dir {
+    char *path;
+    unsigned mode, mtime;
+};
+
+struct extract {
+    struct rpmcpio *cpio;
+    int dirfd;
+    unsigned flags;
+    // Once an error is recorded, the extraction stops, and no more errors
+    // are recorded: the first one is reported.  The writer threads cannot
+    // set the error on the handle, hence the message goes to err first.
+    bool failed;
+    pthread_mutex_t errmutex;
+    char err[RPMCPIO_ERRSIZE];
+    struct dcache dc;
+    // The first file of the current hardlink set (the path relative
+    // to dirfd), to which the rest of the set is linked, and the writer
+    // which has the set.
+    unsigned hino;
+    char hpath[PATH_MAX];
+    struct writer *hw;
+    // The directories, whose modes and mtimes are set when done.
+    struct dir *dirs;
+    unsigned ndir, diralloc;
+    // With io_uring: the staging area, the current half and the position
+    // in it, and the number of writes in flight from each half.
+    bool ring;
+    struct uring u;
+    char *stage;
+    unsigned half;
+    size_t spos;
+    unsigned hreq[2];
+    struct slot slot[NSLOT];
+    // With the writer threads: the free messages, the number of messages
+    // allocated, and whether the writers should exit once done.
+    struct writer *w;
+    unsigned nw;
+    pthread_mutex_t mutex;
+    pthread_cond_t freecond;
+    struct msg *free;
+    unsigned nmsg;
+    bool quit;
+    // The batch being made up, for the writer pw.
+    struct writer *pw;
+    struct msg *phead, *ptail;
+    unsigned npend;
+    // The time spent in the filesystem calls, and waiting for the writes,
+    // by the calling thread.
+    unsigned long long write_ns, wait_ns;
+};
+
+static unsigned long long nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool failed(struct extract *x)
+{
+    return __atomic_load_n(&x->failed, __ATOMIC_RELAXED);
+}
+
+// Stop on the error from the decoder, which is set on the handle.
+static bool fail(struct extract *x)
+{
+    __atomic_store_n(&x->failed, true, __ATOMIC_RELAXED);
+    return false;
+}
+
+// Record the error, only the first one.  Returns false.
+static bool __attribute__((format(printf, 2, 3)))
+seterr(struct extract *x, const char *fmt, ...)
+{
+    int saved_errno = errno; // for %m
+    pthread_mutex_lock(&x->errmutex);
+    if (!failed(x)) {
+	va_list ap;
+	va_start(ap, fmt);
+	errno = saved_errno;
+	vsnprintf(x->err, sizeof x->err, fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&x->failed, true, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&x->errmutex);
+    return false;
+}
+
+#define ERR(fmt, args...) seterr(x, fmt, ##args)
+
+// Open a directory under dirfd.  Symlinks which come with the package, such
+// as /lib -> usr/lib, are resolved as if dirfd were the root directory, so
+// that they cannot lead outside the tree (the kernel must support openat2).
+static int opendirfd(struct extract *x, struct dcache *dc, const char *dname)
+{
+    if (!dc->noat2) {
+	struct open_how how = {
+	    .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+	    .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+	};
+	int fd = syscall(SYS_openat2, x->dirfd, dname, &how, sizeof how);
+	if (fd >= 0 || errno != ENOSYS)
+	    return fd;
+	dc->noat2 = true;
+    }
+    return openat(x->dirfd, dname, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Create the missing directories in the path, component by component,
+// each in its parent opened with opendirfd.  The directories may as well
+// be created concurrently by another writer thread.
+static bool mkdirs(struct extract *x, struct dcache *dc, char *dname)
+{
+    char *s = dname;
+    while (1) {
+	char *slash = strchr(s, '/');
+	if (slash)
+	    *slash = '\0';
+	int pfd = x->dirfd;
+	if (s > dname) {
+	    s[-1] = '\0';
+	    pfd = opendirfd(x, dc, dname);
+	    s[-1] = '/';
+	    if (pfd < 0)
+		return ERR("%s: %m", dname);
+	}
+	int rc = mkdirat(pfd, s, 0755);
+	if (rc < 0 && errno == EEXIST)
+	    rc = 0;
+	if (pfd != x->dirfd) {
+	    int saved_errno = errno;
+	    close(pfd);
+	    errno = saved_errno;
+	}
+	if (rc < 0)
+	    return ERR("%s: mkdir: %m", dname);
+	if (!slash)
+	    return true;
+	*slash = '/';
+	s = slash + 1;
+    }
+}
+
+// Get the parent directory fd for the path, and its basename.
+static int getdir(struct extract *x, struct dcache *dc, const char *path,
+		  const char **base)
+{
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+	return *base = path, x->dirfd;
+    *base = slash + 1;
+    size_t len = slash - path;
+    if (dc->fd >= 0 && len == dc->len && memcmp(path, dc->name, len) == 0)
+	return dc->fd;
+    if (dc->fd >= 0)
+	close(dc->fd), dc->fd = -1;
+    memcpy(dc->name, path, len);
+    dc->name[len] = '\0';
+    int fd = opendirfd(x, dc, dc->name);
+    if (fd < 0 && errno == ENOENT) {
+	if (!mkdirs(x, dc, dc->name))
+	    return -1;
+	fd = opendirfd(x, dc, dc->name);
+    }
+    if (fd < 0)
+	return ERR("%s: %m", dc->name), -1;
+    dc->fd = fd, dc->len = len;
+    return fd;
+}
+
+// Open the parent directory of an existing path, such as the first file
+// of a hardlink set, bypassing the cache.  The fd must be closed with
+// putdir.  Unlike with a plain openat on the path, the symlinks in it
+// cannot lead outside the tree.
+static int opendir1(struct extract *x, struct dcache *dc, const char *path,
+		    const char **base)
+{
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+	return *base = path, x->dirfd;
+    *base = slash + 1;
+    char dname[PATH_MAX];
+    if (slash - path >= PATH_MAX)
+	return errno = ENAMETOOLONG, -1;
+    memcpy(dname, path, slash - path);
+    dname[slash - path] = '\0';
+    return opendirfd(x, dc, dname);
+}
+
+static void putdir(struct extract *x, int fd)
+{
+    if (fd != x->dirfd) {
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+    }
+}
+
+// Binary packages have absolute filenames; the leading slashes are stripped.
+// No ".." components, no "." components or empty components.
+static const char *relpath(struct extract *x, const char *fname)
+{
+    while (*fname == '/')
+	fname++;
+    const char *p = fname;
+    while (1) {
+	const char *q = strchrnul(p, '/');
+	size_t n = q - p;
+	if (n == 0 || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.'))
+	    return ERR("%s: bad filename", fname), NULL;
+	if (*q == '\0')
+	    return fname;
+	p = q + 1;
+    }
+}
+
+static bool zero(const char *p, size_t n)
+{
+    return p[0] == 0 && memcmp(p, p + 1, n - 1) == 0;
+}
+
+// Reap the completions, after submitting the queued requests, and waiting
+// for at least one completion, if requested.
+static bool reap(struct extract *x, bool wait);
+
+static struct io_uring_sqe *getsqe(struct extract *x)
+{
+    struct io_uring_sqe *sqe;
+    while (!(sqe = uring_sqe(&x->u))) {
+	// Either the submission queue is full, and needs to be submitted,
+	// or too many requests are in flight.
+	bool wait = x->u.queued < x->u.sqentries;
+	if (!reap(x, wait))
+	    return NULL;
+    }
+    return sqe;
+}
+
+// Done with the file: its writes have completed.
+static void finish(struct extract *x, struct slot *s)
+{
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { s->mtime, 0 } };
+    if (futimens(s->fd, ts) < 0)
+	ERR("%s: %m", s->fname);
+    struct io_uring_sqe *sqe = NULL;
+    if (x->ring) {
+	// Called from reap, which has just released a completion, so that
+	// the ring has room for one more request once the queue is submitted.
+	sqe = uring_sqe(&x->u);
+	if (!sqe && uring_submit(&x->u, false))
+	    sqe = uring_sqe(&x->u);
+    }
+    if (sqe) {
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = s->fd;
+	sqe->user_data = USERDATA(0, 0, REQ_CLOSE, 0);
+    }
+    else if (close(s->fd) < 0)
+	ERR("%s: %m", s->fname);
+    free(s->fname);
+    s->used = false;
+    s->fd = -1;
+}
+
+static void complete(struct extract *x, uint64_t ud, int res)
+{
+    unsigned len = (uint32_t) ud;
+    struct slot *s = &x->slot[ud >> 32 & 0xff];
+    switch (ud >> 40 & 0xff) {
+    case REQ_WRITE:
+	x->hreq[ud >> 48]--;
+	if (res < 0)
+	    errno = -res, ERR("%s: %m", s->fname);
+	else if (res < len)
+	    ERR("%s: short write", s->fname);
+	break;
+    case REQ_FALLOCATE:
+	if (res < 0 && res != -EOPNOTSUPP)
+	    errno = -res, ERR("%s: fallocate: %m", s->fname);
+	break;
+    case REQ_CLOSE:
+	if (res < 0)
+	    errno = -res, ERR("close: %m");
+	return;
+    }
+    if (--s->nreq == 0 && s->done)
+	finish(x, s);
+}
+
+static bool reap(struct extract *x, bool wait)
+{
+    unsigned long long start = wait ? nsec() : 0;
+    bool ok = uring_submit(&x->u, wait);
+    if (wait)
+	x->wait_ns += nsec() - start;
+    if (!ok)
+	return ERR("io_uring_enter: %m");
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(&x->u))) {
+	uint64_t ud = cqe->user_data;
+	int res = cqe->res;
+	uring_seen(&x->u);
+	complete(x, ud, res);
+    }
+    return true;
+}
+
+static struct slot *getslot(struct extract *x)
+{
+    while (1) {
+	for (unsigned i = 0; i < NSLOT; i++)
+	    if (!x->slot[i].used)
+		return &x->slot[i];
+	if (!reap(x, true))
+	    return NULL;
+    }
+}
+
+// Write the data at the current offset.
+static bool wr(struct extract *x, struct slot *s, const char *p, size_t n)
+{
+    if (!x->ring) {
+	while (n) {
+	    ssize_t ret = pwrite(s->fd, p, n, s->off);
+	    if (ret < 0) {
+		if (errno == EINTR)
+		    continue;
+		return ERR("%s: %m", s->fname);
+	    }
+	    p += ret, n -= ret;
+	    s->end = s->off += ret;
+	}
+	return true;
+    }
+    while (n) {
+	size_t k = n < HALFSIZE ? n : HALFSIZE;
+	if (x->spos + k > HALFSIZE) {
+	    // Switch to the other half, once its writes have completed.
+	    x->half ^= 1, x->spos = 0;
+	    while (x->hreq[x->half])
+		if (!reap(x, true))
+		    return false;
+	}
+	struct io_uring_sqe *sqe = getsqe(x);
+	if (!sqe)
+	    return false;
+	char *buf = x->stage + x->half * HALFSIZE + x->spos;
+	memcpy(buf, p, k);
+	x->spos += k;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = s->fd;
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = k;
+	sqe->off = s->off;
+	sqe->user_data = USERDATA(k, s - x->slot, REQ_WRITE, x->half);
+	s->nreq++, x->hreq[x->half]++;
+	p += k, n -= k;
+	s->end = s->off += k;
+    }
+    return true;
+}
+
+// Same as wr, but with RPMCPIO_EXTRACT_SPARSE, the blocks of zeros
+// are skipped.
+static bool put(struct extract *x, struct slot *s, const char *p, size_t n)
+{
+    if (!(x->flags & RPMCPIO_EXTRACT_SPARSE))
+	return wr(x, s, p, n);
+    while (n) {
+	// The run of data up to the next block of zeros.
+	size_t run = 0;
+	while (run < n) {
+	    size_t k = BLKSIZE - (s->off + run) % BLKSIZE;
+	    if (k > n - run)
+		k = n - run;
+	    if (k == BLKSIZE && zero(p + run, k))
+		break;
+	    run += k;
+	}
+	if (run && !wr(x, s, p, run))
+	    return false;
+	p += run, n -= run;
+	while (n >= BLKSIZE && zero(p, BLKSIZE))
+	    p += BLKSIZE, n -= BLKSIZE, s->off += BLKSIZE;
+    }
+    return true;
+}
+
+// Set up the slot for writing to fd, and preallocate the file.
+static bool startfile(struct extract *x, struct slot *s, int fd, const char *fname,
+		      unsigned mtime, unsigned long long size)
+{
+    *s = (struct slot) { fd, mtime, size, .used = true };
+    s->fname = strdup(fname);
+    if (!s->fname) {
+	*s = (struct slot) { -1 };
+	close(fd);
+	return ERR("%m");
+    }
+    if (size == 0 || (x->flags & RPMCPIO_EXTRACT_SPARSE))
+	return true;
+    struct io_uring_sqe *sqe = x->ring ? getsqe(x) : NULL;
+    if (sqe) {
+	sqe->opcode = IORING_OP_FALLOCATE;
+	sqe->fd = fd;
+	// The length goes in addr, the mode in len.
+	sqe->addr = size;
+	sqe->user_data = USERDATA(0, s - x->slot, REQ_FALLOCATE, 0);
+	s->nreq++;
+    }
+    // On error, the file is still to be closed with endfile.
+    else if (fallocate(fd, 0, 0, size) < 0 && errno != EOPNOTSUPP)
+	ERR("%s: fallocate: %m", fname);
+    return true;
+}
+
+// All the data has been written or queued; the file is closed once
+// the writes have completed.
+static void endfile(struct extract *x, struct slot *s)
+{
+    // The file ends with a hole.
+    if (!failed(x) && s->end < s->size && ftruncate(s->fd, s->size) < 0)
+	ERR("%s: %m", s->fname);
+    s->done = true;
+    if (s->nreq == 0)
+	finish(x, s);
+}
+
+// Create a new file, replacing the existing one (but not a directory).
+static int create(struct extract *x, int pfd, const char *base,
+		  const char *fname, unsigned mode)
+{
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    int fd = openat(pfd, base, flags, 0600);
+    if (fd < 0 && errno == EEXIST && unlinkat(pfd, base, 0) == 0)
+	fd = openat(pfd, base, flags, 0600);
+    if (fd < 0)
+	return ERR("%s: %m", fname), -1;
+    // The mode passed to open is subject to umask.
+    if (fchmod(fd, mode & 07777) < 0) {
+	ERR("%s: %m", fname);
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+// Create a new file for the entry, or open the first file of the hardlink
+// set (rather than create, if target is set).
+static int openfile(struct extract *x, struct dcache *dc, const char *fname,
+		    const char *target, unsigned mode)
+{
+    const char *base;
+    if (target) {
+	int pfd = opendir1(x, dc, target, &base);
+	if (pfd < 0)
+	    return ERR("%s: %m", target), -1;
+	int fd = openat(pfd, base, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+	putdir(x, pfd);
+	if (fd < 0)
+	    return ERR("%s: %m", fname), -1;
+	return fd;
+    }
+    int pfd = getdir(x, dc, fname, &base);
+    if (pfd < 0)
+	return -1;
+    return create(x, pfd, base, fname, mode);
+}
+
+// The entries other than file data.
+static bool mklink(struct extract *x, struct dcache *dc, const char *fname,
+		   const char *target)
+{
+    const char *base, *tbase;
+    int pfd = getdir(x, dc, fname, &base);
+    if (pfd < 0)
+	return false;
+    int tfd = opendir1(x, dc, target, &tbase);
+    if (tfd < 0)
+	return ERR("%s: %m", target);
+    int rc = linkat(tfd, tbase, pfd, base, 0);
+    if (rc < 0 && errno == EEXIST && unlinkat(pfd, base, 0) == 0)
+	rc = linkat(tfd, tbase, pfd, base, 0);
+    putdir(x, tfd);
+    if (rc < 0)
+	return ERR("%s: link: %m", fname);
+    return true;
+}
+
+static bool mkdir1(struct extract *x, struct dcache *dc, const char *fname,
+		   unsigned mode)
+{
+    const char *base;
+    int pfd = getdir(x, dc, fname, &base);
+    if (pfd < 0)
+	return false;
+    // The directory must stay writable until done.
+    if (mkdirat(pfd, base, mode | 0700) < 0 && errno != EEXIST)
+	return ERR("%s: %m", fname);
+    return true;
+}
+
+static bool mknode(struct extract *x, struct dcache *dc, const char *fname,
+		   const char *target, unsigned mode, unsigned mtime)
+{
+    const char *base;
+    int pfd = getdir(x, dc, fname, &base);
+    if (pfd < 0)
+	return false;
+    int rc;
+    if (target) {
+	rc = symlinkat(target, pfd, base);
+	if (rc < 0 && errno == EEXIST && unlinkat(pfd, base, 0) == 0)
+	    rc = symlinkat(target, pfd, base);
+    }
+    else {
+	rc = mknodat(pfd, base, S_IFIFO | 0600, 0);
+	if (rc < 0 && errno == EEXIST && unlinkat(pfd, base, 0) == 0)
+	    rc = mknodat(pfd, base, S_IFIFO | 0600, 0);
+	if (rc == 0)
+	    rc = fchmodat(pfd, base, mode, 0);
+    }
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { mtime, 0 } };
+    if (rc < 0 || utimensat(pfd, base, ts, AT_SYMLINK_NOFOLLOW) < 0)
+	return ERR("%s: %m", fname);
+    return true;
+}
+
+// The writer threads.
+
+// Queue the batch.
+static void flush(struct extract *x)
+{
+    struct writer *w = x->pw;
+    if (!w)
+	return;
+    pthread_mutex_lock(&x->mutex);
+    if (w->tail)
+	w->tail->next = x->phead;
+    else
+	w->head = x->phead;
+    w->tail = x->ptail;
+    w->nq += x->npend;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&x->mutex);
+    x->pw = NULL, x->npend = 0;
+}
+
+static struct msg *getmsg(struct extract *x)
+{
+    struct msg *m = NULL;
+    pthread_mutex_lock(&x->mutex);
+    while (!failed(x)) {
+	if ((m = x->free)) {
+	    x->free = m->next;
+	    break;
+	}
+	if (x->nmsg < NMSG) {
+	    if ((m = malloc(sizeof *m)))
+		x->nmsg++;
+	    else
+		ERR("%m");
+	    break;
+	}
+	// The messages held up in the batch may be the ones to wait for.
+	if (x->pw) {
+	    pthread_mutex_unlock(&x->mutex);
+	    flush(x);
+	    pthread_mutex_lock(&x->mutex);
+	    continue;
+	}
+	// Backpressure: all messages are queued, wait for the writers.
+	unsigned long long start = nsec();
+	pthread_cond_wait(&x->freecond, &x->mutex);
+	x->wait_ns += nsec() - start;
+    }
+    pthread_mutex_unlock(&x->mutex);
+    return m;
+}
+
+// Pick the writer for the next entry: the one with the batch being
+// made up, or else the one with the shortest queue.
+static struct writer *pick(struct extract *x)
+{
+    if (x->pw)
+	return x->pw;
+    struct writer *w = &x->w[0];
+    pthread_mutex_lock(&x->mutex);
+    for (unsigned i = 1; i < x->nw; i++)
+	if (x->w[i].nq < w->nq)
+	    w = &x->w[i];
+    pthread_mutex_unlock(&x->mutex);
+    return w;
+}
+
+static void send(struct extract *x, struct writer *w, struct msg *m)
+{
+    if (x->pw != w)
+	flush(x);
+    m->next = NULL;
+    if (x->pw)
+	x->ptail->next = m;
+    else
+	x->phead = m;
+    x->pw = w, x->ptail = m;
+    if (++x->npend == BATCH)
+	flush(x);
+}
+
+// Send an entry, with the path and the target, if any.
+static bool sendent(struct extract *x, struct writer *w, unsigned kind,
+		    const struct cpioent *ent, const char *fname, const char *target)
+{
+    struct msg *m = getmsg(x);
+    if (!m)
+	return false;
+    size_t len = strlen(fname) + 1;
+    memcpy(m->data, fname, len);
+    if (target) {
+	size_t tlen = strlen(target) + 1;
+	memcpy(m->data + len, target, tlen);
+	len += tlen;
+    }
+    m->kind = kind, m->mode = ent->mode & 07777, m->mtime = ent->mtime;
+    m->size = ent->size, m->len = len;
+    send(x, w, m);
+    return true;
+}
+
+// Pass file data to the writer, followed by MSG_END.
+static bool senddata(struct extract *x, struct writer *w)
+{
+    struct msg *m;
+    while (!failed(x)) {
+	const void *p;
+	ssize_t n = rpmcpio_peek2(x->cpio, &p);
+	if (n < 0)
+	    return fail(x);
+	if (n == 0)
+	    break;
+	for (size_t off = 0, len; off < n; off += len) {
+	    if (!(m = getmsg(x)))
+		return false;
+	    len = n - off < MSGSIZE ? n - off : MSGSIZE;
+	    memcpy(m->data, (const char *) p + off, len);
+	    m->kind = MSG_DATA, m->len = len;
+	    send(x, w, m);
+	}
+	rpmcpio_consume(x->cpio, n);
+    }
+    if (!(m = getmsg(x)))
+	return false;
+    m->kind = MSG_END;
+    send(x, w, m);
+    return true;
+}
+
+static void process(struct writer *w, struct msg *m)
+{
+    struct extract *x = w->x;
+    struct slot *s = &w->s;
+    const char *fname = m->data;
+    const char *target = fname + strlen(fname) + 1;
+    if (failed(x)) {
+	// Keep draining the queue.
+	if (s->fd >= 0)
+	    close(s->fd), free(s->fname), s->fd = -1;
+	return;
+    }
+    switch (m->kind) {
+    case MSG_FILE:
+    case MSG_OPEN: {
+	int fd = openfile(x, &w->dc, fname, m->kind == MSG_OPEN ? target : NULL, m->mode);
+	if (fd >= 0)
+	    startfile(x, s, fd, fname, m->mtime, m->size);
+	break;
+    }
+    case MSG_DATA:
+	if (s->fd >= 0)
+	    put(x, s, m->data, m->len);
+	break;
+    case MSG_END:
+	if (s->fd >= 0)
+	    endfile(x, s);
+	break;
+    case MSG_LINK:
+	mklink(x, &w->dc, fname, target);
+	break;
+    }
+}
+
+static void *writer(void *arg)
+{
+    struct writer *w = arg;
+    struct extract *x = w->x;
+    pthread_mutex_lock(&x->mutex);
+    while (1) {
+	struct msg *m = w->head;
+	if (!m) {
+	    if (x->quit)
+		break;
+	    pthread_cond_wait(&w->cond, &x->mutex);
+	    continue;
+	}
+	if (!(w->head = m->next))
+	    w->tail = NULL;
+	w->nq--;
+	pthread_mutex_unlock(&x->mutex);
+	unsigned long long start = nsec();
+	process(w, m);
+	w->write_ns += nsec() - start;
+	pthread_mutex_lock(&x->mutex);
+	m->next = x->free;
+	x->free = m;
+	pthread_cond_signal(&x->freecond);
+    }
+    pthread_mutex_unlock(&x->mutex);
+    // The extraction has been cut short.
+    if (w->s.fd >= 0)
+	close(w->s.fd), free(w->s.fname);
+    if (w->dc.fd >= 0)
+	close(w->dc.fd);
+    return NULL;
+}
+
+static void startpool(struct extract *x, unsigned nw)
+{
+    pthread_mutex_init(&x->mutex, NULL);
+    pthread_cond_init(&x->freecond, NULL);
+    x->w = calloc(nw, sizeof *x->w);
+    if (!x->w)
+	return;
+    // Should some threads fail to start, the rest will do.
+    for (unsigned i = 0; i < nw; i++) {
+	struct writer *w = &x->w[x->nw];
+	*w = (struct writer) { x, .dc.fd = -1, .s.fd = -1 };
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, writer, w)) {
+	    pthread_cond_destroy(&w->cond);
+	    break;
+	}
+	x->nw++;
+    }
+}
+
+static void stoppool(struct extract *x)
+{
+    flush(x);
+    pthread_mutex_lock(&x->mutex);
+    x->quit = true;
+    for (unsigned i = 0; i < x->nw; i++)
+	pthread_cond_signal(&x->w[i].cond);
+    pthread_mutex_unlock(&x->mutex);
+    for (unsigned i = 0; i < x->nw; i++) {
+	struct writer *w = &x->w[i];
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->cond);
+	x->write_ns += w->write_ns;
+    }
+    while (x->free) {
+	struct msg *m = x->free;
+	x->free = m->next;
+	free(m);
+    }
+    free(x->w);
+    pthread_cond_destroy(&x->freecond);
+    pthread_mutex_destroy(&x->mutex);
+}
+
+// Extract the entry, or pass it to a writer thread.
+static bool extract(struct extract *x, const struct cpioent *ent)
+{
+    const char *fname = relpath(x, ent->fname);
+    if (!fname)
+	return false;
+    unsigned mode = ent->mode & 07777;
+    if (S_ISREG(ent->mode)) {
+	struct writer *w = x->nw ? pick(x) : NULL;
+	const char *target = NULL;
+	if (ent->nlink < 2)
+	    x->hpath[0] = '\0';
+	// The rest of a hardlink set is linked to the first file, by the
+	// same writer.
+	else if (x->hpath[0] && ent->ino == x->hino) {
+	    w = x->hw;
+	    if (w) {
+		if (!sendent(x, w, MSG_LINK, ent, fname, x->hpath))
+		    return false;
+	    }
+	    else if (!mklink(x, &x->dc, fname, x->hpath))
+		return false;
+	    // The data comes with the last file.
+	    if (ent->size == 0)
+		return true;
+	    target = x->hpath;
+	}
+	else {
+	    x->hino = ent->ino, x->hw = w;
+	    strcpy(x->hpath, fname);
+	}
+	if (w)
+	    return sendent(x, w, target ? MSG_OPEN : MSG_FILE, ent, fname, target) &&
+		   senddata(x, w);
+	struct slot *s = getslot(x);
+	if (!s)
+	    return false;
+	int fd = openfile(x, &x->dc, fname, target, mode);
+	if (fd < 0 || !startfile(x, s, fd, fname, ent->mtime, ent->size))
+	    return false;
+	while (!failed(x)) {
+	    const void *p;
+	    // The time spent in the decoder is not counted.
+	    unsigned long long start = nsec();
+	    ssize_t n = rpmcpio_peek2(x->cpio, &p);
+	    x->write_ns -= nsec() - start;
+	    if (n < 0)
+		fail(x);
+	    if (n <= 0)
+		break;
+	    if (!put(x, s, p, n))
+		break;
+	    rpmcpio_consume(x->cpio, n);
+	}
+	endfile(x, s);
+	return !failed(x);
+    }
+    x->hpath[0] = '\0';
+    if (S_ISDIR(ent->mode)) {
+	if (x->ndir == x->diralloc) {
+	    unsigned alloc = x->diralloc ? 2 * x->diralloc : 64;
+	    struct dir *dirs = realloc(x->dirs, alloc * sizeof *dirs);
+	    if (!dirs)
+		return ERR("%m");
+	    x->dirs = dirs, x->diralloc = alloc;
+	}
+	char *path = strdup(fname);
+	if (!path)
+	    return ERR("%m");
+	x->dirs[x->ndir++] = (struct dir) { path, mode, ent->mtime };
+	return mkdir1(x, &x->dc, fname, mode);
+    }
+    if (S_ISLNK(ent->mode)) {
+	char target[4096];
+	if (rpmcpio_readlink2(x->cpio, target) < 0)
+	    return fail(x);
+	return mknode(x, &x->dc, fname, target, mode, ent->mtime);
+    }
+    if (S_ISFIFO(ent->mode))
+	return mknode(x, &x->dc, fname, NULL, mode, ent->mtime);
+    return ERR("%s: cannot extract special files", fname);
+}
+
+// Set the mode and mtime of the directory, once done.  The directory is
+// opened in its parent, so that neither the path nor the directory itself
+// can be a symlink which leads outside the tree.
+static bool fixdir(struct extract *x, struct dir *d)
+{
+    const char *base;
+    int pfd = opendir1(x, &x->dc, d->path, &base);
+    if (pfd < 0)
+	return ERR("%s: %m", d->path);
+    int fd = openat(pfd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    putdir(x, pfd);
+    if (fd < 0)
+	return ERR("%s: %m", d->path);
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { d->mtime, 0 } };
+    int rc = fchmod(fd, d->mode);
+    if (rc == 0)
+	rc = futimens(fd, ts);
+    if (rc < 0)
+	ERR("%s: %m", d->path);
+    close(fd);
+    return rc == 0;
+}
+
+int rpmcpio_extract(struct rpmcpio *cpio, int dirfd, unsigned flags)
+{
+    if (rpmcpio_strerror(cpio))
+	return -1;
+    struct extract *x = calloc(1, sizeof *x);
+    if (!x)
+	return rpmcpio_seterr(cpio, "%m"), -1;
+    x->cpio = cpio, x->dirfd = dirfd, x->flags = flags;
+    x->dc.fd = -1;
+    pthread_mutex_init(&x->errmutex, NULL);
+    for (unsigned i = 0; i < NSLOT; i++)
+	x->slot[i].fd = -1;
+    unsigned nw = flags >> 8 & 255;
+    if (nw)
+	startpool(x, nw);
+    // Opcodes such as IORING_OP_WRITE come with Linux 5.6, along with
+    // IORING_FEAT_RW_CUR_POS.
+    else if (!(flags & RPMCPIO_EXTRACT_NOURING) && uring_init(&x->u, NENTRIES)) {
+	if ((x->u.features & IORING_FEAT_RW_CUR_POS) && (x->stage = malloc(STAGESIZE)))
+	    x->ring = true;
+	else
+	    uring_fini(&x->u);
+    }
+
+    const struct cpioent *ent;
+    while (!failed(x)) {
+	int rc = rpmcpio_next2(cpio, &ent);
+	if (rc < 0)
+	    fail(x);
+	if (rc <= 0)
+	    break;
+	// With the writer threads, the time spent on regular files is theirs.
+	bool mine = !x->nw || !S_ISREG(ent->mode);
+	unsigned long long start = mine ? nsec() : 0;
+	if (!extract(x, ent))
+	    break;
+	if (mine)
+	    x->write_ns += nsec() - start;
+    }
+
+    if (nw)
+	stoppool(x);
+    if (x->ring) {
+	unsigned long long start = nsec();
+	while (x->u.inflight)
+	    if (!reap(x, true))
+		break;
+	x->write_ns += nsec() - start;
+	// Only if io_uring_enter has failed.
+	for (unsigned i = 0; i < NSLOT; i++)
+	    if (x->slot[i].used)
+		close(x->slot[i].fd), free(x->slot[i].fname);
+	uring_fini(&x->u);
+	free(x->stage);
+    }
+    // Children first, in case a directory is not writable.
+    for (unsigned i = x->ndir; i-- > 0; ) {
+	struct dir *d = &x->dirs[i];
+	if (!failed(x))
+	    fixdir(x, d);
+	free(d->path);
+    }
+    free(x->dirs);
+    if (x->dc.fd >= 0)
+	close(x->dc.fd);
+    pthread_mutex_destroy(&x->errmutex);
+    rpmcpio_addtime(cpio, x->write_ns, x->wait_ns);
+    // The error from the decoder, if any, is already there.
+    if (x->err[0] && !rpmcpio_strerror(cpio))
+	rpmcpio_seterr(cpio, "%s", x->err);
+    bool ok = !failed(x);
+    free(x);
+    return ok ? 0 : -1;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,298 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zstd.h>
+#include "gzindex.h"
+
+bool gzindex_add(struct gzindex *gx, unsigned long long in, unsigned bits,
+		 const void *win, unsigned wsize)
+{
+    if (gx->npt == gx->ptalloc) {
+	size_t alloc = gx->ptalloc ? 2 * gx->ptalloc : 64;
+	void *pt = realloc(gx->pt, alloc * sizeof *gx->pt);
+	if (!pt)
+	    return false;
+	gx->pt = pt, gx->ptalloc = alloc;
+    }
+    size_t bound = ZSTD_compressBound(wsize);
+    if (gx->bloballoc - gx->bloblen < bound) {
+	size_t alloc = 2 * gx->bloballoc + bound;
+	void *blob = realloc(gx->blob, alloc);
+	if (!blob)
+	    return false;
+	gx->blob = blob, gx->bloballoc = alloc;
+    }
+    size_t zsize = ZSTD_compress(gx->blob + gx->bloblen, bound, win, wsize,
+				 ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(zsize))
+	return errno = ENOMEM, false;
+    gx->pt[gx->npt++] = (struct gzpoint) {
+	gx->out, in, bits, wsize, gx->bloblen, zsize };
+    gx->bloblen += zsize;
+    gx->last = gx->out;
+    return true;
+}
+
+const struct gzpoint *gzindex_find(const struct gzindex *gx, unsigned long long out)
+{
+    // Binary search for the first checkpoint past out.
+    size_t lo = 0, hi = gx->npt;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (gx->pt[mid].out <= out)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo ? &gx->pt[lo - 1] : NULL;
+}
+
+bool gzindex_window(const struct gzindex *gx, const struct gzpoint *pt, void *buf)
+{
+    size_t ret = ZSTD_decompress(buf, 32 << 10, gx->blob + pt->zoff, pt->zsize);
+    return !ZSTD_isError(ret) && ret == pt->wsize;
+}
+
+// The file starts with the magic, followed by the fixed-size part of
+// struct gzindex.  Then come off[] and pt[], all integers little-endian,
+// and finally the compressed windows.
+static const char magic[8] = "rpmgzix3";
+struct filehdr {
+    char magic[8];
+    unsigned long long pkgsize, payload, size;
+    unsigned fileCount, npt;
+    unsigned long long bloblen;
+    unsigned char digest[16];
+};
+struct filept {
+    unsigned long long out, in;
+    unsigned bits_wsize; // bits << 16 | wsize
+    unsigned zsize;
+};
+
+static bool writen(int fd, const void *buf, size_t size)
+{
+    while (size) {
+	ssize_t ret = write(fd, buf, size);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	buf = (const char *) buf + ret;
+	size -= ret;
+    }
+    return true;
+}
+
+#define ERR(s) (*err = s, false)
+
+bool gzindex_save(const struct gzindex *gx, int dirfd, const char *fname, const char **err)
+{
+    size_t size = sizeof(struct filehdr) +
+		  gx->fileCount * sizeof(unsigned long long) +
+		  gx->npt * sizeof(struct filept) + gx->bloblen;
+    char *mem = malloc(size);
+    if (!mem)
+	return ERR("malloc failed");
+
+    struct filehdr *fh = (void *) mem;
+    memcpy(fh->magic, magic, sizeof magic);
+    fh->pkgsize = htole64(gx->pkgsize);
+    fh->payload = htole64(gx->payload);
+    fh->size = htole64(gx->out);
+    fh->fileCount = htole32(gx->fileCount);
+    fh->npt = htole32(gx->npt);
+    fh->bloblen = htole64(gx->bloblen);
+    memcpy(fh->digest, gx->digest, sizeof gx->digest);
+    unsigned long long *off = (void *) (fh + 1);
+    for (unsigned i = 0; i < gx->fileCount; i++)
+	off[i] = htole64(gx->off[i]);
+    struct filept *fp = (void *) (off + gx->fileCount);
+    for (size_t i = 0; i < gx->npt; i++) {
+	const struct gzpoint *pt = &gx->pt[i];
+	fp[i].out = htole64(pt->out);
+	fp[i].in = htole64(pt->in);
+	fp[i].bits_wsize = htole32(pt->bits << 16 | pt->wsize);
+	fp[i].zsize = htole32(pt->zsize);
+    }
+    memcpy(fp + gx->npt, gx->blob, gx->bloblen);
+
+    int fd = openat(dirfd, fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && writen(fd, mem, size);
+    if (fd >= 0) {
+	int saved_errno = errno;
+	if (close(fd) < 0 && ok)
+	    ok = false;
+	else
+	    errno = saved_errno;
+    }
+    free(mem);
+    *err = NULL;
+    return ok;
+}
+
+static int cmpoff(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return (x > y) - (x < y);
+}
+
+// The offsets of cpio entries must be 4-byte aligned (but for bit 0), within
+// the payload, and distinct.  They go in ascending order in the payload,
+// though not necessarily in header order, and so are checked sorted.
+static bool checkoff(const struct gzindex *gx, const char **err)
+{
+    unsigned long long *v = malloc(gx->fileCount * sizeof *v + 1);
+    if (!v)
+	return ERR("malloc failed");
+    size_t n = 0;
+    for (unsigned i = 0; i < gx->fileCount; i++) {
+	unsigned long long off = gx->off[i];
+	if (off == -1)
+	    continue;
+	if ((off & 2) || (off & ~1ULL) >= gx->out)
+	    return free(v), ERR("bad index offset");
+	v[n++] = off & ~1ULL;
+    }
+    qsort(v, n, sizeof *v, cmpoff);
+    for (size_t i = 1; i < n; i++)
+	if (v[i] == v[i-1])
+	    return free(v), ERR("bad index offset");
+    free(v);
+    return true;
+}
+
+bool gzindex_load(struct gzindex *gx, int dirfd, const char *fname, const char **err)
+{
+    memset(gx, 0, sizeof *gx);
+    *err = NULL;
+    int fd = openat(dirfd, fname, O_RDONLY);
+    if (fd < 0)
+	return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return false;
+    }
+    // Windows are 32K, compressed to at least a few bytes each.
+    if (st.st_size < (off_t) sizeof(struct filehdr) || st.st_size > (1LL << 36)) {
+	close(fd);
+	return ERR("bad index size");
+    }
+    size_t size = st.st_size;
+    char *mem = gx->mem = malloc(size);
+    if (!mem) {
+	close(fd);
+	return ERR("malloc failed");
+    }
+    size_t total = 0;
+    while (total < size) {
+	ssize_t ret = read(fd, mem + total, size - total);
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret <= 0) {
+	    int saved_errno = errno;
+	    close(fd);
+	    errno = saved_errno;
+	    return ret ? false : ERR("unexpected EOF");
+	}
+	total += ret;
+    }
+    close(fd);
+
+    struct filehdr *fh = (void *) mem;
+    if (memcmp(fh->magic, magic, sizeof magic))
+	return ERR("bad index magic");
+    gx->pkgsize = le64toh(fh->pkgsize);
+    gx->payload = le64toh(fh->payload);
+    gx->out = le64toh(fh->size);
+    gx->fileCount = le32toh(fh->fileCount);
+    gx->npt = le32toh(fh->npt);
+    gx->bloblen = le64toh(fh->bloblen);
+    memcpy(gx->digest, fh->digest, sizeof gx->digest);
+    // Each count is bounded by what is left of the file before it is used,
+    // so that crafted counts cannot wrap the sum.
+    size_t left = size - sizeof *fh;
+    if (gx->fileCount > left / 8)
+	return ERR("bad index size");
+    left -= gx->fileCount * 8ULL;
+    if (gx->npt > left / sizeof(struct filept))
+	return ERR("bad index size");
+    left -= gx->npt * sizeof(struct filept);
+    if (gx->bloblen != left)
+	return ERR("bad index size");
+
+    // Convert the integers in place.
+    unsigned long long *off = gx->off = (void *) (fh + 1);
+    for (unsigned i = 0; i < gx->fileCount; i++)
+	off[i] = le64toh(off[i]);
+    if (!checkoff(gx, err))
+	return false;
+    struct filept *fp = (void *) (off + gx->fileCount);
+    gx->pt = malloc(gx->npt * sizeof *gx->pt + 1);
+    if (!gx->pt)
+	return ERR("malloc failed");
+    gx->blob = (void *) (fp + gx->npt);
+    size_t zoff = 0;
+    for (size_t i = 0; i < gx->npt; i++) {
+	struct gzpoint *pt = &gx->pt[i];
+	pt->out = le64toh(fp[i].out);
+	pt->in = le64toh(fp[i].in);
+	unsigned bits_wsize = le32toh(fp[i].bits_wsize);
+	pt->bits = bits_wsize >> 16;
+	pt->wsize = bits_wsize & 0xffff;
+	pt->zoff = zoff;
+	pt->zsize = le32toh(fp[i].zsize);
+	zoff += pt->zsize;
+	// The checkpoints must lie within the payload, in ascending order,
+	// and the window cannot be bigger than the output so far.
+	if (pt->bits > 7 || pt->wsize > (32 << 10) || pt->wsize > pt->out ||
+		pt->out > gx->out || zoff > gx->bloblen ||
+		pt->in < gx->payload + (pt->bits > 0) || pt->in > gx->pkgsize ||
+		(i && (pt->out <= pt[-1].out || pt->in < pt[-1].in)))
+	    return ERR("bad index checkpoint");
+    }
+    if (zoff != gx->bloblen)
+	return ERR("bad index size");
+    return true;
+}
+
+void gzindex_free(struct gzindex *gx)
+{
+    // With gzindex_load, off[] and blob point into mem.
+    if (gx->mem)
+	free(gx->mem);
+    else {
+	free(gx->off);
+	free(gx->blob);
+    }
+    free(gx->pt);
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,88 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <stdbool.h>
+
+#pragma GCC visibility push(hidden)
+
+// Random access to gzip payloads.  While the payload is decompressed in full,
+// the state of inflate is recorded every so often, at the boundaries between
+// deflate blocks.  A checkpoint is the position in the compressed stream,
+// down to the bit, along with the last 32K of uncompressed data (the window,
+// which is needed to resolve back-references).  Decompression can then be
+// restarted at any checkpoint.  The index also maps the files to the offsets
+// of their cpio entries, and is saved to a sidecar file.
+struct gzindex {
+    // Identifies the package, to detect a stale index: the size of the file,
+    // the offset at which the payload starts, and a digest of the package
+    // (the MD5 of the header plus the payload from the signature header, or
+    // else the start of the payload digest; all zeroes with neither).
+    unsigned long long pkgsize, payload;
+    unsigned char digest[16];
+    // Offsets of cpio entries in the uncompressed payload, per ffi[] entry,
+    // -1 for the files which are not in cpio (%ghost files).  The offsets
+    // are 4-byte aligned, and bit 0 is set for the entries which come
+    // without data (all but the last file in a hardlink set).
+    unsigned fileCount;
+    unsigned long long *off;
+    // Checkpoints, in ascending order.
+    struct gzpoint {
+	// The offset in the uncompressed payload.
+	unsigned long long out;
+	// The offset in the file of the first byte not consumed by inflate;
+	// with bits > 0, the lowest bits of the previous byte are to be
+	// decoded first.
+	unsigned long long in;
+	unsigned bits;
+	// The window, of wsize bytes, zstd-compressed into blob[zoff].
+	unsigned wsize;
+	size_t zoff, zsize;
+    } *pt;
+    size_t npt;
+    char *blob;
+    size_t bloblen;
+    // While building the index: the minimum distance between checkpoints,
+    // the number of bytes decompressed so far (then saved as the size of
+    // the payload, which bounds the offsets), and the last checkpoint.
+    unsigned long long span, out, last;
+    size_t ptalloc, bloballoc;
+    // The chunk with the data loaded by gzindex_load.
+    void *mem;
+};
+
+// Records a checkpoint.  Returns false with errno set on failure.
+bool gzindex_add(struct gzindex *gx, unsigned long long in, unsigned bits,
+		 const void *win, unsigned wsize);
+
+// The last checkpoint at or before the given offset, NULL if none.
+const struct gzpoint *gzindex_find(const struct gzindex *gx, unsigned long long out);
+
+// Decompress the checkpoint's window into buf, which must be 32K.
+bool gzindex_window(const struct gzindex *gx, const struct gzpoint *pt, void *buf);
+
+// Write the index to a file, or load the index from a file.  On failure,
+// *err is set to the error message, or else to NULL, with errno set.
+bool gzindex_save(const struct gzindex *gx, int dirfd, const char *fname, const char **err);
+bool gzindex_load(struct gzindex *gx, int dirfd, const char *fname, const char **err);
+
+void gzindex_free(struct gzindex *gx);
+
+#pragma GCC visibility pop
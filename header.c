@@ -21,18 +21,53 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <arpa/inet.h>
 #include <endian.h>
 #include <sys/stat.h>
 #include "reada.h"
+#include "input.h"
 #include "qsort.h"
 #include "header.h"
 
 #define ERR(s) (*err = s, false)
 
-bool header_read(struct header *h, struct fda *fda, const char **err)
+// Make sure that a chunk retained across header_read calls is big enough.
+// The old contents is not preserved.
+static void *grow(void *p, size_t *allocp, size_t size)
 {
+    if (size > *allocp) {
+	free(p);
+	p = malloc(size);
+	*allocp = p ? size : 0;
+    }
+    return p;
+}
+
+// Unpack n bytes from 2n hex digits.
+static bool unhex(const char *s, unsigned char *d, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+	unsigned char b = 0;
+	for (int j = 0; j < 2; j++) {
+	    char c = *s++;
+	    if (c >= '0' && c <= '9')
+		b = b << 4 | (c - '0');
+	    else if (c >= 'a' && c <= 'f')
+		b = b << 4 | (c - 'a' + 10);
+	    else
+		return false;
+	}
+	d[i] = b;
+    }
+    return true;
+}
+
+bool header_read(struct header *h, struct input *in, unsigned flags, const char **err)
+{
+    bool loadfx = flags & HEADER_LOADFX;
+    bool digests = flags & HEADER_DIGESTS;
     struct rpmlead {
 	unsigned char magic[4];
 	unsigned char major;
@@ -44,7 +79,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	short signature_type;
 	char reserved[16];
     } lead;
-    if (reada(fda, &lead, sizeof lead) != sizeof lead)
+    if (inread(in, &lead, sizeof lead) != sizeof lead)
 	return ERR("cannot read rpmlead");
     const unsigned char lmag[4] = { 0xed, 0xab, 0xee, 0xdb };
     if (memcmp(lead.magic, lmag, 4))
@@ -65,7 +100,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	return ERR("old rpmlead signature not supported");
 
     struct { unsigned mag[2], il, dl; } hdr;
-    if (reada(fda, &hdr, sizeof hdr) != sizeof hdr)
+    if (inread(in, &hdr, sizeof hdr) != sizeof hdr)
 	return ERR("cannot read sig header");
     const unsigned char hmag[8] = { 0x8e, 0xad, 0xe8, 0x01, 0x00, 0x00, 0x00, 0x00 };
     if (memcmp(&hdr.mag, hmag, 8))
@@ -74,11 +109,59 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
     hdr.dl = ntohl(hdr.dl);
     if (hdr.il > 32 || hdr.dl > (64<<10)) // like hdrblobRead
 	return ERR("bad sig header size");
-    size_t sigsize = 16 * hdr.il + ((hdr.dl + 7) & ~7);
-    if (sigsize && skipa(fda, sigsize) != sigsize)
-	return ERR("cannot read sig header");
+#define RPMSIGTAG_SIZE            1000
+#define RPMSIGTAG_MD5             1004
+#define RPMSIGTAG_PAYLOADSIZE     1007
+#define RPMSIGTAG_LONGSIZE         270
+#define RPMSIGTAG_LONGARCHIVESIZE  271
 
-    if (reada(fda, &hdr, sizeof hdr) != sizeof hdr)
+    // The signature header is only looked at for the sizes: of the header
+    // plus the compressed payload, and of the uncompressed payload; and for
+    // the MD5 of the header plus the compressed payload.
+    unsigned long long sigsize = 0;
+    h->archivesize = 0;
+    h->hdrmd5 = false;
+    size_t sigbytes = 16 * hdr.il + ((hdr.dl + 7) & ~7);
+    if (sigbytes) {
+	unsigned char *sig = h->tmp = grow(h->tmp, &h->tmpalloc, sigbytes);
+	if (!sig)
+	    return ERR("malloc failed");
+	if (inread(in, sig, sigbytes) != sigbytes)
+	    return ERR("cannot read sig header");
+	const unsigned char *data = sig + 16 * hdr.il;
+	for (unsigned i = 0; i < hdr.il; i++) {
+	    struct { unsigned tag, type, off, cnt; } e;
+	    memcpy(&e, sig + 16 * i, 16);
+	    unsigned tag = ntohl(e.tag), type = ntohl(e.type), off = ntohl(e.off);
+	    unsigned long long val;
+	    if (tag == RPMSIGTAG_MD5) {
+		if (type == RPM_BIN_TYPE && ntohl(e.cnt) == 16 &&
+			off <= hdr.dl - 16 && hdr.dl >= 16) {
+		    memcpy(h->md5, data + off, 16);
+		    h->hdrmd5 = true;
+		}
+		continue;
+	    }
+	    if (type == RPM_INT32_TYPE && off <= hdr.dl - 4 && hdr.dl >= 4) {
+		unsigned v;
+		memcpy(&v, data + off, 4);
+		val = ntohl(v);
+	    }
+	    else if (type == RPM_INT64_TYPE && off <= hdr.dl - 8 && hdr.dl >= 8) {
+		memcpy(&val, data + off, 8);
+		val = be64toh(val);
+	    }
+	    else
+		continue;
+	    if (tag == RPMSIGTAG_SIZE || tag == RPMSIGTAG_LONGSIZE)
+		sigsize = val;
+	    else if (tag == RPMSIGTAG_PAYLOADSIZE || tag == RPMSIGTAG_LONGARCHIVESIZE)
+		h->archivesize = val;
+	}
+    }
+
+    h->hdrpos = in->pos;
+    if (inread(in, &hdr, sizeof hdr) != sizeof hdr)
 	return ERR("cannot read pkg header");
     if (memcmp(&hdr.mag, hmag, 8))
 	return ERR("bad pkg header magic");
@@ -86,17 +169,35 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
     hdr.dl = ntohl(hdr.dl);
     if (hdr.il > (64<<10) || hdr.dl > (256<<20))
 	return ERR("bad pkg header size");
+    // The sig header's size minus the size of the pkg header.
+    unsigned long long hdrbytes = h->hdrsize = 16 + 16 * hdr.il + hdr.dl;
+    h->payloadsize = sigsize > hdrbytes ? sigsize - hdrbytes : 0;
 
-#define RPM_INT16_TYPE        3
-#define RPM_INT32_TYPE        4
-#define RPM_INT64_TYPE        5
-#define RPM_STRING_TYPE       6
-#define RPM_STRING_ARRAY_TYPE 8
+    // The tags decoded for the previous package are gone.
+    for (unsigned i = 0; i < h->ntag; i++)
+	free(h->tags[i].data);
+    h->ntag = 0;
+    h->il = h->dl = 0;
+    // To be retained, the index and the data store are read in one go,
+    // and then parsed from memory.
+    struct input mem;
+    if (flags & HEADER_RETAIN) {
+	size_t size = 16 * hdr.il + hdr.dl;
+	h->blob = grow(h->blob, &h->bloballoc, size);
+	if (!h->blob)
+	    return ERR("malloc failed");
+	if (inread(in, h->blob, size) != size)
+	    return ERR("cannot read pkg header");
+	mem = (struct input) { NULL, h->blob, (char *) h->blob + size };
+	in = &mem;
+	h->il = hdr.il, h->dl = hdr.dl;
+    }
 
 #define RPMTAG_OLDFILENAMES      1027
 #define RPMTAG_FILESIZES         1028
 #define RPMTAG_FILEMODES         1030
 #define RPMTAG_FILEMTIMES        1034
+#define RPMTAG_FILEDIGESTS       1035
 #define RPMTAG_FILEFLAGS         1037
 #define RPMTAG_SOURCERPM         1044
 #define RPMTAG_FILEINODES        1096
@@ -105,6 +206,9 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 #define RPMTAG_DIRNAMES          1118
 #define RPMTAG_PAYLOADCOMPRESSOR 1125
 #define RPMTAG_LONGFILESIZES     5008
+#define RPMTAG_FILEDIGESTALGO    5011
+#define RPMTAG_PAYLOADDIGEST     5092
+#define RPMTAG_PAYLOADDIGESTALGO 5093
 
     // The tags that we need will be placed in a tightly-packed table.
     // If a tag exists and its table entry is filled, cnt must be non-zero.
@@ -114,6 +218,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	struct tabent filesizes;
 	struct tabent filemodes;
 	struct tabent filemtimes;
+	struct tabent filedigests;
 	struct tabent fileflags;
 	struct tabent sourcerpm;
 	struct tabent fileinodes;
@@ -122,6 +227,9 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	struct tabent dirnames;
 	struct tabent payloadcompressor;
 	struct tabent longfilesizes;
+	struct tabent filedigestalgo;
+	struct tabent payloaddigest;
+	struct tabent payloaddigestalgo;
 	// Non-existent tag with maximum value, to facilitate the merge-like algorithm.
 	struct tabent nil;
     } tab = {
@@ -129,6 +237,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	.filesizes         = { RPMTAG_FILESIZES, RPM_INT32_TYPE },
 	.filemodes         = { RPMTAG_FILEMODES, RPM_INT16_TYPE },
 	.filemtimes        = { RPMTAG_FILEMTIMES, RPM_INT32_TYPE },
+	.filedigests       = { RPMTAG_FILEDIGESTS, RPM_STRING_ARRAY_TYPE },
 	.fileflags         = { RPMTAG_FILEFLAGS, RPM_INT32_TYPE },
 	.sourcerpm         = { RPMTAG_SOURCERPM, RPM_STRING_TYPE },
 	.fileinodes        = { RPMTAG_FILEINODES, RPM_INT32_TYPE },
@@ -137,6 +246,9 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	.dirnames          = { RPMTAG_DIRNAMES, RPM_STRING_ARRAY_TYPE },
 	.payloadcompressor = { RPMTAG_PAYLOADCOMPRESSOR, RPM_STRING_TYPE },
 	.longfilesizes     = { RPMTAG_LONGFILESIZES, RPM_INT64_TYPE },
+	.filedigestalgo    = { RPMTAG_FILEDIGESTALGO, RPM_INT32_TYPE },
+	.payloaddigest     = { RPMTAG_PAYLOADDIGEST, RPM_STRING_ARRAY_TYPE },
+	.payloaddigestalgo = { RPMTAG_PAYLOADDIGESTALGO, RPM_INT32_TYPE },
 	.nil               = { -1, -1 }
     };
 
@@ -146,7 +258,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
     unsigned lasttag = 0, lastoff = 0;
     for (unsigned i = 0; i < hdr.il; i++) {
 	struct { unsigned tag, type, off, cnt; } e;
-	if (reada(fda, &e, sizeof e) != sizeof e)
+	if (inread(in, &e, sizeof e) != sizeof e)
 	    return ERR("cannot read pkg header");
 	unsigned tag = ntohl(e.tag);
 	unsigned off = ntohl(e.off);
@@ -202,7 +314,10 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 
     // File info, to be malloc'd.
     struct fi *ffi = NULL;
-    struct fx *ffx = NULL;
+    struct fx *ffx = h->ffx = NULL;
+    // With LONGFILESIZES, the cpio entries are stripped down.
+    h->longfile.sizes = tab.longfilesizes.cnt;
+    h->digestlen = 0;
     // We further need some temporary space.
     void *tmp = NULL;
 
@@ -218,10 +333,22 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
     if (tab.longfilesizes.cnt) {
 	if (tab.longfilesizes.cnt != fileCount || tab.filesizes.cnt)
 	    return ERR("bad longfilesizes");
+	loadfx = true;
+    }
+    // Otherwise, the sizes can be loaded on demand, from FILESIZES.
+    else if (loadfx && tab.filesizes.cnt != fileCount)
+	return ERR("bad filesizes");
+    if (loadfx) {
 	if (tab.filemtimes.cnt != fileCount)
 	    return ERR("bad filemtimes");
+	if (tab.fileinodes.cnt != fileCount)
+	    return ERR("bad fileinodes");
     }
 
+    // File digests are optional, even if asked for.
+    if (digests && tab.filedigests.cnt && tab.filedigests.cnt != fileCount)
+	return ERR("bad filedigests");
+
     // Either OLDFILENAMES or BASENAMES+DIRNAMES+DIRINDEXES.
     if (tab.oldfilenames.cnt) {
 	if (tab.oldfilenames.cnt != fileCount || tab.basenames.cnt)
@@ -251,7 +378,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	return ERR("bad file count");
     // Allocate ffi + ffx + strtab in a single chunk.
     size_t alloc = fileCount * sizeof(*ffi);
-    if (tab.longfilesizes.cnt)
+    if (loadfx)
 	alloc += fileCount * sizeof(*ffx);
 #define tabSize(x) (tab.x.nextoff - tab.x.off)
     if (tab.oldfilenames.cnt)
@@ -260,19 +387,16 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	alloc += tabSize(basenames);
     if (LoadDirs)
 	alloc += tabSize(dirnames);
-    ffi = h->ffi = malloc(alloc + /* strtab[0] */ 1);
+    ffi = h->ffi = grow(h->ffi, &h->ffialloc, alloc + /* strtab[0] */ 1);
     if (!ffi)
 	return ERR("malloc failed");
-    if (tab.longfilesizes.cnt) {
+    if (loadfx) {
 	ffx = h->ffx = (void *) (ffi + fileCount);
 	h->strtab = (void *) (ffx + fileCount);
     }
     else
 	h->strtab = (void *) (ffi + fileCount);
 
-#undef ERR
-#define ERR(s) (free(ffi), *err = s, false)
-
     // Temporary space, to load arrays with a single reada call.
     alloc = fileCount * 4;
     // ffx additionally neeeds (ino,at) + ino sentinel.
@@ -281,13 +405,13 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
     // otherwise dirname unpacking needs two integers per dir.
     else if (LoadDirs && alloc < tab.dirnames.cnt * 8)
 	alloc = tab.dirnames.cnt * 8;
-    tmp = malloc(alloc);
+    // Hex digests are loaded in one go.
+    if (digests && tab.filedigests.cnt && alloc < tabSize(filedigests))
+	alloc = tabSize(filedigests);
+    tmp = h->tmp = grow(h->tmp, &h->tmpalloc, alloc);
     if (!tmp)
 	return ERR("malloc failed");
 
-#undef ERR
-#define ERR(s) (free(ffi), free(tmp), *err = s, false)
-
     // Gonna fill the strtab with basenames and dirnames.
     char *strpos = h->strtab;
     // Zero offset reserved for null / empty string.
@@ -299,7 +423,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
     do {						\
 	assert(off >= doff);				\
 	unsigned skip = off - doff;			\
-	if (skip && skipa(fda, skip) != skip)		\
+	if (skip && inskip(in, skip) != skip)		\
 	    return ERR("cannot read header data");	\
 	doff += skip;					\
     } while (0)
@@ -309,7 +433,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	size_t takeBytes = cnt * sizeof *a;		\
 	if (te->nextoff - te->off < takeBytes)		\
 	    return ERR("bad " s);			\
-	if (reada(fda, a, takeBytes) != takeBytes)	\
+	if (inread(in, a, takeBytes) != takeBytes)	\
 	    return ERR("cannot read header data");	\
 	doff += takeBytes;				\
     } while (0)
@@ -318,7 +442,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 #define TakeS(te)					\
     do {						\
 	unsigned size = te->nextoff - te->off;		\
-	if (reada(fda, strpos, size) != size)		\
+	if (inread(in, strpos, size) != size)		\
 	    return ERR("cannot read header data");	\
 	doff += size;					\
 	strend = strpos + size;				\
@@ -344,6 +468,15 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	}
     }
 
+    te = &tab.filesizes;
+    if (ffx && te->cnt) {
+	SkipTo(te->off);
+	unsigned *fsizes = tmp;
+	TakeArray(te, fsizes, fileCount, "filesizes");
+	for (unsigned i = 0; i < fileCount; i++)
+	    ffx[i].size = ntohl(fsizes[i]);
+    }
+
     te = &tab.filemodes;
     SkipTo(te->off);
     unsigned short *fmodes = tmp;
@@ -353,6 +486,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	// As filemodes is the first field we load unconditionally,
 	// initialize some other fields that need to be initialized.
 	ffi[i].seen = false;
+	ffi[i].skip = false;
     }
 
     if (ffx) {
@@ -364,6 +498,45 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	    ffx[i].mtime = ntohl(fmtimes[i]);
     }
 
+    // The digests are unpacked from hex, all zeroes standing for no digest
+    // (e.g. with directories).  The length is deduced from the first one,
+    // to be checked against FILEDIGESTALGO.
+    te = &tab.filedigests;
+    if (digests && te->cnt) {
+	SkipTo(te->off);
+	unsigned size = te->nextoff - te->off;
+	char *p = tmp, *end = p + size;
+	if (inread(in, p, size) != size)
+	    return ERR("cannot read header data");
+	doff += size;
+	if (end[-1] != '\0')
+	    return ERR("malformed string tag");
+	unsigned dlen = 0;
+	for (unsigned i = 0; i < fileCount; i++) {
+	    if (p == end)
+		return ERR("bad filedigests");
+	    size_t len = strlen(p);
+	    if (len && !dlen) {
+		if (len % 2 || len < 32 || len > 128)
+		    return ERR("bad filedigests");
+		dlen = len / 2;
+		h->digests = grow(h->digests, &h->dgalloc, fileCount * dlen);
+		if (!h->digests)
+		    return ERR("malloc failed");
+		memset(h->digests, 0, i * dlen);
+	    }
+	    if (dlen) {
+		unsigned char *d = h->digests + i * dlen;
+		if (len == 0)
+		    memset(d, 0, dlen);
+		else if (len != 2 * dlen || !unhex(p, d, dlen))
+		    return ERR("bad filedigests");
+	    }
+	    p += len + 1;
+	}
+	h->digestlen = dlen;
+    }
+
     te = &tab.fileflags;
     SkipTo(te->off);
     unsigned *fflags = tmp;
@@ -508,7 +681,7 @@ bool header_read(struct header *h, struct fda *fda, const char **err)
 	unsigned size = te->nextoff - te->off;		\
 	if (size > sizeof buf)				\
 	    return ERR(s " too long");			\
-	if (reada(fda, buf, size) != size)		\
+	if (inread(in, buf, size) != size)		\
 	    return ERR("cannot read header data");	\
 	doff += size;					\
 	if (buf[size-1] != '\0')			\
@@ -526,7 +699,7 @@ compressor:
     else
 	memcpy(h->zprog, "gzip", sizeof "gzip");
 
-    if (ffx) {
+    if (tab.longfilesizes.cnt) {
 	te = &tab.longfilesizes;
 	SkipTo(te->off);
 	unsigned long long *longfsizes = tmp;
@@ -539,17 +712,77 @@ compressor:
 	}
     }
 
+    // MD5 unless specified otherwise.
+    h->digestalgo = 1;
+    if (tab.filedigestalgo.cnt) {
+	te = &tab.filedigestalgo;
+	SkipTo(te->off);
+	unsigned algo[1];
+	TakeArray(te, algo, 1, "filedigestalgo");
+	h->digestalgo = ntohl(algo[0]);
+    }
+    if (h->digestlen) {
+	static const unsigned char len[] = {
+	    [1] = 16, [2] = 20, [8] = 32, [9] = 48, [10] = 64, [11] = 28,
+	};
+	if (h->digestalgo < sizeof len && len[h->digestalgo] &&
+		len[h->digestalgo] != h->digestlen)
+	    return ERR("filedigests do not match filedigestalgo");
+    }
+
+    // The digest of the compressed payload, normally SHA256, is a single
+    // string in a string array.
+    h->paydigestlen = 0;
+    h->paydigestalgo = 8;
+    te = &tab.payloaddigest;
+    if (te->cnt) {
+	SkipTo(te->off);
+	char hex[129];
+	TakeSB(te, hex, "payloaddigest");
+	size_t len = strlen(hex);
+	if (te->cnt != 1 || len % 2 || len < 32 || !unhex(hex, h->paydigest, len / 2))
+	    return ERR("bad payloaddigest");
+	h->paydigestlen = len / 2;
+    }
+    te = &tab.payloaddigestalgo;
+    if (te->cnt) {
+	SkipTo(te->off);
+	unsigned algo[1];
+	TakeArray(te, algo, 1, "payloaddigestalgo");
+	h->paydigestalgo = ntohl(algo[0]);
+    }
+
     SkipTo(hdr.dl);
-    free(tmp);
 
     h->prevFound = -1;
+    h->hmask = 0;
+    h->nguess = h->nsearch = h->nhash = h->nstep = 0;
     return true;
 }
 
+void header_init(struct header *h)
+{
+    h->ffi = NULL;
+    h->tmp = NULL;
+    h->htab = NULL;
+    h->digests = NULL;
+    h->blob = NULL;
+    h->tags = NULL;
+    h->il = h->dl = h->ntag = 0;
+    h->ffialloc = h->tmpalloc = h->halloc = h->dgalloc = 0;
+    h->bloballoc = h->tagalloc = 0;
+}
+
 void header_freedata(struct header *h)
 {
-    if (h->fileCount)
-	free(h->ffi);
+    free(h->ffi);
+    free(h->tmp);
+    free(h->htab);
+    free(h->digests);
+    free(h->blob);
+    for (unsigned i = 0; i < h->ntag; i++)
+	free(h->tags[i].data);
+    free(h->tags);
 }
 
 // Compare two strings whose lengths are known.
@@ -566,32 +799,21 @@ static inline int strlencmp(const char *s1, size_t len1, const char *s2, size_t
     return cmp + (cmp == 0);
 }
 
-unsigned header_find(struct header *h, const char *fname, size_t flen)
+// The binary search, the first iteration examines ffi[at].
+static unsigned search(struct header *h, const char *fname, size_t flen, size_t at)
 {
     // Initialize the binary search range.
     size_t lo = 0, hi = h->fileCount;
 
-    // Direct the first iteration of the binary search loop to examine
-    // the element following the previously found one, rather than the
-    // middle element.  Since filenames in the payload are mostly sorted
-    // (the exception being hardlinks), we expect the immediate hit.
-    size_t at = ++h->prevFound;
-    if (at >= h->fileCount) {
-	if (h->fileCount == 0)
-	    return -1;
-	at = (lo + hi) / 2;
-    }
-
     // If no dirnames need to be considered, run a much simplified version
     // of the binary search loop (which also delivers better performance).
     if (h->src.rpm || h->old.fnames)
     while (1) {
 	struct fi *fi = &h->ffi[at];
+	h->nstep++;
 	int cmp = strlencmp(fname, flen, h->strtab + fi->bn, fi->blen);
-	if (cmp == 0) {
-	    h->prevFound = at;
+	if (cmp == 0)
 	    return at;
-	}
 	if (cmp < 0)
 	    hi = at;
 	else
@@ -616,6 +838,7 @@ unsigned header_find(struct header *h, const char *fname, size_t flen)
 
     while (1) {
 	struct fi *fi = &h->ffi[at];
+	h->nstep++;
 	int cmp;
 	if (dlen == fi->dlen) {
 	    if (fi->dn != lastdn) {
@@ -627,10 +850,8 @@ unsigned header_find(struct header *h, const char *fname, size_t flen)
 		// If dirnames are equal, proceed with basenames.  This is
 		// the only case where both basenames need to be compared.
 		cmp = strlencmp(bn, blen, h->strtab + fi->bn, fi->blen);
-		if (cmp == 0) {
-		    h->prevFound = at;
+		if (cmp == 0)
 		    return at;
-		}
 	    }
 	}
 	else if (dlen < fi->dlen) {
@@ -673,3 +894,234 @@ unsigned header_find(struct header *h, const char *fname, size_t flen)
 	at = (lo + hi) / 2;
     }
 }
+
+// FNV-1a, which can be run over a filename in parts, the dirname and then
+// the basename.
+#define FNV_INIT 2166136261U
+static inline unsigned fnv(unsigned hash, const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+	hash = (hash ^ (unsigned char) s[i]) * 16777619;
+    return hash;
+}
+
+// Check if ffi[at] is fname, the file in question.
+static inline bool match(struct header *h, unsigned at, const char *fname, size_t flen)
+{
+    struct fi *fi = &h->ffi[at];
+    if (h->src.rpm || h->old.fnames)
+	return fi->blen == flen && memcmp(fname, h->strtab + fi->bn, flen) == 0;
+    return fi->dlen + fi->blen == flen &&
+	   memcmp(fname, h->strtab + fi->dn, fi->dlen) == 0 &&
+	   memcmp(fname + fi->dlen, h->strtab + fi->bn, fi->blen) == 0;
+}
+
+// Build the hash table, with at least twice as many slots as there are
+// files.  Returns false if out of memory.
+static bool hbuild(struct header *h)
+{
+    unsigned nslot = 64;
+    while (nslot < 2 * h->fileCount)
+	nslot *= 2;
+    struct hent *htab = h->htab = grow(h->htab, &h->halloc, nslot * sizeof *htab);
+    if (!htab)
+	return false;
+    memset(htab, 0xff, nslot * sizeof *htab);
+    unsigned hmask = nslot - 1;
+    bool dirs = !(h->src.rpm || h->old.fnames);
+    // The files are sorted by dirname, which is only hashed once.
+    unsigned lastdn = -1, dhash = FNV_INIT;
+    for (unsigned i = 0; i < h->fileCount; i++) {
+	struct fi *fi = &h->ffi[i];
+	if (dirs && fi->dn != lastdn) {
+	    dhash = fnv(FNV_INIT, h->strtab + fi->dn, fi->dlen);
+	    lastdn = fi->dn;
+	}
+	unsigned hash = fnv(dhash, h->strtab + fi->bn, fi->blen);
+	unsigned j = hash & hmask;
+	// Linear probing; with duplicate filenames, the first one is found.
+	while (htab[j].ix != -1)
+	    j = (j + 1) & hmask;
+	htab[j] = (struct hent) { hash, i };
+    }
+    h->hmask = hmask;
+    return true;
+}
+
+static unsigned hfind(struct header *h, const char *fname, size_t flen)
+{
+    unsigned hash = fnv(FNV_INIT, fname, flen);
+    for (unsigned j = hash & h->hmask; ; j = (j + 1) & h->hmask) {
+	struct hent *he = &h->htab[j];
+	if (he->ix == -1)
+	    return -1;
+	if (he->hash == hash && match(h, he->ix, fname, flen))
+	    return he->ix;
+    }
+}
+
+unsigned header_find(struct header *h, const char *fname, size_t flen)
+{
+    if (h->fileCount == 0)
+	return -1;
+    // Try the element following the previously found one first.  Since
+    // filenames in the payload are mostly sorted (the exception being
+    // hardlinks), we expect the immediate hit.
+    unsigned at, guess = h->prevFound + 1;
+    if (h->hmask) {
+	if (guess < h->fileCount && match(h, guess, fname, flen))
+	    at = guess;
+	else
+	    at = hfind(h, fname, flen), h->nhash++;
+    }
+    else {
+	// The binary search starts with the guess, or else in the middle.
+	unsigned long long nstep = h->nstep;
+	at = search(h, fname, flen, guess < h->fileCount ? guess : h->fileCount / 2);
+	// The first iteration hit the guess, there was no search.
+	if (at == guess)
+	    h->nstep = nstep;
+	else {
+	    h->nsearch++;
+	    // Switch to the hash table, once the binary searches have cost
+	    // about as much as building the table would.  Should the malloc
+	    // fail, try again 8 misses later.
+	    if (h->nsearch >= 8 && h->nsearch % 8 == 0 &&
+		    h->nsearch * 8 >= h->fileCount)
+		hbuild(h);
+	}
+    }
+    if (at == guess)
+	h->nguess++;
+    if (at != -1)
+	h->prevFound = at;
+    return at;
+}
+
+// The string types are interchangeable, e.g. SUMMARY is I18NSTRING, but
+// can be requested as a STRING_ARRAY.
+static inline unsigned tclass(unsigned type)
+{
+    if (type == RPM_STRING_TYPE || type == RPM_I18NSTRING_TYPE)
+	return RPM_STRING_ARRAY_TYPE;
+    return type;
+}
+
+// Decode the tag's data from the retained header into a malloc'd chunk.
+static void *decode(struct header *h, unsigned type, unsigned cnt, unsigned off,
+		    const char **err)
+{
+    const char *data = (const char *) h->blob + 16 * h->il;
+    if (off >= h->dl)
+	return *err = "bad tag offset", NULL;
+    const char *p = data + off, *end = data + h->dl;
+    size_t left = end - p;
+    if ((type >= RPM_CHAR_TYPE && type <= RPM_INT64_TYPE) || type == RPM_BIN_TYPE) {
+	size_t isize = type >= RPM_INT16_TYPE && type <= RPM_INT64_TYPE ?
+		       1 << (type - RPM_INT16_TYPE + 1) : 1;
+	if (cnt > left / isize)
+	    return *err = "bad tag count", NULL;
+	void *v = malloc(cnt * isize);
+	if (!v)
+	    return *err = "malloc failed", NULL;
+	memcpy(v, p, cnt * isize);
+	unsigned short *v16 = v;
+	unsigned *v32 = v;
+	unsigned long long *v64 = v;
+	if (type == RPM_INT16_TYPE)
+	    for (unsigned i = 0; i < cnt; i++)
+		v16[i] = ntohs(v16[i]);
+	else if (type == RPM_INT32_TYPE)
+	    for (unsigned i = 0; i < cnt; i++)
+		v32[i] = ntohl(v32[i]);
+	else if (type == RPM_INT64_TYPE)
+	    for (unsigned i = 0; i < cnt; i++)
+		v64[i] = be64toh(v64[i]);
+	return v;
+    }
+    if (tclass(type) != RPM_STRING_ARRAY_TYPE)
+	return *err = "unknown tag type", NULL;
+    if ((type == RPM_STRING_TYPE && cnt != 1) || cnt > left)
+	return *err = "bad tag count", NULL;
+    // The strings stay in the blob, only the pointers are malloc'd.
+    const char **v = malloc(cnt * sizeof *v);
+    if (!v)
+	return *err = "malloc failed", NULL;
+    for (unsigned i = 0; i < cnt; i++) {
+	const char *z = memchr(p, '\0', end - p);
+	if (!z)
+	    return free(v), *err = "malformed string tag", NULL;
+	v[i] = p;
+	p = z + 1;
+    }
+    return v;
+}
+
+// An entry in the retained header's index, in host byte order.
+struct ientry { unsigned tag, type, off, cnt; };
+
+// Binary search in the index, which is sorted by tag.
+static bool lookup(struct header *h, unsigned tag, struct ientry *e)
+{
+    const unsigned char *index = h->blob;
+    unsigned lo = 0, hi = h->il;
+    while (lo < hi) {
+	unsigned mid = lo + (hi - lo) / 2;
+	memcpy(e, index + 16 * mid, 16);
+	unsigned etag = ntohl(e->tag);
+	if (etag < tag)
+	    lo = mid + 1;
+	else if (etag > tag)
+	    hi = mid;
+	else {
+	    e->tag = etag;
+	    e->type = ntohl(e->type);
+	    e->off = ntohl(e->off);
+	    e->cnt = ntohl(e->cnt);
+	    return true;
+	}
+    }
+    return false;
+}
+
+void *header_tag(struct header *h, unsigned tag, unsigned type, unsigned *cnt,
+		 const char **err)
+{
+    *cnt = 0, *err = NULL;
+    for (unsigned i = 0; i < h->ntag; i++) {
+	struct htag *t = &h->tags[i];
+	if (t->tag != tag)
+	    continue;
+	if (tclass(t->type) != tclass(type))
+	    return *err = "bad tag type", NULL;
+	*cnt = t->cnt;
+	return t->data;
+    }
+    struct ientry e;
+    if (!lookup(h, tag, &e))
+	return NULL;
+    if (tclass(e.type) != tclass(type))
+	return *err = "bad tag type", NULL;
+    if (e.cnt == 0)
+	return *err = "zero tag count", NULL;
+    // Make room in the cache first, so that the data is not lost.
+    if (h->ntag * sizeof *h->tags == h->tagalloc) {
+	size_t alloc = h->tagalloc ? 2 * h->tagalloc : 8 * sizeof *h->tags;
+	void *p = realloc(h->tags, alloc);
+	if (!p)
+	    return *err = "malloc failed", NULL;
+	h->tags = p, h->tagalloc = alloc;
+    }
+    void *data = decode(h, e.type, e.cnt, e.off, err);
+    if (!data)
+	return NULL;
+    h->tags[h->ntag++] = (struct htag) { tag, e.type, e.cnt, data };
+    *cnt = e.cnt;
+    return data;
+}
+
+unsigned header_tagtype(struct header *h, unsigned tag)
+{
+    struct ientry e;
+    return lookup(h, tag, &e) ? e.type : 0;
+}
@@ -34,9 +34,10 @@ struct header {
 	unsigned fflags;
 	unsigned short mode;
 	bool seen;
-	bool pad;
+	bool skip; // not selected by the caller
     } *ffi;
     // Additional info for large files / excluded cpio entries.
+    // Also loaded for other packages with header_read(loadfx=true).
     struct fx {
 	unsigned ino;
 	unsigned mtime;
@@ -49,20 +50,94 @@ struct header {
     unsigned fileCount;
     // Speeds up header_find().
     unsigned prevFound;
+    // When the payload order diverges from the header, e.g. with hardlinks
+    // or packages built by old rpm, the guess keeps missing, and header_find
+    // falls back to binary search.  After enough misses, it builds a hash
+    // table over the filenames (hmask != 0), and uses it instead.
+    struct hent { unsigned hash, ix; } *htab;
+    unsigned hmask;
+    // header_find counters: the guess was right / binary search / hash
+    // table lookups, and binary search iterations.  Reset by header_read.
+    unsigned nguess, nsearch, nhash;
+    unsigned long long nstep;
     // Flags, spelled in a funny way.
     union { bool rpm; } src;
     union { bool fnames; } old;
+    // With LONGFILESIZES, cpio entries are stripped (07070X),
+    // and ffx[] is always loaded.
+    union { bool sizes; } longfile;
     // The payload compressor.
     char zprog[14];
+    // With header_read(digests=true), the file digests, digestlen bytes per
+    // file (all zeroes if the file has none), and the algorithm, PGPHASHALGO_*
+    // (1 = MD5, 8 = SHA256, etc.).  digestlen=0 if the package has none.
+    unsigned char *digests;
+    unsigned digestalgo, digestlen;
+    // The sizes of the compressed payload and of the cpio archive,
+    // according to the signature header, 0 if unknown.
+    unsigned long long payloadsize, archivesize;
+    // The digest of the compressed payload from the header, paydigestlen
+    // bytes (0 if none), PGPHASHALGO_* as with the file digests.  With old
+    // packages, there is only the MD5 of the header plus the compressed
+    // payload, from the signature header (hdrmd5 is set if it is there);
+    // the header spans hdrsize bytes at the offset hdrpos.
+    unsigned char paydigest[64];
+    unsigned paydigestalgo, paydigestlen;
+    unsigned char md5[16];
+    bool hdrmd5;
+    unsigned long long hdrpos, hdrsize;
+    // With HEADER_RETAIN, the header's index (il entries) and data store
+    // (dl bytes) are kept in the blob, for header_tag; il=0 otherwise.
+    // The tags decoded so far are cached in tags[].
+    void *blob;
+    unsigned il, dl;
+    struct htag { unsigned tag, type, cnt; void *data; } *tags;
+    unsigned ntag;
+    // The allocated sizes of ffi[] (along with ffx[] and strtab), of the
+    // temporary space, of htab[], of digests[], of the blob and of tags[],
+    // which are reused by the next header_read call.
+    size_t ffialloc, tmpalloc, halloc, dgalloc, bloballoc, tagalloc;
+    void *tmp;
 };
 
 static_assert(sizeof(struct fi) == 20, "struct fi tightly packed");
 static_assert(sizeof(struct fx) == 16, "struct fx tightly packed");
 
-bool header_read(struct header *h, struct fda *fda, const char **err);
+// The header must be initialized once, and then can be read many times,
+// reusing the memory, until header_freedata.  After a failed header_read,
+// the data is invalid, but the memory still needs to be freed.
+void header_init(struct header *h);
+// The flags for header_read: load ffx[] even if the payload has the info,
+// load the file digests, retain the header for header_tag.
+#define HEADER_LOADFX  (1 << 0)
+#define HEADER_DIGESTS (1 << 1)
+#define HEADER_RETAIN  (1 << 2)
+bool header_read(struct header *h, struct input *in, unsigned flags, const char **err);
 void header_freedata(struct header *h);
 
 // Find file info by filename.  Returns the index into ffi[], -1 if not found.
 unsigned header_find(struct header *h, const char *fname, size_t flen);
 
+// The tag types, as in rpmtag.h.
+#define RPM_CHAR_TYPE         1
+#define RPM_INT8_TYPE         2
+#define RPM_INT16_TYPE        3
+#define RPM_INT32_TYPE        4
+#define RPM_INT64_TYPE        5
+#define RPM_STRING_TYPE       6
+#define RPM_BIN_TYPE          7
+#define RPM_STRING_ARRAY_TYPE 8
+#define RPM_I18NSTRING_TYPE   9
+
+// Get the tag's data from the retained header, decoded on first access:
+// integers in host byte order, strings as an array of pointers, binary data
+// as is.  The string types (STRING, STRING_ARRAY and I18NSTRING) can be
+// requested interchangeably.  Returns NULL with *cnt=0 and *err=NULL if the
+// tag is not in the header, NULL with *err set on error.
+void *header_tag(struct header *h, unsigned tag, unsigned type, unsigned *cnt,
+		 const char **err);
+
+// The tag's type in the retained header, 0 if there is no such tag.
+unsigned header_tagtype(struct header *h, unsigned tag);
+
 #pragma GCC visibility pop
@@ -0,0 +1,179 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// The header parser and the decompressors read their input either from
+// a file descriptor, via the fda buffer, or from a memory region, such as
+// a memory-mapped package, which is then accessed directly, with no read(2)
+// calls and no intermediate copies.  With push input, see push.h, the memory
+// region is whatever has been fed so far, and once it runs dry, the more
+// hook is called to wait for the next piece.
+struct input {
+    // File input, NULL for memory input.
+    struct fda *fda;
+    // Memory input, the data yet to be consumed.
+    const char *cur, *end;
+    // The number of bytes consumed so far, i.e. the offset in the file.
+    unsigned long long pos;
+    // The number of times inpeek had to refill the fda buffer.
+    unsigned long long nfill;
+    // If set, called on the data consumed with inconsume, i.e. on what
+    // the decompressors take, e.g. to hash the payload as it goes.
+    void (*hash)(void *arg, const void *p, size_t n);
+    void *hasharg;
+    // If set, called when the memory input is exhausted; returns false
+    // at the end of input, otherwise cur and end are set to the new data.
+    bool (*more)(void *arg);
+    void *morearg;
+};
+
+// Wait for more memory input.  Returns false at the end of input.
+static inline bool inmore(struct input *in)
+{
+    return in->more && in->more(in->morearg);
+}
+
+// Read exactly size bytes, unless EOF.  Returns the number of bytes read,
+// -1 on error, just like reada.
+static inline ssize_t inread(struct input *in, void *buf, size_t size)
+{
+    if (in->fda) {
+	ssize_t ret = reada(in->fda, buf, size);
+	if (ret > 0)
+	    in->pos += ret;
+	return ret;
+    }
+    size_t done = 0;
+    do {
+	size_t n = in->end - in->cur;
+	if (n > size - done)
+	    n = size - done;
+	memcpy((char *) buf + done, in->cur, n);
+	in->cur += n;
+	in->pos += n;
+	done += n;
+    } while (done < size && inmore(in));
+    return done;
+}
+
+// Skip size bytes, unless EOF, just like skipa.
+static inline ssize_t inskip(struct input *in, size_t size)
+{
+    if (in->fda) {
+	ssize_t ret = skipa(in->fda, size);
+	if (ret > 0)
+	    in->pos += ret;
+	return ret;
+    }
+    size_t done = 0;
+    do {
+	size_t n = in->end - in->cur;
+	if (n > size - done)
+	    n = size - done;
+	in->cur += n;
+	in->pos += n;
+	done += n;
+    } while (done < size && inmore(in));
+    return done;
+}
+
+// Make some input available to a decompressor, without consuming it.
+// Returns the number of bytes available at *p, 0 on EOF, -1 on error.
+// The size is capped at 1G, which suits zlib's 32-bit avail_in.
+static inline ssize_t inpeek(struct input *in, const char **p)
+{
+    if (in->fda) {
+	struct fda *fda = in->fda;
+	unsigned long w;
+	if (fda->end - fda->cur < (ssize_t) sizeof w)
+	    in->nfill++;
+	ssize_t ret = peeka(fda, &w, sizeof w);
+	if (ret <= 0)
+	    return ret;
+	*p = fda->cur;
+	return fda->end - fda->cur;
+    }
+    if (in->cur == in->end)
+	inmore(in);
+    size_t left = in->end - in->cur;
+    *p = in->cur;
+    return left < (1 << 30) ? left : (1 << 30);
+}
+
+// Consume n bytes of the data returned by inpeek.
+static inline void inconsume(struct input *in, size_t n)
+{
+    const char *p;
+    if (in->fda)
+	p = in->fda->cur, in->fda->cur += n;
+    else
+	p = in->cur, in->cur += n;
+    if (in->hash)
+	in->hash(in->hasharg, p, n);
+    in->pos += n;
+}
+
+// Move forward to the offset pos, which must not be behind in->pos.
+// With file input, the data which is not in the buffer is not read but
+// seeked over, if the file is seekable.  Returns false on EOF or error.
+static inline bool inseek(struct input *in, unsigned long long pos)
+{
+    unsigned long long n = pos - in->pos;
+    if (in->fda) {
+	struct fda *fda = in->fda;
+	size_t buffered = fda->end - fda->cur;
+	if (n > buffered &&
+		lseek(fda->fd, n - buffered, SEEK_CUR) != (off_t) -1) {
+	    *fda = (struct fda) { fda->fd, fda->buf };
+	    in->pos = pos;
+	    return true;
+	}
+    }
+    else if (!in->more && n > (size_t) (in->end - in->cur))
+	return false;
+    return inskip(in, n) == n;
+}
+
+// Read up to size bytes at the offset pos, which can be anywhere in the file,
+// leaving the current position intact.  Returns the number of bytes read,
+// 0 at EOF, -1 on error (e.g. with a pipe, or with push input, which is
+// not kept past being consumed).
+static inline ssize_t inpread(struct input *in, void *buf, size_t size,
+			      unsigned long long pos)
+{
+    if (in->fda)
+	return pread(in->fda->fd, buf, size, pos);
+    if (in->more)
+	return errno = ESPIPE, -1;
+    // Memory input starts at offset 0.
+    const char *start = in->cur - in->pos;
+    size_t len = in->end - start;
+    if (pos >= len)
+	return 0;
+    if (size > len - pos)
+	size = len - pos;
+    memcpy(buf, start + pos, size);
+    return size;
+}
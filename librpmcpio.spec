@@ -10,7 +10,8 @@ URL: https://github.com/svpv/rpmcpio
 Source: rpmcpio-%version.tar
 
 # Automatically added by buildreq on Mon Mar 05 2018
-BuildRequires: liblzma-devel librpm-devel zlib-devel
+BuildRequires: liblzma-devel librpm-devel zlib-devel libzstd-devel
+BuildRequires: libssl-devel
 
 %package devel
 Summary: Read cpio archive of .rpm packages
@@ -0,0 +1,729 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Generate a synthetic rpm package, for benchmarks and testing, without
+// rpmbuild.  The package has the lead, the signature header, the header
+// and the compressed cpio payload, laid out as by rpmbuild, though only
+// the tags needed to list, unpack and verify the files are written (no
+// signatures, no dependencies).  The output is deterministic for a given seed.
+//
+// mkrpm [options] OUT.rpm
+//	-n N	the number of regular files (default 1000)
+//	-s SIZE	the mean file size, in bytes (default 4096)
+//	-d DIST	the size distribution: exp (the default), uniform or fixed
+//	-D N	the number of files per directory (default 100)
+//	-H N	add N hardlink sets of 3 files each
+//	-L	LONGFILESIZES, with stripped cpio headers (07070X)
+//	-S	a source package, with a flat file list
+//	-R	write the payload in random order, rather than sorted
+//	-Z	file data has runs of zeros (32K in every 64K), as with sparse files
+//	-E	add a symlink which leads outside the tree, /usr/share/bench/esc ->
+//		../../../../../escape, with a directory, a file and a hardlink set
+//		under it (and /escape, which it resolves to within the tree)
+//	-z ZPROG	the compressor: gzip (the default), xz, lzma or zstd
+//	-B SIZE	with xz, compress in blocks of SIZE, as with xz -T
+//	-a ALGO	file and payload digests: sha256 (the default), md5, or none
+//		(the signature header always has the MD5 of header+payload)
+//	-r SEED	the random seed (default 1)
+//
+// File data is text made of random words, which compresses about as well
+// as the typical packaged files.
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
+#include <openssl/evp.h>
+
+#define PROG "mkrpm"
+#define warn(fmt, args...) fprintf(stderr, PROG ": " fmt "\n", ##args)
+#define die(fmt, args...) warn(fmt, ##args), exit(128)
+
+static void *xrealloc(void *p, size_t n)
+{
+    p = realloc(p, n);
+    if (!p)
+	die("cannot allocate %zu bytes", n);
+    return p;
+}
+
+// A growing byte buffer.
+struct buf {
+    unsigned char *p;
+    size_t len, alloc;
+};
+
+static void *bufext(struct buf *b, size_t n)
+{
+    if (b->len + n > b->alloc) {
+	b->alloc = b->alloc ? 2 * b->alloc : 4096;
+	while (b->len + n > b->alloc)
+	    b->alloc *= 2;
+	b->p = xrealloc(b->p, b->alloc);
+    }
+    void *ret = b->p + b->len;
+    b->len += n;
+    return ret;
+}
+
+static void bufadd(struct buf *b, const void *p, size_t n)
+{
+    memcpy(bufext(b, n), p, n);
+}
+
+static void bufpad(struct buf *b, size_t align)
+{
+    while (b->len % align)
+	*(unsigned char *) bufext(b, 1) = 0;
+}
+
+// xorshift64*
+static uint64_t seed = 1;
+
+static uint64_t rnd(void)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0,1).
+static double rndf(void)
+{
+    return (rnd() >> 11) * 0x1p-53;
+}
+
+#define NWORD 512
+static char words[NWORD][12];
+
+static void mkwords(void)
+{
+    for (int i = 0; i < NWORD; i++) {
+	int len = 2 + rnd() % 9;
+	for (int j = 0; j < len; j++)
+	    words[i][j] = 'a' + rnd() % 26;
+	words[i][len] = '\0';
+    }
+}
+
+static void mktext(unsigned char *p, size_t size)
+{
+    size_t n = 0;
+    while (n < size) {
+	const char *w = words[rnd() % NWORD];
+	while (*w && n < size)
+	    p[n++] = *w++;
+	if (n < size)
+	    p[n++] = rnd() % 10 ? ' ' : '\n';
+    }
+}
+
+struct file {
+    char *path;
+    unsigned mode, flags, ino, nlink;
+    unsigned long long size;
+    const char *linkto;
+    // The hex digest of file data, empty if none.
+    char *digest;
+};
+
+static struct file *files;
+static unsigned nfile, allocfile;
+
+static struct file *addfile(unsigned mode, unsigned long long size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static struct file *addfile(unsigned mode, unsigned long long size, const char *fmt, ...)
+{
+    if (nfile == allocfile) {
+	allocfile = allocfile ? 2 * allocfile : 1024;
+	files = xrealloc(files, allocfile * sizeof *files);
+    }
+    char *path;
+    va_list ap;
+    va_start(ap, fmt);
+    if (vasprintf(&path, fmt, ap) < 0)
+	die("cannot allocate memory");
+    va_end(ap);
+    struct file *f = &files[nfile++];
+    // Each file is its own inode, until hardlinked.
+    *f = (struct file) { path, mode, 0, nfile, 1, size, "", "" };
+    return f;
+}
+
+static int cmpfile(const void *a, const void *b)
+{
+    return strcmp(((const struct file *) a)->path, ((const struct file *) b)->path);
+}
+
+#define RPMFILE_GHOST 64
+#define MTIME 1546300800 // 2019-01-01
+
+static void newc(struct buf *b, const struct file *f, const char *name,
+		 unsigned long long size)
+{
+    char hdr[111];
+    sprintf(hdr, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+	    f ? f->ino : 0, f ? f->mode : 0, 0, 0, f ? f->nlink : 1,
+	    f ? MTIME : 0, (unsigned) size, 0, 0, 0, 0, (unsigned) strlen(name) + 1, 0);
+    bufadd(b, hdr, 110);
+    bufadd(b, name, strlen(name) + 1);
+    bufpad(b, 4);
+}
+
+// The file digest algorithm, NULL if none.
+static const EVP_MD *md;
+
+static char *hexdigest(const void *p, size_t size)
+{
+    unsigned char d[EVP_MAX_MD_SIZE];
+    unsigned len;
+    if (!EVP_Digest(p, size, d, &len, md, NULL))
+	die("cannot compute file digest");
+    char *hex = xrealloc(NULL, 2 * len + 1);
+    for (unsigned i = 0; i < len; i++)
+	sprintf(hex + 2 * i, "%02x", d[i]);
+    return hex;
+}
+
+static bool zeros;
+
+static void entry(struct buf *b, unsigned ix, unsigned long long size,
+		  bool src, bool stripped)
+{
+    struct file *f = &files[ix];
+    if (stripped) {
+	char hdr[17];
+	sprintf(hdr, "07070X%08x", ix);
+	bufadd(b, hdr, 16);
+    }
+    else {
+	char name[4096];
+	snprintf(name, sizeof name, "%s%s", src ? "" : ".", f->path);
+	newc(b, f, name, size);
+    }
+    if (S_ISLNK(f->mode))
+	bufadd(b, f->linkto, size);
+    else {
+	unsigned char *p = bufext(b, size);
+	mktext(p, size);
+	for (unsigned long long off = 16 << 10; zeros && off < size; off += 64 << 10)
+	    memset(p + off, 0, size - off < (32 << 10) ? size - off : (32 << 10));
+    }
+    // Directories and symlinks have no digest.
+    if (md && S_ISREG(f->mode))
+	f->digest = hexdigest(b->p + b->len - size, size);
+    bufpad(b, 4);
+}
+
+// Make the cpio archive.  A hardlink set goes as a unit, with only the last
+// file coming with data.  The files of a set are adjacent in the header.
+static void mkcpio(struct buf *b, bool src, bool stripped, bool shuffle)
+{
+    unsigned *order = xrealloc(NULL, nfile * sizeof *order);
+    unsigned n = 0;
+    for (unsigned i = 0; i < nfile; i++)
+	if (!(files[i].flags & RPMFILE_GHOST) &&
+		!(i && files[i].nlink > 1 && files[i-1].ino == files[i].ino))
+	    order[n++] = i;
+    if (shuffle)
+	for (unsigned i = n - 1; i > 0; i--) {
+	    unsigned j = rnd() % (i + 1), t = order[i];
+	    order[i] = order[j], order[j] = t;
+	}
+    for (unsigned k = 0; k < n; k++) {
+	unsigned ix = order[k];
+	struct file *f = &files[ix];
+	for (unsigned j = 1; j < f->nlink; j++)
+	    entry(b, ix++, 0, src, stripped);
+	entry(b, ix, f->size, src, stripped);
+	// The files in a hardlink set share the digest.
+	for (unsigned j = 1; j < f->nlink; j++)
+	    free(files[ix-j].digest), files[ix-j].digest = files[ix].digest;
+    }
+    newc(b, NULL, "TRAILER!!!", 0);
+    free(order);
+}
+
+static void zcompress(struct buf *out, const struct buf *in, const char *zprog,
+		      unsigned long long blocksize)
+{
+    if (strcmp(zprog, "gzip") == 0) {
+	z_stream strm = { 0 };
+	if (deflateInit2(&strm, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	    die("deflateInit2 failed");
+	uLong bound = deflateBound(&strm, in->len);
+	strm.next_in = in->p, strm.avail_in = in->len;
+	strm.next_out = bufext(out, bound), strm.avail_out = bound;
+	if (deflate(&strm, Z_FINISH) != Z_STREAM_END)
+	    die("deflate failed");
+	out->len -= strm.avail_out;
+	deflateEnd(&strm);
+    }
+    else if (strcmp(zprog, "xz") == 0 || strcmp(zprog, "lzma") == 0) {
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_ret ret;
+	if (zprog[0] == 'l') {
+	    lzma_options_lzma opt;
+	    lzma_lzma_preset(&opt, 6);
+	    ret = lzma_alone_encoder(&strm, &opt);
+	}
+	else if (blocksize) {
+	    lzma_mt mt = { .threads = 1, .block_size = blocksize,
+			   .preset = 6, .check = LZMA_CHECK_CRC64 };
+	    ret = lzma_stream_encoder_mt(&strm, &mt);
+	}
+	else
+	    ret = lzma_easy_encoder(&strm, 6, LZMA_CHECK_CRC64);
+	if (ret != LZMA_OK)
+	    die("cannot initialize %s encoder", zprog);
+	strm.next_in = in->p, strm.avail_in = in->len;
+	do {
+	    out->len -= strm.avail_out;
+	    strm.next_out = bufext(out, 1 << 20), strm.avail_out = 1 << 20;
+	    ret = lzma_code(&strm, LZMA_FINISH);
+	} while (ret == LZMA_OK);
+	if (ret != LZMA_STREAM_END)
+	    die("%s compression failed", zprog);
+	out->len -= strm.avail_out;
+	lzma_end(&strm);
+    }
+    else if (strcmp(zprog, "zstd") == 0) {
+	size_t bound = ZSTD_compressBound(in->len);
+	size_t ret = ZSTD_compress(bufext(out, bound), bound, in->p, in->len, 3);
+	if (ZSTD_isError(ret))
+	    die("zstd compression failed");
+	out->len -= bound - ret;
+    }
+    else
+	die("%s: unknown compressor", zprog);
+}
+
+#define RPM_INT16_TYPE        3
+#define RPM_INT32_TYPE        4
+#define RPM_INT64_TYPE        5
+#define RPM_STRING_TYPE       6
+#define RPM_BIN_TYPE          7
+#define RPM_STRING_ARRAY_TYPE 8
+
+// An rpm header in the making.  The tags must be added in ascending order,
+// after the region tag.
+struct hdr {
+    struct buf index, data;
+    unsigned il;
+};
+
+static void tag(struct hdr *h, unsigned tag, unsigned type, unsigned cnt,
+		const void *p, size_t size)
+{
+    static const unsigned char align[] = { [RPM_INT16_TYPE] = 2,
+	[RPM_INT32_TYPE] = 4, [RPM_INT64_TYPE] = 8 };
+    if (align[type])
+	bufpad(&h->data, align[type]);
+    unsigned e[4] = { htonl(tag), htonl(type), htonl(h->data.len), htonl(cnt) };
+    bufadd(&h->index, e, sizeof e);
+    bufadd(&h->data, p, size);
+    h->il++;
+}
+
+static void tagS(struct hdr *h, unsigned t, const char *s)
+{
+    tag(h, t, RPM_STRING_TYPE, 1, s, strlen(s) + 1);
+}
+
+static void tag32(struct hdr *h, unsigned t, unsigned v)
+{
+    v = htonl(v);
+    tag(h, t, RPM_INT32_TYPE, 1, &v, 4);
+}
+
+static void tag64(struct hdr *h, unsigned t, unsigned long long v)
+{
+    v = htobe64(v);
+    tag(h, t, RPM_INT64_TYPE, 1, &v, 8);
+}
+
+static void tagSA(struct hdr *h, unsigned t, unsigned cnt,
+		  const char *(*get)(unsigned i, void *arg), void *arg)
+{
+    struct buf a = { 0 };
+    for (unsigned i = 0; i < cnt; i++) {
+	const char *s = get(i, arg);
+	bufadd(&a, s, strlen(s) + 1);
+    }
+    tag(h, t, RPM_STRING_ARRAY_TYPE, cnt, a.p, a.len);
+    free(a.p);
+}
+
+// Finish the header: the region tag goes first, and its trailer last.
+static void hdrout(struct hdr *h, unsigned region, struct buf *out)
+{
+    unsigned trailer[4] = { htonl(region), htonl(RPM_BIN_TYPE),
+			    htonl(-(h->il + 1) * 16), htonl(16) };
+    unsigned e[4] = { htonl(region), htonl(RPM_BIN_TYPE), htonl(h->data.len), htonl(16) };
+    bufadd(&h->data, trailer, 16);
+    static const unsigned char magic[8] = { 0x8e, 0xad, 0xe8, 0x01 };
+    bufadd(out, magic, 8);
+    unsigned il = htonl(h->il + 1), dl = htonl(h->data.len);
+    bufadd(out, &il, 4);
+    bufadd(out, &dl, 4);
+    bufadd(out, e, 16);
+    bufadd(out, h->index.p, h->index.len);
+    bufadd(out, h->data.p, h->data.len);
+    free(h->index.p), free(h->data.p);
+}
+
+static const char *getbn(unsigned i, void *arg)
+{
+    const char *slash = strrchr(files[i].path, '/');
+    return slash ? slash + 1 : files[i].path;
+}
+
+static const char *getlinkto(unsigned i, void *arg)
+{
+    return files[i].linkto;
+}
+
+static const char *getstr(unsigned i, void *arg)
+{
+    return arg;
+}
+
+static const char *getv(unsigned i, void *arg)
+{
+    return ((const char **) arg)[i];
+}
+
+static const char *getdigest(unsigned i, void *arg)
+{
+    return files[i].digest;
+}
+
+static const char *getroot(unsigned i, void *arg)
+{
+    return "root";
+}
+
+static const char **dirs;
+static unsigned ndir;
+
+static const char *getdir(unsigned i, void *arg)
+{
+    return dirs[i];
+}
+
+// Map the files to their dirnames, which come sorted, because the files do.
+static unsigned *mkdirs(void)
+{
+    unsigned *dindex = xrealloc(NULL, nfile * sizeof *dindex);
+    dirs = xrealloc(NULL, nfile * sizeof *dirs);
+    for (unsigned i = 0; i < nfile; i++) {
+	const char *path = files[i].path;
+	size_t dlen = strrchr(path, '/') + 1 - path;
+	if (ndir == 0 || strlen(dirs[ndir-1]) != dlen || memcmp(dirs[ndir-1], path, dlen)) {
+	    // Sorting by path does not quite sort by dirname, e.g. "/a/b"
+	    // goes before "/a/b-c/d", but "/a/b/c" goes after it.
+	    unsigned j;
+	    for (j = 0; j < ndir; j++)
+		if (strlen(dirs[j]) == dlen && memcmp(dirs[j], path, dlen) == 0)
+		    break;
+	    if (j == ndir)
+		dirs[ndir++] = strndup(path, dlen);
+	    dindex[i] = j;
+	}
+	else
+	    dindex[i] = ndir - 1;
+    }
+    return dindex;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned n = 1000, perdir = 100, nhard = 0;
+    double meansize = 4096;
+    const char *dist = "exp", *zprog = "gzip", *algo = "sha256";
+    bool stripped = false, src = false, shuffle = false, escape = false;
+    unsigned long long blocksize = 0;
+    int c;
+    while ((c = getopt(argc, argv, "n:s:d:D:H:LSRZEz:B:a:r:")) != -1)
+	switch (c) {
+	case 'n': n = atoi(optarg); break;
+	case 's': meansize = atof(optarg); break;
+	case 'd': dist = optarg; break;
+	case 'D': perdir = atoi(optarg); break;
+	case 'H': nhard = atoi(optarg); break;
+	case 'L': stripped = true; break;
+	case 'S': src = true; break;
+	case 'R': shuffle = true; break;
+	case 'Z': zeros = true; break;
+	case 'E': escape = true; break;
+	case 'z': zprog = optarg; break;
+	case 'B': blocksize = strtoull(optarg, NULL, 0); break;
+	case 'a': algo = optarg; break;
+	case 'r': seed = strtoull(optarg, NULL, 0) | 1; break;
+	default: goto usage;
+	}
+    argc -= optind, argv += optind;
+    if (argc != 1 || perdir == 0) {
+usage:	fprintf(stderr, "Usage: " PROG " [-n N] [-s SIZE] [-d DIST] [-D N] [-H N] "
+			"[-L] [-S] [-R] [-Z] [-E] [-z ZPROG] [-B SIZE] [-a ALGO] [-r SEED] OUT.rpm\n");
+	return 2;
+    }
+    mkwords();
+    // PGPHASHALGO_* for FILEDIGESTALGO.
+    unsigned algonum = 0;
+    if (strcmp(algo, "sha256") == 0)
+	md = EVP_sha256(), algonum = 8;
+    else if (strcmp(algo, "md5") == 0)
+	md = EVP_md5(), algonum = 1;
+    else if (strcmp(algo, "none"))
+	die("%s: unknown digest algorithm", algo);
+
+    // The file list.
+    for (unsigned i = 0; i < n; i++) {
+	double size = meansize;
+	if (strcmp(dist, "exp") == 0)
+	    size = -meansize * log(1 - rndf());
+	else if (strcmp(dist, "uniform") == 0)
+	    size = 2 * meansize * rndf();
+	else if (strcmp(dist, "fixed"))
+	    die("%s: unknown size distribution", dist);
+	if (!stripped && size > 0xffffffff)
+	    size = 0xffffffff;
+	if (src)
+	    addfile(S_IFREG | 0644, size, "file%05u.c", i);
+	else {
+	    if (i % perdir == 0) {
+		addfile(S_IFDIR | 0755, 0, "/usr/share/bench/d%04u", i / perdir);
+		struct file *f = addfile(S_IFLNK | 0777, 0, "/usr/share/bench/d%04u/link", i / perdir);
+		asprintf((char **) &f->linkto, "f%06u", i);
+		f->size = strlen(f->linkto);
+	    }
+	    addfile(S_IFREG | 0644, size, "/usr/share/bench/d%04u/f%06u", i / perdir, i);
+	}
+    }
+    for (unsigned i = 0; i < nhard; i++) {
+	unsigned long long size = meansize;
+	unsigned ino = 0;
+	for (int j = 0; j < 3; j++) {
+	    struct file *f = src ? addfile(S_IFREG | 0755, size, "hard%05u-%d", i, j)
+				 : addfile(S_IFREG | 0755, size, "/usr/bin/hard%05u-%d", i, j);
+	    if (j == 0)
+		ino = f->ino;
+	    f->ino = ino;
+	    f->nlink = 3;
+	}
+    }
+    if (escape && !src) {
+	addfile(S_IFDIR | 0755, 0, "/escape");
+	struct file *f = addfile(S_IFLNK | 0777, 0, "/usr/share/bench/esc");
+	f->linkto = "../../../../../escape";
+	f->size = strlen(f->linkto);
+	addfile(S_IFDIR | 0750, 0, "/usr/share/bench/esc/dir");
+	addfile(S_IFREG | 0640, meansize, "/usr/share/bench/esc/file");
+	unsigned ino = 0;
+	for (int j = 0; j < 2; j++) {
+	    f = addfile(S_IFREG | 0640, meansize, "/usr/share/bench/esc/hard-%d", j);
+	    if (j == 0)
+		ino = f->ino;
+	    f->ino = ino;
+	    f->nlink = 2;
+	}
+    }
+    if (src)
+	addfile(S_IFREG | 0644, 512, "bench.spec");
+    else {
+	addfile(S_IFDIR | 0755, 0, "/usr/share/bench");
+	addfile(S_IFREG | 0644, 0, "/usr/share/bench/ghost")->flags = RPMFILE_GHOST;
+    }
+    // rpm sorts the file list, and renumbers the inodes in that order.
+    qsort(files, nfile, sizeof *files, cmpfile);
+    unsigned *ino = calloc(nfile + 1, sizeof *ino);
+    if (!ino)
+	die("cannot allocate memory");
+    for (unsigned i = 0, next = 1; i < nfile; i++) {
+	struct file *f = &files[i];
+	if (!ino[f->ino])
+	    ino[f->ino] = next++;
+	f->ino = ino[f->ino];
+    }
+    free(ino);
+
+    struct buf cpio = { 0 }, payload = { 0 };
+    mkcpio(&cpio, src, stripped, shuffle);
+    zcompress(&payload, &cpio, zprog, blocksize);
+
+    // The header.
+    struct hdr h = { 0 };
+    unsigned long long total = 0;
+    for (unsigned i = 0; i < nfile; i++)
+	total += files[i].size;
+    tagS(&h, 1000, "bench"); // NAME
+    tagS(&h, 1001, "1.0"); // VERSION
+    tagS(&h, 1002, "1"); // RELEASE
+    if (!stripped)
+	tag32(&h, 1009, total); // SIZE
+    tagS(&h, 1021, "linux"); // OS
+    tagS(&h, 1022, src ? "noarch" : "x86_64"); // ARCH
+#define F(x) files[i].x
+    if (!stripped) {
+	unsigned *a = xrealloc(NULL, nfile * 4);
+	for (unsigned i = 0; i < nfile; i++)
+	    a[i] = htonl(F(size));
+	tag(&h, 1028, RPM_INT32_TYPE, nfile, a, nfile * 4); // FILESIZES
+	free(a);
+    }
+    unsigned short *a16 = xrealloc(NULL, nfile * 2);
+    for (unsigned i = 0; i < nfile; i++)
+	a16[i] = htons(F(mode));
+    tag(&h, 1030, RPM_INT16_TYPE, nfile, a16, nfile * 2); // FILEMODES
+    for (unsigned i = 0; i < nfile; i++)
+	a16[i] = 0;
+    tag(&h, 1033, RPM_INT16_TYPE, nfile, a16, nfile * 2); // FILERDEVS
+    free(a16);
+    unsigned *a32 = xrealloc(NULL, nfile * 4);
+    for (unsigned i = 0; i < nfile; i++)
+	a32[i] = htonl(MTIME);
+    tag(&h, 1034, RPM_INT32_TYPE, nfile, a32, nfile * 4); // FILEMTIMES
+    if (md)
+	tagSA(&h, 1035, nfile, getdigest, NULL); // FILEDIGESTS
+    tagSA(&h, 1036, nfile, getlinkto, NULL); // FILELINKTOS
+    for (unsigned i = 0; i < nfile; i++)
+	a32[i] = htonl(F(flags));
+    tag(&h, 1037, RPM_INT32_TYPE, nfile, a32, nfile * 4); // FILEFLAGS
+    tagSA(&h, 1039, nfile, getroot, NULL); // FILEUSERNAME
+    tagSA(&h, 1040, nfile, getroot, NULL); // FILEGROUPNAME
+    if (!src)
+	tagS(&h, 1044, "bench-1.0-1.src.rpm"); // SOURCERPM
+    for (unsigned i = 0; i < nfile; i++)
+	a32[i] = htonl(1);
+    tag(&h, 1095, RPM_INT32_TYPE, nfile, a32, nfile * 4); // FILEDEVICES
+    for (unsigned i = 0; i < nfile; i++)
+	a32[i] = htonl(F(ino));
+    tag(&h, 1096, RPM_INT32_TYPE, nfile, a32, nfile * 4); // FILEINODES
+    if (src) {
+	for (unsigned i = 0; i < nfile; i++)
+	    a32[i] = 0;
+	tag(&h, 1116, RPM_INT32_TYPE, nfile, a32, nfile * 4); // DIRINDEXES
+	tagSA(&h, 1117, nfile, getbn, NULL); // BASENAMES
+	static const char *none[] = { "" };
+	dirs = none, ndir = 1;
+	tagSA(&h, 1118, ndir, getdir, NULL); // DIRNAMES
+    }
+    else {
+	unsigned *dindex = mkdirs();
+	for (unsigned i = 0; i < nfile; i++)
+	    a32[i] = htonl(dindex[i]);
+	free(dindex);
+	tag(&h, 1116, RPM_INT32_TYPE, nfile, a32, nfile * 4); // DIRINDEXES
+	tagSA(&h, 1117, nfile, getbn, NULL); // BASENAMES
+	tagSA(&h, 1118, ndir, getdir, NULL); // DIRNAMES
+    }
+    free(a32);
+    tagS(&h, 1124, "cpio"); // PAYLOADFORMAT
+    tagS(&h, 1125, zprog); // PAYLOADCOMPRESSOR
+    tagS(&h, 1126, "6"); // PAYLOADFLAGS
+    a32 = xrealloc(NULL, nfile * 4);
+    for (unsigned i = 0; i < nfile; i++)
+	a32[i] = 0;
+    tag(&h, 1140, RPM_INT32_TYPE, nfile, a32, nfile * 4); // FILECOLORS
+    for (unsigned i = 0; i < nfile; i++)
+	a32[i] = htonl(S_ISDIR(F(mode)) ? 1 : S_ISLNK(F(mode)) ? 2 : 3);
+    tag(&h, 1141, RPM_INT32_TYPE, nfile, a32, nfile * 4); // FILECLASS
+    free(a32);
+    static const char *classes[] = { "", "directory", "symbolic link", "ASCII text" };
+    tagSA(&h, 1142, 4, getv, classes); // CLASSDICT
+    if (stripped) {
+	unsigned long long *a64 = xrealloc(NULL, nfile * 8);
+	for (unsigned i = 0; i < nfile; i++)
+	    a64[i] = htobe64(F(size));
+	tag(&h, 5008, RPM_INT64_TYPE, nfile, a64, nfile * 8); // LONGFILESIZES
+	free(a64);
+	tag64(&h, 5009, total); // LONGSIZE
+    }
+    if (md) {
+	tag32(&h, 5011, algonum); // FILEDIGESTALGO
+	char *hex = hexdigest(payload.p, payload.len);
+	tagSA(&h, 5092, 1, getstr, hex); // PAYLOADDIGEST
+	tag32(&h, 5093, algonum); // PAYLOADDIGESTALGO
+	free(hex);
+    }
+    struct buf hdr = { 0 };
+    hdrout(&h, 63, &hdr); // HEADERIMMUTABLE
+
+    // The signature header, padded to a multiple of 8 bytes.
+    unsigned char md5[16];
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!(ctx && EVP_DigestInit_ex(ctx, EVP_md5(), NULL) &&
+	    EVP_DigestUpdate(ctx, hdr.p, hdr.len) &&
+	    EVP_DigestUpdate(ctx, payload.p, payload.len) &&
+	    EVP_DigestFinal_ex(ctx, md5, NULL)))
+	die("cannot compute MD5");
+    EVP_MD_CTX_free(ctx);
+    struct hdr s = { 0 };
+    if (stripped) {
+	tag64(&s, 270, hdr.len + payload.len); // LONGSIZE
+	tag64(&s, 271, cpio.len); // LONGARCHIVESIZE
+	tag(&s, 1004, RPM_BIN_TYPE, 16, md5, 16); // MD5
+    }
+    else {
+	tag32(&s, 1000, hdr.len + payload.len); // SIZE
+	tag(&s, 1004, RPM_BIN_TYPE, 16, md5, 16); // MD5
+	tag32(&s, 1007, cpio.len); // PAYLOADSIZE
+    }
+    struct buf sig = { 0 };
+    hdrout(&s, 62, &sig); // HEADERSIGNATURES
+    bufpad(&sig, 8);
+
+    struct {
+	unsigned char magic[4];
+	unsigned char major, minor;
+	short type, archnum;
+	char name[66];
+	short osnum, signature_type;
+	char reserved[16];
+    } lead = {
+	{ 0xed, 0xab, 0xee, 0xdb }, 3, 0, htons(src), htons(1),
+	"bench-1.0-1", htons(1), htons(5),
+    };
+    FILE *fp = fopen(argv[0], "w");
+    if (!fp)
+	die("%s: %m", argv[0]);
+    fwrite(&lead, sizeof lead, 1, fp);
+    fwrite(sig.p, sig.len, 1, fp);
+    fwrite(hdr.p, hdr.len, 1, fp);
+    fwrite(payload.p, payload.len, 1, fp);
+    if (fclose(fp))
+	die("%s: %m", argv[0]);
+    return 0;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,176 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <string.h>
+#include "newc.h"
+
+bool newc_parse_table(const char buf[110], unsigned v[13])
+{
+    if (memcmp(buf, "070701", 6) != 0)
+	return false;
+    bool ok = true;
+    for (int i = 0; i < 13; i++)
+	ok &= hex8(buf + 6 + 8 * i, &v[i]);
+    return ok;
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGH 0x8080808080808080ULL
+
+// Decode 8 hex digits, loaded little-endian, the first digit in the low byte.
+// Returns the bad digits, as the high bits of their bytes.
+static inline uint64_t swar8(uint64_t x, unsigned *v)
+{
+    // With the high bits clear, adding (0x80 - c) to each byte sets
+    // the byte's high bit iff the byte is >= c, with no carry across bytes.
+    uint64_t bad = x & HIGH;
+    x &= ~HIGH;
+    uint64_t digit = (x + (0x80 - '0') * ONES) & ~(x + (0x80 - '9' - 1) * ONES);
+    uint64_t lower = x | 0x20 * ONES;
+    uint64_t alpha = (lower + (0x80 - 'a') * ONES) & ~(lower + (0x80 - 'f' - 1) * ONES);
+    bad |= ~(digit | alpha) & HIGH;
+    // Nibbles, then pack them, the first one being the most significant.
+    x = (x & 0x0f * ONES) + (x >> 6 & ONES) * 9;
+    x = (x << 4 | x >> 8) & 0x00ff00ff00ff00ffULL;
+    x = (x << 8 | x >> 16) & 0x0000ffff0000ffffULL;
+    *v = x << 16 | x >> 32;
+    return bad;
+}
+
+bool newc_parse_swar(const char buf[110], unsigned v[13])
+{
+    uint64_t bad = 0;
+    for (int i = 0; i < 13; i++) {
+	uint64_t x;
+	memcpy(&x, buf + 6 + 8 * i, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	x = __builtin_bswap64(x);
+#endif
+	bad |= swar8(x, &v[i]);
+    }
+    return bad == 0 && memcmp(buf, "070701", 6) == 0;
+}
+
+#ifdef NEWC_SIMD
+#include <immintrin.h>
+
+// Each byte is validated and turned into a nibble, then the nibbles are
+// multiplied-and-added into bytes, 16-bit and 32-bit values.  The loads
+// at offsets 6 + 8i cover fields i, i+1, etc.; they never go past the end
+// of the header (the last one overlaps with the previous one).
+
+__attribute__((target("sse4.1")))
+static inline __m128i nibbles128(__m128i x, __m128i *bad)
+{
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+    __m128i isdigit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    __m128i a = _mm_sub_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i isalpha = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+    *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(isdigit, isalpha),
+					       _mm_set1_epi8(-1)));
+    return _mm_blendv_epi8(_mm_add_epi8(a, _mm_set1_epi8(10)), d, isdigit);
+}
+
+// 16 nibbles -> two 32-bit values, in the low halves of the 64-bit lanes.
+__attribute__((target("sse4.1")))
+static inline __m128i pack128(__m128i n)
+{
+    n = _mm_maddubs_epi16(n, _mm_set1_epi16(0x0110));
+    n = _mm_madd_epi16(n, _mm_set1_epi32(0x00010100));
+    return _mm_or_si128(_mm_slli_epi64(n, 16), _mm_srli_epi64(n, 32));
+}
+
+__attribute__((target("sse4.1")))
+bool newc_parse_sse41(const char buf[110], unsigned v[13])
+{
+    __m128i bad = _mm_setzero_si128();
+    for (int i = 0; i < 12; i += 2) {
+	__m128i x = _mm_loadu_si128((const __m128i *) (buf + 6 + 8 * i));
+	x = pack128(nibbles128(x, &bad));
+	v[i+0] = _mm_cvtsi128_si32(x);
+	v[i+1] = _mm_extract_epi32(x, 2);
+    }
+    __m128i x = _mm_loadu_si128((const __m128i *) (buf + 6 + 8 * 11));
+    x = pack128(nibbles128(x, &bad));
+    v[12] = _mm_extract_epi32(x, 2);
+    return _mm_testz_si128(bad, bad) && memcmp(buf, "070701", 6) == 0;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nibbles256(__m256i x, __m256i *bad)
+{
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8('0'));
+    __m256i isdigit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    __m256i a = _mm256_sub_epi8(_mm256_or_si256(x, _mm256_set1_epi8(0x20)),
+				_mm256_set1_epi8('a'));
+    __m256i isalpha = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+    *bad = _mm256_or_si256(*bad, _mm256_andnot_si256(_mm256_or_si256(isdigit, isalpha),
+						     _mm256_set1_epi8(-1)));
+    return _mm256_blendv_epi8(_mm256_add_epi8(a, _mm256_set1_epi8(10)), d, isdigit);
+}
+
+// 32 nibbles -> four 32-bit values, stored to v[].
+__attribute__((target("avx2")))
+static inline void pack256(__m256i n, unsigned *v)
+{
+    n = _mm256_maddubs_epi16(n, _mm256_set1_epi16(0x0110));
+    n = _mm256_madd_epi16(n, _mm256_set1_epi32(0x00010100));
+    n = _mm256_or_si256(_mm256_slli_epi64(n, 16), _mm256_srli_epi64(n, 32));
+    n = _mm256_permutevar8x32_epi32(n, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+    _mm_storeu_si128((__m128i *) v, _mm256_castsi256_si128(n));
+}
+
+__attribute__((target("avx2")))
+bool newc_parse_avx2(const char buf[110], unsigned v[13])
+{
+    __m256i bad = _mm256_setzero_si256();
+    __m256i x0 = _mm256_loadu_si256((const __m256i *) (buf + 6));
+    __m256i x1 = _mm256_loadu_si256((const __m256i *) (buf + 6 + 32));
+    __m256i x2 = _mm256_loadu_si256((const __m256i *) (buf + 6 + 64));
+    __m256i x3 = _mm256_loadu_si256((const __m256i *) (buf + 6 + 72));
+    pack256(nibbles256(x0, &bad), v);
+    pack256(nibbles256(x1, &bad), v + 4);
+    pack256(nibbles256(x2, &bad), v + 8);
+    // Fields 9..12, only the last one is new.
+    unsigned tail[4];
+    pack256(nibbles256(x3, &bad), tail);
+    v[12] = tail[3];
+    return _mm256_testz_si256(bad, bad) && memcmp(buf, "070701", 6) == 0;
+}
+#endif
+
+static bool resolve(const char buf[110], unsigned v[13])
+{
+    bool (*best)(const char buf[110], unsigned v[13]) = newc_parse_swar;
+#ifdef NEWC_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	best = newc_parse_avx2;
+    else if (__builtin_cpu_supports("sse4.1"))
+	best = newc_parse_sse41;
+#endif
+    __atomic_store_n(&newc_parse_best, best, __ATOMIC_RELAXED);
+    return best(buf, v);
+}
+
+bool (*newc_parse_best)(const char buf[110], unsigned v[13]) = resolve;
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,88 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <stdbool.h>
+
+#pragma GCC visibility push(hidden)
+
+// Parsing the hex numbers in cpio headers.
+static const signed char hex[256] = {
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+    0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+};
+
+// Parse 4-digit hex number, returns < 0 on error.
+static inline int hex4(const char *s)
+{
+    int v;
+    v  = hex[(unsigned char) s[0]] << 12;
+    v |= hex[(unsigned char) s[1]] << 8;
+    v |= hex[(unsigned char) s[2]] << 4;
+    v |= hex[(unsigned char) s[3]];
+    return v;
+}
+
+// Parse 8-digit hex number, returns false on error.
+static inline bool hex8(const char *s, unsigned *v)
+{
+    int hi = hex4(s);
+    int lo = hex4(s + 4);
+    *v = hi << 16 | lo;
+    return (hi | lo) >= 0;
+}
+
+// Parse the 110-byte "070701" (newc) cpio header: check the magic, and decode
+// the 13 8-digit hex fields into v[].  Returns false if the magic or any of
+// the digits is invalid, in which case v[] is garbage.  Runs the fastest
+// implementation which the CPU supports, selected on the first call.
+extern bool (*newc_parse_best)(const char buf[110], unsigned v[13]);
+static inline bool newc_parse(const char buf[110], unsigned v[13])
+{
+    return newc_parse_best(buf, v);
+}
+
+// The implementations, exposed for benchmarking.  newc_parse_table calls
+// hex8 for each field; newc_parse_swar processes a field at a time in a
+// 64-bit register; the SIMD versions process all the fields at once, and
+// may only be called if the CPU supports the instructions.
+bool newc_parse_table(const char buf[110], unsigned v[13]);
+bool newc_parse_swar(const char buf[110], unsigned v[13]);
+#if defined(__x86_64__) || defined(__i386__)
+#define NEWC_SIMD 1
+bool newc_parse_sse41(const char buf[110], unsigned v[13]);
+bool newc_parse_avx2(const char buf[110], unsigned v[13]);
+#endif
+
+#pragma GCC visibility pop
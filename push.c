@@ -0,0 +1,127 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "reada.h"
+#include "input.h"
+#include "push.h"
+
+// The coroutine's stack is mapped on demand, with a guard page below it.
+// Besides the parser and the decoders, it runs the caller's callbacks.
+#define STACKSIZE (1 << 20)
+#define GUARDSIZE (4 << 10)
+
+struct push {
+    // Switched back and forth with swapcontext (which also saves and
+    // restores the signal mask, a syscall each way; this is once per
+    // push_feed call, not per byte).
+    ucontext_t caller, co;
+    void (*fn)(void *arg);
+    void *arg;
+    char *stack;
+    // The input being fed, and the state of the coroutine.
+    struct input *in;
+    bool started, eof, done;
+};
+
+struct push *push_new(void (*fn)(void *arg), void *arg)
+{
+    struct push *p = malloc(sizeof *p);
+    if (!p)
+	return NULL;
+    p->stack = mmap(NULL, STACKSIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+    if (p->stack == MAP_FAILED) {
+	free(p);
+	return NULL;
+    }
+    mprotect(p->stack, GUARDSIZE, PROT_NONE);
+    p->fn = fn, p->arg = arg;
+    p->in = NULL;
+    p->started = p->eof = p->done = false;
+    return p;
+}
+
+void push_free(struct push *p)
+{
+    if (!p)
+	return;
+    munmap(p->stack, STACKSIZE);
+    free(p);
+}
+
+// makecontext only passes int arguments, the pointer is split in two
+// (shifted twice, so as to be valid with 32-bit pointers).
+static void start(unsigned lo, unsigned hi)
+{
+    struct push *p = (struct push *) ((uintptr_t) hi << 16 << 16 | lo);
+    p->fn(p->arg);
+    p->done = true;
+    // Returns to uc_link, i.e. to the last push_feed call.
+}
+
+size_t push_feed(struct push *p, struct input *in, const void *data, size_t len)
+{
+    if (p->done)
+	return len;
+    in->cur = data;
+    in->end = (const char *) data + len;
+    p->in = in;
+    p->eof = len == 0;
+    if (!p->started) {
+	getcontext(&p->co);
+	p->co.uc_stack.ss_sp = p->stack + GUARDSIZE;
+	p->co.uc_stack.ss_size = STACKSIZE - GUARDSIZE;
+	p->co.uc_link = &p->caller;
+	uintptr_t u = (uintptr_t) p;
+	makecontext(&p->co, (void (*)(void)) start, 2,
+		    (unsigned) u, (unsigned) (u >> 16 >> 16));
+	p->started = true;
+    }
+    swapcontext(&p->caller, &p->co);
+    size_t left = in->end - in->cur;
+    // The caller's buffer is about to go away.
+    in->cur = in->end = NULL;
+    return p->done ? len : len - left;
+}
+
+void push_yield(struct push *p)
+{
+    swapcontext(&p->co, &p->caller);
+}
+
+bool push_more(void *arg)
+{
+    struct push *p = arg;
+    if (p->eof)
+	return false;
+    push_yield(p);
+    return !p->eof;
+}
+
+bool push_done(struct push *p)
+{
+    return p->done;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
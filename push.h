@@ -0,0 +1,56 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#pragma GCC visibility push(hidden)
+
+// Push input: the parser, which pulls its input with inread, inpeek, etc.,
+// runs as a coroutine on its own stack, in the caller's thread.  Whenever
+// the input runs dry, the coroutine switches back to push_feed, which then
+// returns to the caller; the next push_feed call resumes the coroutine
+// with more data.  There are no threads and no copies: the decoders take
+// the data right from the caller's buffer.
+struct push;
+
+// The coroutine will run fn(arg), with a stack of its own.
+struct push *push_new(void (*fn)(void *arg), void *arg);
+void push_free(struct push *p);
+
+// Make the data available through in, as memory input with in->more set,
+// and run the coroutine until it asks for more data (having consumed all
+// of it), yields, or returns.  Returns the number of bytes consumed; after
+// the coroutine has returned, all data is considered consumed.  With len=0,
+// the coroutine sees the end of input.
+struct input;
+size_t push_feed(struct push *p, struct input *in, const void *data, size_t len);
+
+// Called by the coroutine: switch back to the caller of push_feed, leaving
+// the rest of the data unconsumed.  Returns with the next push_feed call.
+void push_yield(struct push *p);
+
+// The more hook for struct input, with morearg = p.
+bool push_more(void *p);
+
+// The coroutine has returned.
+bool push_done(struct push *p);
+
+#pragma GCC visibility pop
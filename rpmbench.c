@@ -0,0 +1,539 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Benchmarks for the rpmcpio library, see "make bench".
+//
+// rpmbench list RPM...
+//	Iterate the entries, reading no file data, so that the data is
+//	skipped; reports the throughput in terms of the uncompressed data,
+//	and how the entries were looked up in the header.
+//
+// rpmbench stages RPM...
+//	Time the stages of reading a package separately: header_read,
+//	decompression of the payload (into memory), the walk over the cpio
+//	headers, and header_find on the filenames; then the whole thing,
+//	as with rpmbench list, for comparison.
+//
+// rpmbench digest RPM...
+//	Read all file data, then read it again with RPMCPIO_DIGEST, which
+//	verifies the file digests, and with RPMCPIO_PAYLOAD_DIGEST added,
+//	which also verifies the compressed payload; reports the throughput
+//	of each pass.
+//
+// rpmbench extract DIR RPM...
+//	Extract the packages under DIR, with plain syscalls, with io_uring,
+//	and with 4 writer threads (into DIR/plain, DIR/uring and DIR/writers,
+//	which are created if needed); reports the throughput against reading
+//	all file data, and the time spent in the decoder, in the filesystem
+//	calls, and waiting for the writes.
+//
+// rpmbench push RPM...
+//	Read all file data, then do the same with push handles, feeding
+//	the packages in 4K and 64K pieces, and pausing after each 1M of file
+//	data; reports the throughput of each pass, and the number of calls.
+//
+// rpmbench hex
+//	Parse newc cpio headers with each of the implementations available
+//	on the CPU, reports nanoseconds per header.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "rpmcpio.h"
+#include "reada.h"
+#include "input.h"
+#include "header.h"
+#include "zreader.h"
+#include "newc.h"
+
+#define PROG "rpmbench"
+#define die(fmt, args...) fprintf(stderr, PROG ": " fmt "\n", ##args), exit(128)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int list(int argc, char **argv)
+{
+    unsigned long long nent = 0, size = 0;
+    struct rpmcpio_stats total = { 0 }, st;
+    double start = now();
+    // A single handle, reopened for each package.
+    struct rpmcpio *cpio = rpmcpio_open(AT_FDCWD, argv[0], NULL);
+    for (int i = 0; i < argc; i++) {
+	if (i)
+	    rpmcpio_reopen(cpio, AT_FDCWD, argv[i], NULL, NULL);
+	const struct cpioent *ent;
+	while ((ent = rpmcpio_next(cpio)))
+	    nent++, size += ent->size;
+	rpmcpio_stats(cpio, &st);
+	total.zbytes += st.zbytes, total.bytes += st.bytes;
+	total.skip_bytes += st.skip_bytes;
+	total.zread_calls += st.zread_calls, total.refills += st.refills;
+	total.find_hits += st.find_hits;
+	total.find_bsearch += st.find_bsearch;
+	total.find_hash += st.find_hash;
+	total.find_steps += st.find_steps;
+    }
+    rpmcpio_close(cpio);
+    double elapsed = now() - start;
+    printf("list: %d packages, %llu entries, %.1f MB in %.3f s, %.1f MB/s\n",
+	    argc, nent, size / 1e6, elapsed, size / 1e6 / elapsed);
+    printf("decoder: %.1f MB in, %.1f MB out (%.1f MB skipped), "
+	    "%llu calls, %llu buffer refills\n",
+	    total.zbytes / 1e6, total.bytes / 1e6, total.skip_bytes / 1e6,
+	    total.zread_calls, total.refills);
+    unsigned long long nfind = total.find_hits + total.find_bsearch + total.find_hash;
+    if (nfind)
+	printf("header_find: %.1f%% hits, %.1f%% binary search (%.1f steps), %.1f%% hash\n",
+		100.0 * total.find_hits / nfind, 100.0 * total.find_bsearch / nfind,
+		total.find_bsearch ? (double) total.find_steps / total.find_bsearch : 0,
+		100.0 * total.find_hash / nfind);
+    return 0;
+}
+
+static char *slurp(const char *fname, size_t *sizep)
+{
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+	die("%s: %m", fname);
+    char *buf = malloc(st.st_size + 1);
+    if (!buf)
+	die("%s: cannot allocate memory", fname);
+    size_t size = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + size, st.st_size + 1 - size)) > 0)
+	size += n;
+    if (n < 0)
+	die("%s: %m", fname);
+    close(fd);
+    *sizep = size;
+    return buf;
+}
+
+// A cpio entry found by the walk.
+struct ent {
+    const char *fname;
+    unsigned fnamelen;
+};
+
+// Walk the cpio archive in memory, the way rpmcpio_next does, but without
+// any checks; returns the number of entries, filled in ents[] if there
+// are filenames, i.e. unless the headers are stripped.
+static unsigned walk(struct header *h, const char *cpio, size_t size, struct ent *ents)
+{
+    // Each entry is a file listed in the header.
+    unsigned nent = 0;
+    size_t pos = 0;
+    // The number of files in the current hardlink set, with stripped headers.
+    unsigned nhard = 0;
+    while (1) {
+	if (size - pos < 110)
+	    die("truncated cpio");
+	const char *p = cpio + pos;
+	unsigned v[13];
+	unsigned long long fsize;
+	if (nent == h->fileCount && memcmp(p + 110, "TRAILER!!!", 11))
+	    die("too many cpio entries");
+	if (memcmp(p, "07070X", 6) == 0) {
+	    unsigned ix;
+	    if (!hex8(p + 6, &ix) || ix >= h->fileCount)
+		die("bad stripped cpio header");
+	    pos += 16;
+	    fsize = h->ffx[ix].size;
+	    // Only the last file in a hardlink set comes with data.
+	    if (h->ffx[ix].nlink > 1) {
+		if (++nhard < h->ffx[ix].nlink)
+		    fsize = 0;
+		else
+		    nhard = 0;
+	    }
+	}
+	else {
+	    if (!newc_parse(p, v) || v[11] < 2)
+		die("bad cpio header");
+	    const char *fname = p + 110;
+	    unsigned fnamelen = v[11] - 1;
+	    if (fnamelen == 10 && memcmp(fname, "TRAILER!!!", 10) == 0)
+		break;
+	    pos += (110 + v[11] + 3) & ~3;
+	    fsize = v[6];
+	    if (fname[0] == '.' && !h->src.rpm)
+		fname++, fnamelen--;
+	    ents[nent] = (struct ent) { fname, fnamelen };
+	}
+	nent++;
+	pos += (fsize + 3) & ~3ULL;
+	if (pos > size)
+	    die("truncated cpio");
+    }
+    return nent;
+}
+
+static int stages(int argc, char **argv)
+{
+    struct header h;
+    header_init(&h);
+    struct zreader z = { .fini = NULL };
+    char *cpio = NULL;
+    size_t cpioalloc = 0;
+    struct ent *ents = NULL;
+    unsigned entalloc = 0;
+    unsigned long long nent = 0, nfind = 0, zsize = 0, size = 0;
+    double thdr = 0, tz = 0, tcpio = 0, tfind = 0, tall = 0;
+    for (int i = 0; i < argc; i++) {
+	size_t rpmsize;
+	char *rpm = slurp(argv[i], &rpmsize);
+	struct input in = { NULL, rpm, rpm + rpmsize };
+	const char *err;
+
+	double start = now();
+	if (!header_read(&h, &in, 0, &err))
+	    die("%s: %s", argv[i], err);
+	thdr += now() - start;
+	zsize += rpmsize - in.pos;
+	if (entalloc < h.fileCount) {
+	    entalloc = h.fileCount;
+	    ents = realloc(ents, entalloc * sizeof *ents);
+	    if (!ents)
+		die("cannot allocate memory");
+	}
+
+	start = now();
+	if (!zreader_reinit(&z, h.zprog, NULL))
+	    die("%s: cannot initialize %s decompressor", argv[i], h.zprog);
+	size_t len = 0, n;
+	do {
+	    if (cpioalloc - len < (1 << 20)) {
+		cpioalloc = cpioalloc ? 2 * cpioalloc : (16 << 20);
+		cpio = realloc(cpio, cpioalloc);
+		if (!cpio)
+		    die("cannot allocate memory");
+	    }
+	    n = zreader_read(&z, &in, cpio + len, cpioalloc - len);
+	    if (n == (size_t) -1)
+		die("%s: %s decompression failed", argv[i], h.zprog);
+	    len += n;
+	} while (n);
+	tz += now() - start;
+	size += len;
+
+	start = now();
+	unsigned k = walk(&h, cpio, len, ents);
+	tcpio += now() - start;
+	nent += k;
+
+	if (!h.longfile.sizes) {
+	    start = now();
+	    for (unsigned j = 0; j < k; j++)
+		if (header_find(&h, ents[j].fname, ents[j].fnamelen) == -1)
+		    die("%s: %s: file not in rpm header", argv[i], ents[j].fname);
+	    tfind += now() - start;
+	    nfind += k;
+	}
+	free(rpm);
+
+	start = now();
+	struct rpmcpio *c = rpmcpio_open(AT_FDCWD, argv[i], NULL);
+	while (rpmcpio_next(c))
+	    ;
+	rpmcpio_close(c);
+	tall += now() - start;
+    }
+    zreader_fini(&z);
+    header_freedata(&h);
+    free(cpio), free(ents);
+    printf("stages: %d packages, %llu entries, %.1f MB compressed, %.1f MB cpio\n",
+	    argc, nent, zsize / 1e6, size / 1e6);
+    printf("header_read %8.3f s %10.1f us/package\n", thdr, thdr * 1e6 / argc);
+    printf("decompress  %8.3f s %10.1f MB/s\n", tz, size / 1e6 / tz);
+    printf("cpio        %8.3f s %10.1f ns/entry\n", tcpio, tcpio * 1e9 / nent);
+    if (nfind)
+	printf("header_find %8.3f s %10.1f ns/entry\n", tfind, tfind * 1e9 / nfind);
+    printf("rpmcpio     %8.3f s %10.1f MB/s\n", tall, size / 1e6 / tall);
+    return 0;
+}
+
+// Read all file data in place, returns the number of bytes.
+static unsigned long long readall(int argc, char **argv, unsigned flags)
+{
+    unsigned long long size = 0;
+    struct rpmcpio_opt opt = { .flags = flags };
+    struct rpmcpio *cpio = rpmcpio_openx(AT_FDCWD, argv[0], NULL, &opt);
+    for (int i = 0; i < argc; i++) {
+	if (i)
+	    rpmcpio_reopen(cpio, AT_FDCWD, argv[i], NULL, &opt);
+	const struct cpioent *ent;
+	while ((ent = rpmcpio_next(cpio))) {
+	    if (!S_ISREG(ent->mode))
+		continue;
+	    const void *p;
+	    size_t n;
+	    while ((p = rpmcpio_peek(cpio, &n))) {
+		rpmcpio_consume(cpio, n);
+		size += n;
+	    }
+	}
+    }
+    rpmcpio_close(cpio);
+    return size;
+}
+
+static int digest(int argc, char **argv)
+{
+    double start = now();
+    unsigned long long size = readall(argc, argv, 0);
+    double t0 = now() - start;
+    start = now();
+    readall(argc, argv, RPMCPIO_DIGEST);
+    double t1 = now() - start;
+    start = now();
+    readall(argc, argv, RPMCPIO_DIGEST | RPMCPIO_PAYLOAD_DIGEST);
+    double t2 = now() - start;
+    printf("digest: %d packages, %.1f MB of file data\n", argc, size / 1e6);
+    printf("read        %8.3f s %10.1f MB/s\n", t0, size / 1e6 / t0);
+    printf("+files      %8.3f s %10.1f MB/s\n", t1, size / 1e6 / t1);
+    printf("+payload    %8.3f s %10.1f MB/s\n", t2, size / 1e6 / t2);
+    return 0;
+}
+
+// Extract the packages under dname/sub, prints the time.
+static void extractall(int argc, char **argv, const char *dname,
+		       const char *sub, unsigned flags, unsigned long long size)
+{
+    int dirfd = open(dname, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0)
+	die("%s: %m", dname);
+    if (mkdirat(dirfd, sub, 0755) < 0 && errno != EEXIST)
+	die("%s/%s: %m", dname, sub);
+    int subfd = openat(dirfd, sub, O_RDONLY | O_DIRECTORY);
+    if (subfd < 0)
+	die("%s/%s: %m", dname, sub);
+    struct rpmcpio_opt opt = { .flags = RPMCPIO_TIMING };
+    unsigned long long decode_ns = 0, write_ns = 0, wait_ns = 0;
+    double start = now();
+    struct rpmcpio *cpio = rpmcpio_openx(AT_FDCWD, argv[0], NULL, &opt);
+    for (int i = 0; i < argc; i++) {
+	if (i)
+	    rpmcpio_reopen(cpio, AT_FDCWD, argv[i], NULL, &opt);
+	if (rpmcpio_extract(cpio, subfd, flags) < 0)
+	    die("%s", rpmcpio_strerror(cpio));
+	struct rpmcpio_stats st;
+	rpmcpio_stats(cpio, &st);
+	decode_ns += st.decode_ns, write_ns += st.write_ns, wait_ns += st.wait_ns;
+    }
+    rpmcpio_close(cpio);
+    double elapsed = now() - start;
+    close(subfd), close(dirfd);
+    printf("%-11s %8.3f s %10.1f MB/s  decode %.3f s, write %.3f s, wait %.3f s\n",
+	   sub, elapsed, size / 1e6 / elapsed, decode_ns / 1e9, write_ns / 1e9, wait_ns / 1e9);
+}
+
+static int extract(int argc, char **argv)
+{
+    const char *dname = argv[0];
+    argc--, argv++;
+    if (mkdir(dname, 0755) < 0 && errno != EEXIST)
+	die("%s: %m", dname);
+    double start = now();
+    unsigned long long size = readall(argc, argv, 0);
+    double t0 = now() - start;
+    printf("extract: %d packages, %.1f MB of file data\n", argc, size / 1e6);
+    printf("read        %8.3f s %10.1f MB/s\n", t0, size / 1e6 / t0);
+    extractall(argc, argv, dname, "plain", RPMCPIO_EXTRACT_NOURING, size);
+    extractall(argc, argv, dname, "uring", 0, size);
+    extractall(argc, argv, dname, "writers", RPMCPIO_EXTRACT_WRITERS(4), size);
+    return 0;
+}
+
+struct pushed {
+    unsigned long long size, since;
+    bool done;
+};
+
+static int pushdata(void *arg, struct rpmcpio *cpio, const void *buf, size_t size)
+{
+    struct pushed *ps = arg;
+    ps->size += size;
+    ps->since += size;
+    if (ps->since >= (1 << 20)) {
+	ps->since = 0;
+	rpmcpio_pause(cpio);
+    }
+    return 0;
+}
+
+static int pushentry(void *arg, struct rpmcpio *cpio, const struct cpioent *ent)
+{
+    return !S_ISREG(ent->mode);
+}
+
+static void pushdone(void *arg, struct rpmcpio *cpio, const char *err)
+{
+    struct pushed *ps = arg;
+    if (err)
+	die("%s", err);
+    ps->done = true;
+}
+
+// Feed the packages in pieces of the given size, prints the time.
+static void pushall(int argc, char **argv, size_t piece, unsigned long long size)
+{
+    char *buf = malloc(piece);
+    if (!buf)
+	die("cannot allocate memory");
+    struct pushed ps = { 0 };
+    struct rpmcpio_push cb = { pushentry, pushdata, pushdone, &ps };
+    unsigned long long calls = 0;
+    double start = now();
+    for (int i = 0; i < argc; i++) {
+	char errbuf[RPMCPIO_ERRSIZE];
+	struct rpmcpio *cpio = rpmcpio_push_open(argv[i], NULL, &cb, errbuf);
+	if (!cpio)
+	    die("%s", errbuf);
+	int fd = open(argv[i], O_RDONLY);
+	if (fd < 0)
+	    die("%s: %m", argv[i]);
+	ps.done = false;
+	ssize_t n;
+	do {
+	    n = read(fd, buf, piece);
+	    if (n < 0)
+		die("%s: %m", argv[i]);
+	    // After a pause, the rest of the piece is fed again; the last
+	    // call, with n=0, marks the end of the package.
+	    ssize_t off = 0;
+	    do {
+		ssize_t ret = rpmcpio_feed(cpio, buf + off, n - off);
+		calls++;
+		if (ret < 0)
+		    die("%s", rpmcpio_strerror(cpio));
+		off += ret;
+	    } while (off < n);
+	} while (n > 0);
+	close(fd);
+	if (!ps.done)
+	    die("%s: not done", argv[i]);
+	rpmcpio_close(cpio);
+    }
+    double elapsed = now() - start;
+    free(buf);
+    if (ps.size != size)
+	die("push: %llu bytes of file data, expected %llu", ps.size, size);
+    printf("push %-6zu %8.3f s %10.1f MB/s  %llu calls\n",
+	   piece, elapsed, size / 1e6 / elapsed, calls);
+}
+
+static int push(int argc, char **argv)
+{
+    double start = now();
+    unsigned long long size = readall(argc, argv, 0);
+    double t0 = now() - start;
+    printf("push: %d packages, %.1f MB of file data\n", argc, size / 1e6);
+    printf("read        %8.3f s %10.1f MB/s\n", t0, size / 1e6 / t0);
+    pushall(argc, argv, 4 << 10, size);
+    pushall(argc, argv, 64 << 10, size);
+    return 0;
+}
+
+#define NHDR 4096
+
+static int hexbench(void)
+{
+    // Random headers, as written by rpm, though with mixed-case digits.
+    static char hdr[NHDR][112];
+    srand(1);
+    for (int i = 0; i < NHDR; i++) {
+	char *p = hdr[i] + sprintf(hdr[i], "070701");
+	for (int j = 0; j < 13; j++) {
+	    unsigned v = rand() % 4 ? rand() % 1000 : (unsigned) rand() << 1;
+	    p += sprintf(p, rand() % 2 ? "%08x" : "%08X", v);
+	}
+    }
+    struct { const char *name; bool (*parse)(const char buf[110], unsigned v[13]); } impl[] = {
+	{ "table", newc_parse_table },
+	{ "swar", newc_parse_swar },
+#ifdef NEWC_SIMD
+	{ "sse4.1", __builtin_cpu_supports("sse4.1") ? newc_parse_sse41 : NULL },
+	{ "avx2", __builtin_cpu_supports("avx2") ? newc_parse_avx2 : NULL },
+#endif
+    };
+    static unsigned ref[NHDR][13];
+    for (int i = 0; i < NHDR; i++)
+	if (!newc_parse_table(hdr[i], ref[i]))
+	    return fprintf(stderr, PROG ": bad test header\n"), 1;
+    for (size_t k = 0; k < sizeof impl / sizeof *impl; k++) {
+	if (!impl[k].parse) {
+	    printf("hex %s: not supported\n", impl[k].name);
+	    continue;
+	}
+	unsigned v[13], sum = 0;
+	for (int i = 0; i < NHDR; i++)
+	    if (!impl[k].parse(hdr[i], v) || memcmp(v, ref[i], sizeof v))
+		return fprintf(stderr, PROG ": %s: wrong result\n", impl[k].name), 1;
+	int rounds = 1000;
+	double start = now();
+	for (int r = 0; r < rounds; r++)
+	    for (int i = 0; i < NHDR; i++)
+		impl[k].parse(hdr[i], v), sum += v[6];
+	double elapsed = now() - start;
+	printf("hex %s: %.2f ns/header (%u)\n", impl[k].name,
+		elapsed * 1e9 / rounds / NHDR, sum);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+	goto usage;
+    if (strcmp(argv[1], "list") == 0 && argc > 2)
+	return list(argc - 2, argv + 2);
+    if (strcmp(argv[1], "stages") == 0 && argc > 2)
+	return stages(argc - 2, argv + 2);
+    if (strcmp(argv[1], "digest") == 0 && argc > 2)
+	return digest(argc - 2, argv + 2);
+    if (strcmp(argv[1], "extract") == 0 && argc > 3)
+	return extract(argc - 2, argv + 2);
+    if (strcmp(argv[1], "push") == 0 && argc > 2)
+	return push(argc - 2, argv + 2);
+    if (strcmp(argv[1], "hex") == 0 && argc == 2)
+	return hexbench();
+usage:
+    fprintf(stderr, "Usage: " PROG " list RPM...\n"
+		    "       " PROG " stages RPM...\n"
+		    "       " PROG " digest RPM...\n"
+		    "       " PROG " extract DIR RPM...\n"
+		    "       " PROG " push RPM...\n"
+		    "       " PROG " hex\n");
+    return 2;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
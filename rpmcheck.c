@@ -0,0 +1,961 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Tests for the rpmcpio library, run by "make check" on packages generated
+// with mkrpm.  Each test exits with a non-zero status on the first failure.
+//
+// rpmcheck read RPM...
+//	Read the packages in full, then again in every other way: with each
+//	of the RPMCPIO_* options which change how the data is read, from a
+//	pipe, from memory, and pushed in pieces; the entries and their data
+//	must come out the same, with the digests verified.  The header-only
+//	listing must have the same files, the filters must select the right
+//	ones (and stop early), and the tags in the header must agree with
+//	them.
+//
+// rpmcheck corrupt RPM...
+//	Change a file digest in the header, then flip bytes at various
+//	offsets in the payload: reading the package, with the digests
+//	verified, must fail.
+//
+// rpmcheck openat [-s] RPM [IDX]
+//	Open each file with rpmcpio_open_at, with the gzip index built into
+//	IDX, or else by seeking the xz payload (or decompressing from the
+//	start), and compare with the full read.  With -s, the files in the
+//	last quarter of the payload must be reached by seeking, that is,
+//	without decompressing the first half (open_at falls back silently).
+//	With IDX, tampered copies of the index must be rejected.
+//
+// rpmcheck extract DIR RPM...
+//	Extract the packages under DIR (into DIR/plain, DIR/uring, etc., one
+//	for each way of writing the files), and compare the trees with the
+//	entries: file types, modes, mtimes, data, symlink targets, hardlinks.
+//	The paths are looked up with the symlinks confined to the tree, as
+//	the library does.  A symlink to ../../NAME (at any depth, such as the
+//	one made with mkrpm -E) is taken to lead to DIR/NAME, where decoys
+//	are planted for the entries under the symlink; they must stay intact.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include "rpmcpio.h"
+
+#define PROG "rpmcheck"
+#define die(fmt, args...) fprintf(stderr, PROG ": " fmt "\n", ##args), exit(1)
+
+// An entry, with a hash of its data (or of the symlink target).
+struct file {
+    char *fname, *linkto;
+    unsigned mode, mtime, ino, nlink;
+    unsigned long long size, hash;
+};
+
+struct files {
+    struct file *v;
+    size_t n, alloc;
+};
+
+#define HASHINIT 14695981039346656037ULL
+
+// FNV-1a, which is good enough to tell the data apart.
+static unsigned long long hash(unsigned long long h, const void *p, size_t n)
+{
+    const unsigned char *s = p;
+    while (n--)
+	h = (h ^ *s++) * 1099511628211ULL;
+    return h;
+}
+
+static struct file *add(struct files *ff, const struct cpioent *ent)
+{
+    if (ff->n == ff->alloc) {
+	ff->alloc = ff->alloc ? 2 * ff->alloc : 256;
+	ff->v = realloc(ff->v, ff->alloc * sizeof *ff->v);
+	if (!ff->v)
+	    die("cannot allocate memory");
+    }
+    struct file *f = &ff->v[ff->n++];
+    *f = (struct file) { strdup(ent->fname), NULL, ent->mode, ent->mtime,
+			 ent->ino, ent->nlink, ent->size, HASHINIT };
+    if (!f->fname)
+	die("cannot allocate memory");
+    return f;
+}
+
+static void freefiles(struct files *ff)
+{
+    for (size_t i = 0; i < ff->n; i++)
+	free(ff->v[i].fname), free(ff->v[i].linkto);
+    free(ff->v);
+    *ff = (struct files) { 0 };
+}
+
+// Read the remaining entries, along with their data.
+static void collect(struct rpmcpio *cpio, const char *what, struct files *ff)
+{
+    int rc;
+    const struct cpioent *ent;
+    while ((rc = rpmcpio_next2(cpio, &ent)) > 0) {
+	struct file *f = add(ff, ent);
+	if (S_ISREG(ent->mode)) {
+	    const void *p;
+	    ssize_t n;
+	    while ((n = rpmcpio_peek2(cpio, &p)) > 0) {
+		f->hash = hash(f->hash, p, n);
+		rpmcpio_consume(cpio, n);
+	    }
+	    if (n < 0)
+		die("%s: %s", what, rpmcpio_strerror(cpio));
+	}
+	else if (S_ISLNK(ent->mode)) {
+	    char buf[4096];
+	    ssize_t n = rpmcpio_readlink2(cpio, buf);
+	    if (n < 0)
+		die("%s: %s", what, rpmcpio_strerror(cpio));
+	    f->hash = hash(f->hash, buf, n);
+	    if (!(f->linkto = strdup(buf)))
+		die("cannot allocate memory");
+	}
+    }
+    if (rc < 0)
+	die("%s: %s", what, rpmcpio_strerror(cpio));
+}
+
+static void compare(const struct files *a, const struct files *b,
+		    const char *rpm, const char *what)
+{
+    if (a->n != b->n)
+	die("%s %s: %zu entries, expected %zu", rpm, what, b->n, a->n);
+    for (size_t i = 0; i < a->n; i++) {
+	const struct file *x = &a->v[i], *y = &b->v[i];
+	if (strcmp(x->fname, y->fname) || x->mode != y->mode ||
+		x->mtime != y->mtime || x->size != y->size || x->hash != y->hash)
+	    die("%s %s: %s: entry differs", rpm, what, y->fname);
+    }
+}
+
+static void readfile(const char *rpm, const struct rpmcpio_opt *opt, struct files *ff)
+{
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, rpm, NULL, opt, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    collect(cpio, rpm, ff);
+    rpmcpio_close(cpio);
+}
+
+
+static char *slurp(const char *fname, size_t *sizep)
+{
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+	die("%s: %m", fname);
+    char *buf = malloc(st.st_size + 1);
+    if (!buf)
+	die("cannot allocate memory");
+    size_t size = 0;
+    while (size < st.st_size) {
+	ssize_t n = read(fd, buf + size, st.st_size - size);
+	if (n <= 0)
+	    die("%s: read failed", fname);
+	size += n;
+    }
+    close(fd);
+    *sizep = size;
+    return buf;
+}
+
+
+struct writer {
+    int fd;
+    const char *buf;
+    size_t size;
+};
+
+static void *writer(void *arg)
+{
+    struct writer *w = arg;
+    for (size_t off = 0; off < w->size; ) {
+	// Small writes, so that the reader sees short reads.
+	size_t n = w->size - off < 1000 ? w->size - off : 1000;
+	ssize_t ret = write(w->fd, w->buf + off, n);
+	if (ret < 0)
+	    break;
+	off += ret;
+    }
+    close(w->fd);
+    return NULL;
+}
+
+// Read the package from a pipe, fed by another thread.
+static void readpipe(const char *rpm, const char *buf, size_t size, struct files *ff)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+	die("pipe: %m");
+    struct writer w = { fds[1], buf, size };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer, &w))
+	die("pthread_create failed");
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_fdopen(fds[0], "pipe", NULL, NULL, errbuf);
+    if (!cpio)
+	die("%s %s", rpm, errbuf);
+    collect(cpio, rpm, ff);
+    rpmcpio_close(cpio);
+    close(fds[0]);
+    pthread_join(thread, NULL);
+}
+
+
+// The push callbacks build the same list as collect.
+struct pushed {
+    struct files *ff;
+    bool done;
+};
+
+static int pushentry(void *arg, struct rpmcpio *cpio, const struct cpioent *ent)
+{
+    struct pushed *ps = arg;
+    add(ps->ff, ent);
+    // Pause now and then, to have some of the input fed again.
+    if (ps->ff->n % 5 == 0)
+	rpmcpio_pause(cpio);
+    return 0;
+}
+
+static int pushdata(void *arg, struct rpmcpio *cpio, const void *buf, size_t size)
+{
+    struct pushed *ps = arg;
+    struct file *f = &ps->ff->v[ps->ff->n - 1];
+    f->hash = hash(f->hash, buf, size);
+    return 0;
+}
+
+static void pushdone(void *arg, struct rpmcpio *cpio, const char *err)
+{
+    struct pushed *ps = arg;
+    if (err)
+	die("%s", err);
+    ps->done = true;
+}
+
+// Push the package in pieces of 1 to 2000 bytes.
+static void readpush(const char *rpm, const char *buf, size_t size, struct files *ff)
+{
+    struct pushed ps = { ff };
+    struct rpmcpio_push cb = { pushentry, pushdata, pushdone, &ps };
+    struct rpmcpio_opt opt = { .flags = RPMCPIO_DIGEST | RPMCPIO_PAYLOAD_DIGEST };
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_push_open(rpm, &opt, &cb, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    srand(size);
+    size_t off = 0;
+    while (off < size) {
+	size_t n = 1 + rand() % 2000;
+	if (n > size - off)
+	    n = size - off;
+	ssize_t ret = rpmcpio_feed(cpio, buf + off, n);
+	if (ret < 0)
+	    die("%s", rpmcpio_strerror(cpio));
+	off += ret;
+    }
+    if (rpmcpio_feed(cpio, NULL, 0) < 0)
+	die("%s", rpmcpio_strerror(cpio));
+    if (!ps.done)
+	die("%s push: not done", rpm);
+    rpmcpio_close(cpio);
+}
+
+
+static int cmpname(const void *a, const void *b)
+{
+    return strcmp(((const struct file *) a)->fname, ((const struct file *) b)->fname);
+}
+
+// The header-only listing has the same files, %ghost files aside, though
+// not necessarily in the same order (and with hardlinks, the sizes differ).
+static void checkhdr(const char *rpm, const struct files *ref)
+{
+    struct rpmcpio_opt opt = { .flags = RPMCPIO_HEADER_ONLY };
+    struct files a = { 0 }, b = { 0 };
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, rpm, NULL, &opt, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    int rc;
+    const struct cpioent *ent;
+    while ((rc = rpmcpio_next2(cpio, &ent)) > 0)
+	if (!(ent->fflags & (1 << 6)))
+	    add(&a, ent);
+    if (rc < 0)
+	die("%s", rpmcpio_strerror(cpio));
+    rpmcpio_close(cpio);
+    for (size_t i = 0; i < ref->n; i++)
+	add(&b, &(struct cpioent) { .fname = ref->v[i].fname,
+				    .mode = ref->v[i].mode, .mtime = ref->v[i].mtime });
+    if (a.n != b.n)
+	die("%s header-only: %zu entries, expected %zu", rpm, a.n, b.n);
+    qsort(a.v, a.n, sizeof *a.v, cmpname);
+    qsort(b.v, b.n, sizeof *b.v, cmpname);
+    for (size_t i = 0; i < a.n; i++)
+	if (strcmp(a.v[i].fname, b.v[i].fname) || a.v[i].mode != b.v[i].mode ||
+		a.v[i].mtime != b.v[i].mtime)
+	    die("%s header-only: %s: entry differs", rpm, a.v[i].fname);
+    freefiles(&a), freefiles(&b);
+}
+
+
+// Read the package with the filter, which should select the ref entries
+// marked in sel[], plus the last file of each hardlink set with a selected
+// file (the one with the data).  Returns the uncompressed bytes produced.
+static unsigned long long filtered(const char *rpm, const struct files *ref,
+				   const struct rpmcpio_filter *filter,
+				   bool *sel, const char *what)
+{
+    // The files of a hardlink set are adjacent in the payload.
+    for (size_t i = 0; i < ref->n; i++) {
+	const struct file *f = &ref->v[i];
+	if (sel[i] && S_ISREG(f->mode) && f->nlink > 1) {
+	    size_t j = i;
+	    while (j + 1 < ref->n && ref->v[j+1].ino == f->ino &&
+		    ref->v[j+1].nlink == f->nlink)
+		j++;
+	    sel[j] = true;
+	}
+    }
+    struct files a = { 0 }, b = { 0 };
+    for (size_t i = 0; i < ref->n; i++)
+	if (sel[i]) {
+	    struct file *f = add(&b, &(struct cpioent) { .fname = ref->v[i].fname });
+	    char *fname = f->fname;
+	    *f = ref->v[i];
+	    f->fname = fname, f->linkto = NULL;
+	}
+    struct rpmcpio_opt opt = { .filter = filter };
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, rpm, NULL, &opt, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    collect(cpio, rpm, &a);
+    struct rpmcpio_stats st;
+    rpmcpio_stats(cpio, &st);
+    rpmcpio_close(cpio);
+    compare(&b, &a, rpm, what);
+    freefiles(&a), freefiles(&b);
+    return st.bytes;
+}
+
+static bool endswith(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// The filter selects the files by name, flags and type.
+static void checkfilter(const char *rpm, const struct files *ref)
+{
+    bool *sel = calloc(ref->n + 1, sizeof *sel);
+    if (!sel)
+	die("cannot allocate memory");
+#define SEL(expr) for (size_t i = 0; i < ref->n; i++) { \
+	const struct file *f = &ref->v[i]; sel[i] = (expr); (void) f; }
+
+    // Only the symlinks, though all the data is decompressed.
+    struct rpmcpio_filter filter = { .types = RPMCPIO_TYPE(S_IFLNK) };
+    SEL(S_ISLNK(f->mode));
+    filtered(rpm, ref, &filter, sel, "filter types");
+
+    // Globs, in which '*' also matches '/'.
+    const char *globs[] = { "*3", "/usr/*/d0001/*", NULL };
+    filter = (struct rpmcpio_filter) { .fnames = globs };
+    SEL(endswith(f->fname, "3") || (strncmp(f->fname, "/usr/", 5) == 0 &&
+	strstr(f->fname + 4, "/d0001/") && !endswith(f->fname, "/d0001/")));
+    filtered(rpm, ref, &filter, sel, "filter globs");
+
+    // Prefixes, which do not select the directory itself.
+    const char *prefixes[] = { "/usr/share/bench/d0000/", "/usr/bin/", NULL };
+    filter = (struct rpmcpio_filter) { .fnames = prefixes };
+    SEL(strncmp(f->fname, prefixes[0], strlen(prefixes[0])) == 0 ||
+	strncmp(f->fname, prefixes[1], strlen(prefixes[1])) == 0);
+    filtered(rpm, ref, &filter, sel, "filter prefixes");
+
+    // The %ghost file is not in the payload; mkrpm sets no other flags.
+    filter = (struct rpmcpio_filter) { .fflags_set = 1 << 6 };
+    SEL(false);
+    filtered(rpm, ref, &filter, sel, "filter fflags_set");
+    filter = (struct rpmcpio_filter) { .fflags_clear = 1 << 6,
+				       .types = RPMCPIO_TYPE(S_IFREG) };
+    SEL(S_ISREG(f->mode));
+    filtered(rpm, ref, &filter, sel, "filter fflags_clear");
+
+    // Only the first file of each hardlink set (mkrpm names them *-0),
+    // which comes with no data: the last file has to be returned as well.
+    const char *first[] = { "*-0", NULL };
+    filter = (struct rpmcpio_filter) { .fnames = first };
+    SEL(endswith(f->fname, "-0"));
+    filtered(rpm, ref, &filter, sel, "filter hardlinks");
+
+    // The first entry alone: the rest of the payload is not decompressed.
+    const char *one[] = { ref->v[0].fname, NULL };
+    filter = (struct rpmcpio_filter) { .fnames = one };
+    SEL(i == 0);
+    unsigned long long bytes = filtered(rpm, ref, &filter, sel, "filter early");
+    struct rpmcpio_stats st;
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, rpm, NULL, NULL, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    rpmcpio_stats(cpio, &st);
+    rpmcpio_close(cpio);
+    if (st.payload_size && bytes > st.payload_size / 2)
+	die("%s filter early: %llu of %llu bytes decompressed", rpm,
+	    bytes, st.payload_size);
+#undef SEL
+    free(sel);
+}
+
+
+// The tags from the header agree with the package and with the entries.
+static void checktags(const char *rpm, const struct files *ref)
+{
+    struct rpmcpio_opt opt = { .flags = RPMCPIO_HEADER_TAGS };
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, rpm, NULL, &opt, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    const char *name = rpmcpio_tag_str(cpio, 1000); // NAME
+    if (!name || strcmp(name, "bench"))
+	die("%s tags: wrong NAME", rpm);
+    int rc;
+    size_t i = 0;
+    const struct cpioent *ent;
+    while ((rc = rpmcpio_next2(cpio, &ent)) > 0) {
+	const struct file *f = &ref->v[i++];
+	if (i > ref->n || strcmp(ent->fname, f->fname))
+	    die("%s tags: %s: unexpected entry", rpm, ent->fname);
+	unsigned mode, mtime;
+	if (rpmcpio_ent_int(cpio, 1030, &mode) <= 0 || mode != f->mode || // FILEMODES
+		rpmcpio_ent_int(cpio, 1034, &mtime) <= 0 || mtime != f->mtime) // FILEMTIMES
+	    die("%s tags: %s: wrong mode or mtime", rpm, f->fname);
+	if (S_ISLNK(f->mode)) {
+	    const char *linkto = rpmcpio_ent_str(cpio, 1036); // FILELINKTOS
+	    if (!linkto || hash(HASHINIT, linkto, strlen(linkto)) != f->hash)
+		die("%s tags: %s: wrong symlink target", rpm, f->fname);
+	}
+    }
+    if (rc < 0)
+	die("%s", rpmcpio_strerror(cpio));
+    if (i != ref->n)
+	die("%s tags: %zu entries, expected %zu", rpm, i, ref->n);
+    rpmcpio_close(cpio);
+}
+
+static int cmdread(int argc, char **argv)
+{
+    static const struct { const char *what; struct rpmcpio_opt opt; } ways[] = {
+	{ "mmap", { .flags = RPMCPIO_MMAP } },
+	{ "pipeline", { .flags = RPMCPIO_PIPELINE } },
+	{ "digest", { .flags = RPMCPIO_DIGEST } },
+	{ "payload", { .flags = RPMCPIO_PAYLOAD_DIGEST } },
+	{ "tags", { .flags = RPMCPIO_MMAP | RPMCPIO_HEADER_TAGS } },
+	{ "pipeline+digest", { .flags = RPMCPIO_PIPELINE | RPMCPIO_DIGEST |
+					RPMCPIO_PAYLOAD_DIGEST } },
+	{ "xzthreads", { .xzthreads = 4 } },
+    };
+    for (int i = 0; i < argc; i++) {
+	const char *rpm = argv[i];
+	struct files ref = { 0 }, ff = { 0 };
+	readfile(rpm, NULL, &ref);
+	for (size_t k = 0; k < sizeof ways / sizeof *ways; k++) {
+	    readfile(rpm, &ways[k].opt, &ff);
+	    compare(&ref, &ff, rpm, ways[k].what);
+	    freefiles(&ff);
+	}
+	size_t size;
+	char *buf = slurp(rpm, &size);
+	char errbuf[RPMCPIO_ERRSIZE];
+	struct rpmcpio_opt opt = { .flags = RPMCPIO_DIGEST | RPMCPIO_PAYLOAD_DIGEST };
+	struct rpmcpio *cpio = rpmcpio_memopen(buf, size, rpm, NULL, &opt, errbuf);
+	if (!cpio)
+	    die("%s", errbuf);
+	collect(cpio, rpm, &ff);
+	rpmcpio_close(cpio);
+	compare(&ref, &ff, rpm, "memopen");
+	freefiles(&ff);
+	readpipe(rpm, buf, size, &ff);
+	compare(&ref, &ff, rpm, "fdopen");
+	freefiles(&ff);
+	readpush(rpm, buf, size, &ff);
+	compare(&ref, &ff, rpm, "push");
+	freefiles(&ff);
+	free(buf);
+	checkhdr(rpm, &ref);
+	checkfilter(rpm, &ref);
+	checktags(rpm, &ref);
+	printf("%s: %zu entries ok\n", rpm, ref.n);
+	freefiles(&ref);
+    }
+    return 0;
+}
+
+// Read all the entries and file data, without dying on error.
+static int drain(struct rpmcpio *cpio)
+{
+    int rc;
+    const struct cpioent *ent;
+    while ((rc = rpmcpio_next2(cpio, &ent)) > 0)
+	if (S_ISREG(ent->mode)) {
+	    const void *p;
+	    ssize_t n;
+	    while ((n = rpmcpio_peek2(cpio, &p)) > 0)
+		rpmcpio_consume(cpio, n);
+	    if (n < 0)
+		return -1;
+	}
+    return rc;
+}
+
+// Write the altered copy to a temporary file, tmp being "rpmcheck.XXXXXX".
+static void tmpcopy(char *tmp, const char *buf, size_t size)
+{
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+	die("mkstemp: %m");
+    for (size_t off = 0; off < size; ) {
+	ssize_t n = write(fd, buf + off, size - off);
+	if (n <= 0)
+	    die("%s: write failed", tmp);
+	off += n;
+    }
+    close(fd);
+}
+
+// Whether reading the altered copy of the package fails.  The copy goes
+// to a temporary file, which, unlike a pipe, can be read again (as needed
+// for the MD5 of the header and the payload).
+static bool fails(const char *buf, size_t size, unsigned flags)
+{
+    char tmp[] = "rpmcheck.XXXXXX";
+    tmpcopy(tmp, buf, size);
+    struct rpmcpio_opt opt = { .flags = flags };
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, tmp, NULL, &opt, errbuf);
+    bool failed = !cpio;
+    if (cpio) {
+	failed = drain(cpio) < 0;
+	rpmcpio_close(cpio);
+    }
+    unlink(tmp);
+    return failed;
+}
+
+// Change the digest of a file in the header, which must be caught once
+// the file data goes by.  The packages without file digests are skipped.
+static void baddigest(const char *rpm, char *buf, size_t size)
+{
+    struct rpmcpio_opt opt = { .flags = RPMCPIO_HEADER_ONLY | RPMCPIO_DIGEST };
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, rpm, NULL, &opt, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    char hex[2 * 64 + 1] = "";
+    int rc;
+    const struct cpioent *ent;
+    while ((rc = rpmcpio_next2(cpio, &ent)) > 0)
+	if (S_ISREG(ent->mode) && ent->nlink == 1 && ent->size &&
+		ent->digest && ent->digestlen <= 64) {
+	    for (unsigned i = 0; i < ent->digestlen; i++)
+		sprintf(hex + 2 * i, "%02x", ent->digest[i]);
+	    break;
+	}
+    if (rc < 0)
+	die("%s", rpmcpio_strerror(cpio));
+    rpmcpio_close(cpio);
+    if (!hex[0])
+	return;
+    char *p = memmem(buf, size, hex, strlen(hex));
+    if (!p)
+	die("%s: digest %s not found in the header", rpm, hex);
+    char c = *p;
+    *p = c == '0' ? '1' : '0';
+    if (!fails(buf, size, RPMCPIO_DIGEST))
+	die("%s: wrong file digest not detected", rpm);
+    *p = c;
+}
+
+// Flip bytes at offsets spread over the payload, the last byte included:
+// if the decoder does not fail first, the payload digest must not match.
+static void badpayload(const char *rpm, char *buf, size_t size)
+{
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, rpm, NULL, NULL, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    struct rpmcpio_stats st;
+    rpmcpio_stats(cpio, &st);
+    rpmcpio_close(cpio);
+    if (st.payload_zsize == 0 || st.payload_zsize > size)
+	die("%s: unknown payload size", rpm);
+    size_t start = size - st.payload_zsize;
+    for (int k = 0; k <= 8; k++) {
+	size_t pos = start + (st.payload_zsize - 1) * k / 8;
+	buf[pos] ^= 0x10;
+	if (!fails(buf, size, RPMCPIO_PAYLOAD_DIGEST))
+	    die("%s: corruption at offset %zu not detected", rpm, pos);
+	buf[pos] ^= 0x10;
+    }
+}
+
+static int cmdcorrupt(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++) {
+	const char *rpm = argv[i];
+	size_t size;
+	char *buf = slurp(rpm, &size);
+	if (fails(buf, size, RPMCPIO_DIGEST | RPMCPIO_PAYLOAD_DIGEST))
+	    die("%s: the intact copy fails", rpm);
+	baddigest(rpm, buf, size);
+	badpayload(rpm, buf, size);
+	free(buf);
+	printf("%s: corruption detected\n", rpm);
+    }
+    return 0;
+}
+
+// Open the file with the altered copy of the index.  Returns false if
+// rpmcpio_open_at fails; any other file than the right one is an error.
+static bool openbad(const char *rpm, const char *buf, size_t size,
+		    const struct file *f)
+{
+    char tmp[] = "rpmcheck.XXXXXX";
+    tmpcopy(tmp, buf, size);
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open_at(AT_FDCWD, rpm, tmp, f->fname, NULL, errbuf);
+    unlink(tmp);
+    if (!cpio)
+	return false;
+    struct files ff = { 0 };
+    collect(cpio, rpm, &ff);
+    rpmcpio_close(cpio);
+    if (ff.n != 1)
+	die("%s bad index: %s: %zu entries", rpm, f->fname, ff.n);
+    compare(&(struct files) { (struct file *) f, 1 }, &ff, rpm, "bad index");
+    freefiles(&ff);
+    return true;
+}
+
+// Tamper with the index (the layout is that of struct filehdr in gzindex.c,
+// followed by off[]): the counts crafted to wrap the size around, the digest
+// of another package, and two offsets swapped.  rpmcpio_open_at must fail
+// rather than crash or return the wrong file.
+static void badindex(const char *rpm, const char *idx, const struct files *ref)
+{
+    size_t size;
+    char *buf = slurp(idx, &size);
+    unsigned fileCount;
+    unsigned long long bloblen;
+    memcpy(&fileCount, buf + 32, 4);
+    memcpy(&bloblen, buf + 40, 8);
+    unsigned xfileCount = fileCount + (1U << 28);
+    unsigned long long xbloblen = bloblen - (1ULL << 31);
+    memcpy(buf + 32, &xfileCount, 4);
+    memcpy(buf + 40, &xbloblen, 8);
+    if (openbad(rpm, buf, size, &ref->v[0]))
+	die("%s: wrapped index size not detected", rpm);
+    memcpy(buf + 32, &fileCount, 4);
+    memcpy(buf + 40, &bloblen, 8);
+
+    buf[48] ^= 1;
+    if (openbad(rpm, buf, size, &ref->v[0]))
+	die("%s: wrong index digest not detected", rpm);
+    buf[48] ^= 1;
+
+    unsigned long long *off = (void *) (buf + 64);
+    unsigned k1 = 0, k2;
+    while (k1 < fileCount && off[k1] == -1)
+	k1++;
+    for (k2 = k1 + 1; k2 < fileCount && off[k2] == -1; k2++)
+	;
+    if (k2 >= fileCount)
+	die("%s: too few index offsets", idx);
+    unsigned long long t = off[k1];
+    off[k1] = off[k2], off[k2] = t;
+    size_t failed = 0;
+    for (size_t i = 0; i < ref->n; i++)
+	if (!openbad(rpm, buf, size, &ref->v[i]))
+	    failed++;
+    if (failed != 2)
+	die("%s: swapped index offsets: %zu files failed, expected 2", rpm, failed);
+    free(buf);
+}
+
+static int cmdopenat(const char *rpm, const char *idx, bool seek)
+{
+    char errbuf[RPMCPIO_ERRSIZE];
+    if (idx && rpmcpio_index_build(AT_FDCWD, rpm, idx, NULL, errbuf) < 0)
+	die("%s", errbuf);
+    struct files ref = { 0 };
+    readfile(rpm, NULL, &ref);
+    for (size_t i = 0; i < ref.n; i++) {
+	const struct file *f = &ref.v[i];
+	struct rpmcpio *cpio = rpmcpio_open_at(AT_FDCWD, rpm, idx, f->fname, NULL, errbuf);
+	if (!cpio)
+	    die("%s", errbuf);
+	struct rpmcpio_stats st;
+	rpmcpio_stats(cpio, &st);
+	if (seek && i >= ref.n * 3 / 4 && st.bytes >= st.payload_size / 2)
+	    die("%s open_at: %s: not reached by seeking", rpm, f->fname);
+	struct files ff = { 0 };
+	collect(cpio, rpm, &ff);
+	rpmcpio_close(cpio);
+	if (ff.n != 1)
+	    die("%s open_at: %s: %zu entries", rpm, f->fname, ff.n);
+	compare(&(struct files) { (struct file *) f, 1 }, &ff, rpm, "open_at");
+	freefiles(&ff);
+    }
+    if (idx)
+	badindex(rpm, idx, &ref);
+    printf("%s: %zu entries opened%s\n", rpm, ref.n, idx ? " with the index" : "");
+    freefiles(&ref);
+    return 0;
+}
+
+
+// The data of a hardlink set comes with the last file.
+static const struct file *linkdata(const struct files *ref, const struct file *f)
+{
+    const struct file *last = f;
+    for (size_t i = 0; i < ref->n; i++)
+	if (ref->v[i].ino == f->ino && ref->v[i].size)
+	    last = &ref->v[i];
+    return last;
+}
+
+// Open the parent directory of the path, resolved as if dirfd were the root
+// directory (with an older kernel, the symlinks are followed as usual).
+static int openparent(int dirfd, const char *path, const char **base)
+{
+    const char *slash = strrchr(path, '/');
+    if (!slash)
+	return *base = path, dup(dirfd);
+    *base = slash + 1;
+    char *dname = strndup(path, slash - path);
+    if (!dname)
+	die("cannot allocate memory");
+    struct open_how how = {
+	.flags = O_PATH | O_DIRECTORY,
+	.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = syscall(SYS_openat2, dirfd, dname, &how, sizeof how);
+    if (fd < 0 && errno == ENOSYS)
+	fd = openat(dirfd, dname, O_PATH | O_DIRECTORY);
+    free(dname);
+    return fd;
+}
+
+static void checktree(int dirfd, const char *dname, const struct files *ref)
+{
+    for (size_t i = 0; i < ref->n; i++) {
+	const struct file *f = &ref->v[i];
+	const char *path = f->fname + strspn(f->fname, "/");
+	const char *base;
+	int pfd = openparent(dirfd, path, &base);
+	struct stat st;
+	if (pfd < 0 || fstatat(pfd, base, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	    die("%s/%s: %m", dname, path);
+	if ((st.st_mode & S_IFMT) != (f->mode & S_IFMT))
+	    die("%s/%s: wrong file type", dname, path);
+	if (S_ISLNK(f->mode)) {
+	    char buf[4096];
+	    ssize_t n = readlinkat(pfd, base, buf, sizeof buf);
+	    if (n < 0 || hash(HASHINIT, buf, n) != f->hash)
+		die("%s/%s: wrong symlink target", dname, path);
+	    close(pfd);
+	    continue;
+	}
+	if ((st.st_mode & 07777) != (f->mode & 07777))
+	    die("%s/%s: wrong mode", dname, path);
+	if (st.st_mtime != f->mtime)
+	    die("%s/%s: wrong mtime", dname, path);
+	if (!S_ISREG(f->mode)) {
+	    close(pfd);
+	    continue;
+	}
+	if (f->nlink > 1) {
+	    f = linkdata(ref, f);
+	    if (st.st_nlink < f->nlink)
+		die("%s/%s: not hardlinked", dname, path);
+	}
+	if (st.st_size != f->size)
+	    die("%s/%s: wrong size", dname, path);
+	int fd = openat(pfd, base, O_RDONLY | O_NOFOLLOW);
+	close(pfd);
+	if (fd < 0)
+	    die("%s/%s: %m", dname, path);
+	unsigned long long h = HASHINIT;
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof buf)) > 0)
+	    h = hash(h, buf, n);
+	close(fd);
+	if (n < 0 || h != f->hash)
+	    die("%s/%s: wrong data", dname, path);
+    }
+}
+
+#define DECOY "decoy\n"
+
+// Plant the decoys, or check that they are intact, for the entries under
+// the symlinks which lead outside the tree.
+static void decoys(const char *dname, const struct files *ref, bool plant)
+{
+    for (size_t i = 0; i < ref->n; i++) {
+	const struct file *l = &ref->v[i];
+	if (!S_ISLNK(l->mode) || strncmp(l->linkto, "../", 3))
+	    continue;
+	const char *name = l->linkto;
+	while (strncmp(name, "../", 3) == 0)
+	    name += 3;
+	char path[4096];
+	snprintf(path, sizeof path, "%s/%s", dname, name);
+	if (plant && mkdir(path, 0755) < 0 && errno != EEXIST)
+	    die("%s: %m", path);
+	size_t len = strlen(l->fname);
+	for (size_t j = 0; j < ref->n; j++) {
+	    const struct file *f = &ref->v[j];
+	    if (strncmp(f->fname, l->fname, len) || f->fname[len] != '/')
+		continue;
+	    snprintf(path, sizeof path, "%s/%s%s", dname, name, f->fname + len);
+	    if (plant) {
+		if (S_ISDIR(f->mode)) {
+		    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+			die("%s: %m", path);
+		    continue;
+		}
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || write(fd, DECOY, strlen(DECOY)) != strlen(DECOY))
+		    die("%s: %m", path);
+		close(fd);
+		continue;
+	    }
+	    struct stat st;
+	    if (lstat(path, &st) < 0)
+		die("%s: %m", path);
+	    if (S_ISDIR(f->mode)) {
+		if (!S_ISDIR(st.st_mode) || (st.st_mode & 07777) != 0700)
+		    die("%s: the decoy has been changed", path);
+		continue;
+	    }
+	    char buf[sizeof DECOY];
+	    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+	    if (!S_ISREG(st.st_mode) || (st.st_mode & 07777) != 0600 ||
+		    st.st_nlink != 1 || fd < 0 ||
+		    read(fd, buf, sizeof buf) != strlen(DECOY) ||
+		    memcmp(buf, DECOY, strlen(DECOY)))
+		die("%s: the decoy has been changed", path);
+	    close(fd);
+	}
+    }
+}
+
+static int cmdextract(int argc, char **argv)
+{
+    static const struct { const char *what; unsigned flags; } ways[] = {
+	{ "plain", RPMCPIO_EXTRACT_NOURING },
+	{ "uring", 0 },
+	{ "sparse", RPMCPIO_EXTRACT_SPARSE },
+	{ "writers", RPMCPIO_EXTRACT_WRITERS(4) },
+    };
+    const char *dname = argv[0];
+    argc--, argv++;
+    if (mkdir(dname, 0755) < 0 && errno != EEXIST)
+	die("%s: %m", dname);
+    for (int i = 0; i < argc; i++) {
+	const char *rpm = argv[i];
+	struct files ref = { 0 };
+	readfile(rpm, NULL, &ref);
+	decoys(dname, &ref, true);
+	for (size_t k = 0; k < sizeof ways / sizeof *ways; k++) {
+	    // Each package goes into a directory of its own.
+	    char sub[4096];
+	    snprintf(sub, sizeof sub, "%s/%s", dname, ways[k].what);
+	    if (mkdir(sub, 0755) < 0 && errno != EEXIST)
+		die("%s: %m", sub);
+	    snprintf(sub, sizeof sub, "%s/%s/%d", dname, ways[k].what, i);
+	    if (mkdir(sub, 0755) < 0 && errno != EEXIST)
+		die("%s: %m", sub);
+	    int dirfd = open(sub, O_RDONLY | O_DIRECTORY);
+	    if (dirfd < 0)
+		die("%s: %m", sub);
+	    char errbuf[RPMCPIO_ERRSIZE];
+	    struct rpmcpio *cpio = rpmcpio_open2(AT_FDCWD, rpm, NULL, NULL, errbuf);
+	    if (!cpio)
+		die("%s", errbuf);
+	    if (rpmcpio_extract(cpio, dirfd, ways[k].flags) < 0)
+		die("%s %s: %s", rpm, ways[k].what, rpmcpio_strerror(cpio));
+	    rpmcpio_close(cpio);
+	    checktree(dirfd, sub, &ref);
+	    decoys(dname, &ref, false);
+	    close(dirfd);
+	}
+	printf("%s: %zu entries extracted\n", rpm, ref.n);
+	freefiles(&ref);
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+	goto usage;
+    if (strcmp(argv[1], "read") == 0 && argc > 2)
+	return cmdread(argc - 2, argv + 2);
+    if (strcmp(argv[1], "corrupt") == 0 && argc > 2)
+	return cmdcorrupt(argc - 2, argv + 2);
+    if (strcmp(argv[1], "openat") == 0 && argc > 2) {
+	bool seek = strcmp(argv[2], "-s") == 0;
+	argc -= 2 + seek, argv += 2 + seek;
+	if (argc == 1 || argc == 2)
+	    return cmdopenat(argv[0], argc == 2 ? argv[1] : NULL, seek);
+    }
+    if (strcmp(argv[1], "extract") == 0 && argc > 3)
+	return cmdextract(argc - 2, argv + 2);
+usage:
+    fprintf(stderr, "Usage: " PROG " read RPM...\n"
+		    "       " PROG " corrupt RPM...\n"
+		    "       " PROG " openat [-s] RPM [IDX]\n"
+		    "       " PROG " extract DIR RPM...\n");
+    return 2;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
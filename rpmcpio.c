@@ -19,132 +19,895 @@
 // SOFTWARE.
 
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
 #include "rpmcpio.h"
 #include "reada.h"
+#include "input.h"
 #include "header.h"
 #include "zreader.h"
+#include "gzindex.h"
+#include "zpipe.h"
+#include "push.h"
+#include "newc.h"
 #include "errexit.h"
 
 struct rpmcpio {
     unsigned long long curpos; // current data pos
     unsigned long long endpos; // end data pos
     struct hard { unsigned ino, mode, nlink, cnt; } hard;
+    // With RPMCPIO_HEADER_ONLY, the entries come from the header,
+    // hix being the index of the next one.
+    bool hdronly;
+    unsigned hix;
+    // The number of entries left to return, -1 if unlimited.
+    unsigned left;
+    // With rpmcpio_open_at, a single entry out of its hardlink set,
+    // which may come without data.
+    bool lone, lonedata;
+    // The entry has already been read by rpmcpio_open_at, and is to be
+    // returned by the first rpmcpio_next2 call.
+    bool pending;
+    // The current entry: the index into ffi[] (-1 before the first one),
+    // and the offset of its cpio header in the uncompressed payload.
+    unsigned ix;
+    unsigned long long entpos;
+    struct input in;
+    // With RPMCPIO_MMAP, the mapping, otherwise map=NULL.
+    void *map;
+    size_t mapsize;
+    // The package file, which is not closed by the library if the fd
+    // was passed by the caller (ownfd=false).
     struct fda fda;
+    bool ownfd;
     char fdabuf[BUFSIZA];
     struct header h;
     struct zreader z;
+    // With RPMCPIO_PIPELINE, the decoder runs in a background thread,
+    // started on the first read, see zpipe.h.
+    bool pipeline;
+    struct zpipe *zp;
+    // The counters maintained as we go, see rpmcpio_stats; zstart is
+    // the offset of the payload.
+    bool timing;
+    struct rpmcpio_stats st;
+    unsigned long long zstart;
+    // With RPMCPIO_DIGEST, file data is hashed with md, while hashing
+    // is set for the current entry.
+    bool digest, hashing;
+    const EVP_MD *md;
+    EVP_MD_CTX *mdctx;
+    // With RPMCPIO_PAYLOAD_DIGEST, the compressed payload is hashed with
+    // zmdctx as the decoder takes it, to be checked at the trailer.
+    bool zverify;
+    EVP_MD_CTX *zmdctx;
+    // With RPMCPIO_HEADER_TAGS, the header is retained, see rpmcpio_tag.
+    bool tags;
+    // With rpmcpio_push_open, the package is parsed by a coroutine, see
+    // push.h, which calls back with the entries and data; the options are
+    // kept until the header is read.  Set by rpmcpio_pause.
+    struct push *push;
+    struct rpmcpio_push cb;
+    struct rpmcpio_opt popt;
+    bool pause;
     struct cpioent ent;
+    // File data decompressed by rpmcpio_peek, not yet consumed.
+    char *win;
+    size_t wpos, wend;
     char buf[8192];
-    char rpmbname[];
+    // The error message, recorded by the functions which return errors,
+    // prefixed with rpmbname.  Once set, the handle is no longer usable.
+    char errbuf[RPMCPIO_ERRSIZE];
+    char rpmbname[NAME_MAX + 1];
 };
 
-struct rpmcpio *rpmcpio_open(int dirfd, const char *rpmfname, unsigned *nent)
+// The size of the rpmcpio_peek window, which also serves as scratch space
+// for skipping file data.  Big enough for the decoders to run at full speed,
+// small enough to stay in L2.
+#define WINSIZE (256 << 10)
+
+// Record the error message and return false.
+static bool vseterr(struct rpmcpio *cpio, const char *fmt, va_list ap)
 {
-    const char *rpmbname = xbasename(rpmfname);
-    int fd = openat(dirfd, rpmfname, O_RDONLY);
-    if (fd < 0)
-	die("%s: %m", rpmbname);
+    int saved_errno = errno; // for %m
+    size_t n = snprintf(cpio->errbuf, sizeof cpio->errbuf, "%s: ", cpio->rpmbname);
+    if (n < sizeof cpio->errbuf) {
+	errno = saved_errno;
+	vsnprintf(cpio->errbuf + n, sizeof cpio->errbuf - n, fmt, ap);
+    }
+    return false;
+}
+
+static bool __attribute__((format(printf, 2, 3)))
+seterr(struct rpmcpio *cpio, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vseterr(cpio, fmt, ap);
+    va_end(ap);
+    return false;
+}
+
+// Same as seterr, for extract.c.
+bool __attribute__((format(printf, 2, 3), visibility("hidden")))
+rpmcpio_seterr(struct rpmcpio *cpio, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vseterr(cpio, fmt, ap);
+    va_end(ap);
+    return false;
+}
+
+#define ERR(fmt, args...) seterr(cpio, fmt, ##args)
+
+// Close the package file, the decoder and the memory are kept.
+static void release(struct rpmcpio *cpio)
+{
+    if (cpio->zp)
+	cpio->st.decode_ns += zpipe_stop(cpio->zp);
+    if (cpio->map) {
+	munmap(cpio->map, cpio->mapsize);
+	cpio->map = NULL;
+    }
+    if (cpio->fda.fd >= 0) {
+	if (cpio->ownfd)
+	    close(cpio->fda.fd);
+	cpio->fda.fd = -1;
+    }
+}
+
+#define RPMFILE_GHOST 64
+
+// Check if the file is selected by the filter.
+static bool selected(struct rpmcpio *cpio, struct fi *fi,
+		     const struct rpmcpio_filter *filter)
+{
+    if ((fi->fflags & filter->fflags_set) != filter->fflags_set)
+	return false;
+    if (fi->fflags & filter->fflags_clear)
+	return false;
+    if (filter->types && !(filter->types & RPMCPIO_TYPE(fi->mode & S_IFMT)))
+	return false;
+    if (!filter->fnames)
+	return true;
+    // Build the filename, spelled as in cpioent.
+    struct header *h = &cpio->h;
+    const char *fname = h->strtab + fi->bn;
+    if (!h->src.rpm && !h->old.fnames) {
+	if (fi->dlen + fi->blen >= sizeof cpio->buf)
+	    return false;
+	memcpy(cpio->buf,            h->strtab + fi->dn, fi->dlen);
+	memcpy(cpio->buf + fi->dlen, h->strtab + fi->bn, fi->blen + 1);
+	fname = cpio->buf;
+    }
+    for (const char *const *pp = filter->fnames; *pp; pp++) {
+	const char *pat = *pp;
+	size_t len = strlen(pat);
+	if (len && pat[len-1] == '/') {
+	    if (strncmp(fname, pat, len) == 0)
+		return true;
+	}
+	else if (fnmatch(pat, fname, 0) == 0)
+	    return true;
+    }
+    return false;
+}
+
+// Mark the files which are not selected by the filter, and count the
+// selected entries, to be returned by rpmcpio_next.  In a hardlink set,
+// only the last file comes with the data, so if any file in the set is
+// selected, the last one is selected too.
+static bool filter(struct rpmcpio *cpio, const struct rpmcpio_filter *filter)
+{
+    struct header *h = &cpio->h;
+    unsigned cnt = 0, nhard = 0;
+    for (unsigned i = 0; i < h->fileCount; i++) {
+	struct fi *fi = &h->ffi[i];
+	fi->skip = !selected(cpio, fi, filter);
+	// Without the header-only mode, %ghost files are not in cpio.
+	if (!fi->skip && (cpio->hdronly || !(fi->fflags & RPMFILE_GHOST)))
+	    cnt++;
+	if (S_ISREG(fi->mode) && h->ffx[i].nlink > 1)
+	    nhard++;
+    }
+    cpio->left = cnt;
+    if (cpio->hdronly || nhard == 0)
+	return true;
+    // Hardlink sets: the inode, the last file so far, and whether any file
+    // is selected, in a hash table with linear probing.
+    unsigned nslot = 64;
+    while (nslot < 2 * nhard)
+	nslot *= 2;
+    struct { unsigned ino, last; bool used, sel; } *hs = calloc(nslot, sizeof *hs);
+    if (!hs)
+	return ERR("cannot allocate memory in %s()", __func__);
+    unsigned hmask = nslot - 1;
+    for (unsigned i = 0; i < h->fileCount; i++) {
+	struct fi *fi = &h->ffi[i];
+	struct fx *fx = &h->ffx[i];
+	if (!S_ISREG(fi->mode) || fx->nlink < 2)
+	    continue;
+	unsigned j = (fx->ino * 2654435761U) & hmask;
+	while (hs[j].used && hs[j].ino != fx->ino)
+	    j = (j + 1) & hmask;
+	hs[j].ino = fx->ino;
+	hs[j].used = true;
+	hs[j].sel |= !fi->skip;
+	hs[j].last = i;
+    }
+    for (unsigned j = 0; j < nslot; j++) {
+	struct fi *fi = &h->ffi[hs[j].last];
+	if (hs[j].used && hs[j].sel && fi->skip) {
+	    fi->skip = false;
+	    cpio->left++;
+	}
+    }
+    free(hs);
+    return true;
+}
+
+// PGPHASHALGO_* values, as found in FILEDIGESTALGO.
+static const EVP_MD *mdbyalgo(unsigned algo)
+{
+    switch (algo) {
+    case 1: return EVP_md5();
+    case 2: return EVP_sha1();
+    case 8: return EVP_sha256();
+    case 9: return EVP_sha384();
+    case 10: return EVP_sha512();
+    case 11: return EVP_sha224();
+    }
+    return NULL;
+}
+
+static void zhash(void *arg, const void *p, size_t n)
+{
+    struct rpmcpio *cpio = arg;
+    EVP_DigestUpdate(cpio->zmdctx, p, n);
+}
+
+// Start hashing the compressed payload.  Old packages have no payload
+// digest, only the MD5 of the header plus the payload, and so the header,
+// which has already been parsed, is read once again.
+static bool zhashinit(struct rpmcpio *cpio)
+{
+    struct header *h = &cpio->h;
+    const EVP_MD *md;
+    if (h->paydigestlen) {
+	md = mdbyalgo(h->paydigestalgo);
+	if (!md)
+	    return ERR("unsupported payload digest algorithm %u", h->paydigestalgo);
+    }
+    else if (h->hdrmd5)
+	md = EVP_md5();
+    else
+	return true;
+    if (!cpio->zmdctx && !(cpio->zmdctx = EVP_MD_CTX_new()))
+	return ERR("cannot allocate memory in %s()", __func__);
+    if (!EVP_DigestInit_ex(cpio->zmdctx, md, NULL))
+	return ERR("cannot initialize payload digest");
+    if (!h->paydigestlen) {
+	unsigned long long pos = h->hdrpos, end = pos + h->hdrsize;
+	while (pos < end) {
+	    size_t n = end - pos < sizeof cpio->buf ? end - pos : sizeof cpio->buf;
+	    ssize_t ret = inpread(&cpio->in, cpio->buf, n, pos);
+	    // Not seekable, cannot be verified.
+	    if (ret < 0 && errno == ESPIPE)
+		return true;
+	    if (ret < 0)
+		return ERR("pread: %m");
+	    if (ret == 0)
+		return ERR("cannot reread pkg header");
+	    EVP_DigestUpdate(cpio->zmdctx, cpio->buf, ret);
+	    pos += ret;
+	}
+    }
+    cpio->in.hash = zhash;
+    cpio->in.hasharg = cpio;
+    cpio->zverify = true;
+    return true;
+}
+
+// At the end of the archive, hash whatever is left of the package file,
+// and check the payload digest.
+static bool zcheck(struct rpmcpio *cpio)
+{
+    struct header *h = &cpio->h;
+    // The decoder is done, but the thread still owns the input.
+    if (cpio->zp)
+	cpio->st.decode_ns += zpipe_stop(cpio->zp);
+    const char *p;
+    ssize_t n;
+    while ((n = inpeek(&cpio->in, &p)) > 0)
+	inconsume(&cpio->in, n);
+    if (n < 0)
+	return ERR("%m");
+    cpio->in.hash = NULL;
+    cpio->zverify = false;
+    if (h->payloadsize && cpio->in.pos - cpio->zstart != h->payloadsize)
+	return ERR("payload size mismatch");
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned mdlen;
+    if (!EVP_DigestFinal_ex(cpio->zmdctx, md, &mdlen))
+	return ERR("cannot finalize payload digest");
+    if (!h->paydigestlen) {
+	if (memcmp(md, h->md5, 16))
+	    return ERR("header+payload MD5 mismatch");
+    }
+    else if (mdlen != h->paydigestlen || memcmp(md, h->paydigest, mdlen))
+	return ERR("payload digest mismatch");
+    return true;
+}
 
+static bool start(struct rpmcpio *cpio, unsigned *nent,
+		  const struct rpmcpio_opt *opt, bool loadfx);
+
+// Release the previous package, if any, and set the prefix of the error
+// messages: the basename of the file, or the caller's display name, which
+// is used verbatim (and truncated to NAME_MAX bytes).
+static bool reset(struct rpmcpio *cpio, const char *name, bool basename)
+{
+    release(cpio);
+    // Reopened with other input, a push handle is no longer fed.
+    push_free(cpio->push);
+    cpio->push = NULL;
+    cpio->errbuf[0] = '\0';
+    if (!basename) {
+	snprintf(cpio->rpmbname, sizeof cpio->rpmbname, "%s", name);
+	return true;
+    }
+    const char *rpmbname = strrchr(name, '/');
+    rpmbname = rpmbname ? rpmbname + 1 : name;
     size_t len = strlen(rpmbname);
-    struct rpmcpio *cpio = xmalloc(sizeof(*cpio) + len + 1);
+    if (rpmbname[strspn(rpmbname, ".")] == '\0' || len > NAME_MAX) {
+	snprintf(cpio->errbuf, sizeof cpio->errbuf, "%s: cannot make basename", name);
+	return false;
+    }
     memcpy(cpio->rpmbname, rpmbname, len + 1);
+    return true;
+}
 
+// Read the package from fd, starting at its current offset, if seekable,
+// so that in->pos is the offset in the file.  With own, the fd is closed
+// along with the package.
+static void setfd(struct rpmcpio *cpio, int fd, bool own,
+		  const struct rpmcpio_opt *opt)
+{
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (off < 0)
+	off = 0;
     cpio->fda = (struct fda) { fd, cpio->fdabuf };
+    cpio->ownfd = own;
+    cpio->in = (struct input) { &cpio->fda, .pos = off };
 
+    // Map the whole file, if possible.  Should the file be something other
+    // than a regular file, fall back to reading it through the fda buffer.
+    struct stat st;
+    if (opt && (opt->flags & RPMCPIO_MMAP) &&
+	    fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > off) {
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map != MAP_FAILED) {
+	    madvise(map, st.st_size, MADV_SEQUENTIAL);
+	    cpio->map = map;
+	    cpio->mapsize = st.st_size;
+	    cpio->in = (struct input) { NULL, (char *) map + off,
+					(char *) map + st.st_size, .pos = off };
+	}
+    }
+}
+
+// Point the handle at the package, reusing whatever has been allocated
+// for the previous package, if any.
+static bool reopen(struct rpmcpio *cpio, int dirfd, const char *rpmfname,
+		   unsigned *nent, const struct rpmcpio_opt *opt, bool loadfx)
+{
+    if (!reset(cpio, rpmfname, true))
+	return false;
+    int fd = openat(dirfd, rpmfname, O_RDONLY);
+    if (fd < 0)
+	return ERR("%m");
+    setfd(cpio, fd, true, opt);
+    return start(cpio, nent, opt, loadfx);
+}
+
+static bool fdreopen(struct rpmcpio *cpio, int fd, const char *name,
+		     unsigned *nent, const struct rpmcpio_opt *opt)
+{
+    if (!reset(cpio, name, false))
+	return false;
+    setfd(cpio, fd, false, opt);
+    return start(cpio, nent, opt, false);
+}
+
+// The buffer is memory input, just like a mapping, starting at offset 0.
+static bool memreopen(struct rpmcpio *cpio, const void *buf, size_t size,
+		      const char *name, unsigned *nent, const struct rpmcpio_opt *opt)
+{
+    if (!reset(cpio, name, false))
+	return false;
+    cpio->in = (struct input) { NULL, buf, (const char *) buf + size };
+    return start(cpio, nent, opt, false);
+}
+
+// With the input set up, read the header and get ready for the payload.
+static bool start(struct rpmcpio *cpio, unsigned *nent,
+		  const struct rpmcpio_opt *opt, bool loadfx)
+{
+    cpio->hdronly = opt && (opt->flags & RPMCPIO_HEADER_ONLY);
+    cpio->pipeline = opt && (opt->flags & RPMCPIO_PIPELINE);
+    cpio->timing = opt && (opt->flags & RPMCPIO_TIMING);
+    cpio->digest = opt && (opt->flags & RPMCPIO_DIGEST);
+    cpio->hashing = cpio->zverify = false;
+    memset(&cpio->st, 0, sizeof cpio->st);
+    cpio->hix = 0;
+    cpio->left = -1;
+    cpio->lone = cpio->pending = false;
+
+    cpio->tags = opt && (opt->flags & RPMCPIO_HEADER_TAGS);
+    cpio->ix = -1;
+    unsigned hflags = 0;
+    // The filter needs the inodes to find hardlink sets.
+    if (cpio->hdronly || loadfx || (opt && opt->filter))
+	hflags |= HEADER_LOADFX;
+    if (cpio->digest)
+	hflags |= HEADER_DIGESTS;
+    if (cpio->tags)
+	hflags |= HEADER_RETAIN;
     const char *err;
-    if (!header_read(&cpio->h, &cpio->fda, &err))
-	die("%s: %s", rpmbname, err);
+    if (!header_read(&cpio->h, &cpio->in, hflags, &err))
+	return ERR("%s", err);
+    cpio->ent.digest = NULL;
+    cpio->ent.digestlen = 0;
+    if (cpio->h.digestlen && !cpio->hdronly) {
+	cpio->md = mdbyalgo(cpio->h.digestalgo);
+	if (!cpio->md)
+	    return ERR("unsupported file digest algorithm %u", cpio->h.digestalgo);
+	if (!cpio->mdctx && !(cpio->mdctx = EVP_MD_CTX_new()))
+	    return ERR("cannot allocate memory in %s()", __func__);
+    }
+    cpio->zstart = cpio->in.pos;
     if (nent)
 	*nent = cpio->h.fileCount;
+    if (opt && opt->filter && !filter(cpio, opt->filter))
+	return false;
 
-    if (!zreader_init(&cpio->z, cpio->h.zprog))
-	die("%s: cannot initialize %s decompressor", rpmbname, cpio->h.zprog);
+    // The payload is not going to be touched, the decoder is left as is,
+    // to be reinitialized for the next package.
+    if (cpio->hdronly) {
+	cpio->curpos = cpio->endpos = 0;
+	cpio->ent.mode = 0;
+	cpio->wpos = cpio->wend = 0;
+	return true;
+    }
+
+    struct zopt zopt = { 0 };
+    if (opt) {
+	zopt.threads = opt->xzthreads;
+	zopt.memlimit = opt->xzmemlimit;
+    }
+    if (!zreader_reinit(&cpio->z, cpio->h.zprog, &zopt))
+	return ERR("cannot initialize %s decompressor", cpio->h.zprog);
+    if (opt && (opt->flags & RPMCPIO_PAYLOAD_DIGEST) && !zhashinit(cpio))
+	return false;
 
     cpio->curpos = cpio->endpos = 0;
     cpio->hard.nlink = cpio->hard.cnt = 0;
     cpio->ent.mode = 0; // S_ISREG will fail
+    cpio->wpos = cpio->wend = 0;
+    return true;
+}
+
+// Allocate the handle, with nothing open yet.
+static struct rpmcpio *alloc(const char *rpmfname, char errbuf[RPMCPIO_ERRSIZE])
+{
+    struct rpmcpio *cpio = malloc(sizeof *cpio);
+    if (!cpio) {
+	snprintf(errbuf, RPMCPIO_ERRSIZE, "%s: cannot allocate %zu bytes",
+		 rpmfname, sizeof *cpio);
+	return NULL;
+    }
+    cpio->map = NULL;
+    cpio->fda.fd = -1;
+    cpio->ownfd = false;
+    header_init(&cpio->h);
+    cpio->z.fini = NULL;
+    cpio->zp = NULL;
+    cpio->win = NULL;
+    cpio->mdctx = cpio->zmdctx = NULL;
+    cpio->push = NULL;
+    return cpio;
+}
+
+// With loadfx, ffx[] is loaded for all packages.
+static struct rpmcpio *create(int dirfd, const char *rpmfname, unsigned *nent,
+			      const struct rpmcpio_opt *opt, bool loadfx,
+			      char errbuf[RPMCPIO_ERRSIZE])
+{
+    struct rpmcpio *cpio = alloc(rpmfname, errbuf);
+    if (!cpio)
+	return NULL;
+    if (!reopen(cpio, dirfd, rpmfname, nent, opt, loadfx)) {
+	memcpy(errbuf, cpio->errbuf, RPMCPIO_ERRSIZE);
+	rpmcpio_close(cpio);
+	return NULL;
+    }
+    return cpio;
+}
+
+struct rpmcpio *rpmcpio_open2(int dirfd, const char *rpmfname, unsigned *nent,
+			      const struct rpmcpio_opt *opt,
+			      char errbuf[RPMCPIO_ERRSIZE])
+{
+    return create(dirfd, rpmfname, nent, opt, false, errbuf);
+}
+
+struct rpmcpio *rpmcpio_openx(int dirfd, const char *rpmfname, unsigned *nent,
+			      const struct rpmcpio_opt *opt)
+{
+    char errbuf[RPMCPIO_ERRSIZE];
+    struct rpmcpio *cpio = rpmcpio_open2(dirfd, rpmfname, nent, opt, errbuf);
+    if (!cpio)
+	die("%s", errbuf);
+    return cpio;
+}
+
+struct rpmcpio *rpmcpio_open(int dirfd, const char *rpmfname, unsigned *nent)
+{
+    return rpmcpio_openx(dirfd, rpmfname, nent, NULL);
+}
+
+int rpmcpio_reopen2(struct rpmcpio *cpio, int dirfd, const char *rpmfname,
+		    unsigned *nent, const struct rpmcpio_opt *opt)
+{
+    return reopen(cpio, dirfd, rpmfname, nent, opt, false) ? 0 : -1;
+}
+
+void rpmcpio_reopen(struct rpmcpio *cpio, int dirfd, const char *rpmfname,
+		    unsigned *nent, const struct rpmcpio_opt *opt)
+{
+    if (!reopen(cpio, dirfd, rpmfname, nent, opt, false))
+	die("%s", cpio->errbuf);
+}
+
+struct rpmcpio *rpmcpio_fdopen(int fd, const char *name, unsigned *nent,
+			       const struct rpmcpio_opt *opt,
+			       char errbuf[RPMCPIO_ERRSIZE])
+{
+    struct rpmcpio *cpio = alloc(name, errbuf);
+    if (!cpio)
+	return NULL;
+    if (!fdreopen(cpio, fd, name, nent, opt)) {
+	memcpy(errbuf, cpio->errbuf, RPMCPIO_ERRSIZE);
+	rpmcpio_close(cpio);
+	return NULL;
+    }
+    return cpio;
+}
+
+struct rpmcpio *rpmcpio_memopen(const void *buf, size_t size, const char *name,
+				unsigned *nent, const struct rpmcpio_opt *opt,
+				char errbuf[RPMCPIO_ERRSIZE])
+{
+    struct rpmcpio *cpio = alloc(name, errbuf);
+    if (!cpio)
+	return NULL;
+    if (!memreopen(cpio, buf, size, name, nent, opt)) {
+	memcpy(errbuf, cpio->errbuf, RPMCPIO_ERRSIZE);
+	rpmcpio_close(cpio);
+	return NULL;
+    }
+    return cpio;
+}
+
+int rpmcpio_fdreopen(struct rpmcpio *cpio, int fd, const char *name,
+		     unsigned *nent, const struct rpmcpio_opt *opt)
+{
+    return fdreopen(cpio, fd, name, nent, opt) ? 0 : -1;
+}
+
+int rpmcpio_memreopen(struct rpmcpio *cpio, const void *buf, size_t size,
+		      const char *name, unsigned *nent, const struct rpmcpio_opt *opt)
+{
+    return memreopen(cpio, buf, size, name, nent, opt) ? 0 : -1;
+}
+
+// Pass the file data of the current entry to the data callback.
+static bool pushdata(struct rpmcpio *cpio)
+{
+    const struct rpmcpio_push *cb = &cpio->cb;
+    if (S_ISLNK(cpio->ent.mode)) {
+	char buf[PATH_MAX];
+	ssize_t n = rpmcpio_readlink2(cpio, buf);
+	if (n < 0)
+	    return false;
+	if (cb->data(cb->arg, cpio, buf, n) < 0)
+	    return ERR("operation canceled");
+	return true;
+    }
+    if (!S_ISREG(cpio->ent.mode))
+	return true;
+    const void *p;
+    ssize_t n;
+    while ((n = rpmcpio_peek2(cpio, &p)) > 0) {
+	int ret = cb->data(cb->arg, cpio, p, n);
+	rpmcpio_consume(cpio, n);
+	if (ret < 0)
+	    return ERR("operation canceled");
+	if (cpio->pause) {
+	    cpio->pause = false;
+	    push_yield(cpio->push);
+	}
+    }
+    return n == 0;
+}
+
+// The coroutine: the package is parsed as usual, except that the input
+// comes from rpmcpio_feed, and the entries go to the callbacks.
+static void pushrun(void *arg)
+{
+    struct rpmcpio *cpio = arg;
+    const struct rpmcpio_push *cb = &cpio->cb;
+    bool ok = start(cpio, NULL, &cpio->popt, false);
+    const struct cpioent *ent;
+    int rc = 0;
+    while (ok && (rc = rpmcpio_next2(cpio, &ent)) > 0) {
+	int ret = cb->entry ? cb->entry(cb->arg, cpio, ent) : 0;
+	if (ret < 0)
+	    ok = ERR("operation canceled");
+	else if (cpio->pause) {
+	    cpio->pause = false;
+	    push_yield(cpio->push);
+	}
+	if (ok && ret == 0 && cb->data)
+	    ok = pushdata(cpio);
+    }
+    if (cb->done)
+	cb->done(cb->arg, cpio, ok && rc == 0 ? NULL : cpio->errbuf);
+}
 
+struct rpmcpio *rpmcpio_push_open(const char *name, const struct rpmcpio_opt *opt,
+				  const struct rpmcpio_push *cb,
+				  char errbuf[RPMCPIO_ERRSIZE])
+{
+    struct rpmcpio *cpio = alloc(name, errbuf);
+    if (!cpio)
+	return NULL;
+    reset(cpio, name, false);
+    cpio->push = push_new(pushrun, cpio);
+    if (!cpio->push) {
+	ERR("cannot allocate coroutine stack");
+	memcpy(errbuf, cpio->errbuf, RPMCPIO_ERRSIZE);
+	rpmcpio_close(cpio);
+	return NULL;
+    }
+    cpio->cb = *cb;
+    cpio->pause = false;
+    // The decoder must not pull the input from another thread.
+    cpio->popt = opt ? *opt : (struct rpmcpio_opt) { 0 };
+    cpio->popt.flags &= ~(RPMCPIO_MMAP | RPMCPIO_PIPELINE);
+    cpio->in = (struct input) { .more = push_more, .morearg = cpio->push };
+    memset(&cpio->st, 0, sizeof cpio->st);
     return cpio;
 }
 
+ssize_t rpmcpio_feed(struct rpmcpio *cpio, const void *data, size_t len)
+{
+    if (cpio->errbuf[0])
+	return -1;
+    if (!cpio->push)
+	return ERR("not a push handle"), -1;
+    size_t n = push_feed(cpio->push, &cpio->in, data, len);
+    return cpio->errbuf[0] ? -1 : (ssize_t) n;
+}
+
+void rpmcpio_pause(struct rpmcpio *cpio)
+{
+    if (cpio->push)
+	cpio->pause = true;
+}
+
 void rpmcpio_close(struct rpmcpio *cpio)
 {
+    // The pipeline thread, if still running, must be stopped before
+    // the decoder is freed.
+    release(cpio);
     zreader_fini(&cpio->z);
     header_freedata(&cpio->h);
-    close(cpio->fda.fd);
+    zpipe_free(cpio->zp);
+    push_free(cpio->push);
+    EVP_MD_CTX_free(cpio->mdctx);
+    EVP_MD_CTX_free(cpio->zmdctx);
+    free(cpio->win);
     free(cpio);
 }
 
-// Read the raw uncompressed stream.
+const char *rpmcpio_strerror(struct rpmcpio *cpio)
+{
+    return cpio->errbuf[0] ? cpio->errbuf : NULL;
+}
+
+// For rpmcpio_extract.
+void __attribute__((visibility("hidden")))
+rpmcpio_addtime(struct rpmcpio *cpio, unsigned long long write_ns,
+		unsigned long long wait_ns)
+{
+    cpio->st.write_ns += write_ns;
+    cpio->st.wait_ns += wait_ns;
+}
+
+void rpmcpio_stats(struct rpmcpio *cpio, struct rpmcpio_stats *st)
+{
+    struct header *h = &cpio->h;
+    *st = cpio->st;
+    st->payload_zsize = h->payloadsize;
+    st->payload_size = h->archivesize;
+    unsigned long long inpos, ns;
+    if (cpio->zp && zpipe_stats(cpio->zp, &inpos, &st->refills, &ns))
+	st->decode_ns += ns;
+    else
+	inpos = cpio->in.pos, st->refills = cpio->in.nfill;
+    // Before the payload is opened, inpos can be short of zstart.
+    st->zbytes = inpos > cpio->zstart ? inpos - cpio->zstart : 0;
+    st->find_hits = h->nguess;
+    st->find_bsearch = h->nsearch;
+    st->find_hash = h->nhash;
+    st->find_steps = h->nstep;
+}
+
+// Allocate the window on demand.
+static char *getwin(struct rpmcpio *cpio)
+{
+    if (!cpio->win) {
+	// Cache-aligned, with the decoders writing big chunks into it.
+	cpio->win = aligned_alloc(64, WINSIZE);
+	if (!cpio->win)
+	    ERR("cannot allocate %zu bytes in %s()", (size_t) WINSIZE, __func__);
+    }
+    return cpio->win;
+}
+
+static inline unsigned long long nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Read the raw uncompressed stream.  Returns the number of bytes read,
+// which can only be short at the end of the stream, or -1 on error.
 static inline size_t zread(struct rpmcpio *cpio, void *buf, size_t n)
 {
-    size_t ret = zreader_read(&cpio->z, &cpio->fda, buf, n);
-    if (ret == -1) {
+    size_t ret;
+    cpio->st.zread_calls++;
+    if (cpio->pipeline) {
+	if (!cpio->zp && !(cpio->zp = zpipe_new()))
+	    return ERR("cannot allocate memory in %s()", __func__), -1;
+	ret = zpipe_read(cpio->zp, &cpio->z, &cpio->in, buf, n);
+    }
+    else if (cpio->timing) {
+	unsigned long long start = nsec();
+	ret = zreader_read(&cpio->z, &cpio->in, buf, n);
+	cpio->st.decode_ns += nsec() - start;
+    }
+    else
+	ret = zreader_read(&cpio->z, &cpio->in, buf, n);
+    if (ret != -1)
+	cpio->st.bytes += ret;
+    else {
 	if (errno)
-	    die("%s: %m", cpio->rpmbname);
-	die("%s: %s decompression failed", cpio->rpmbname, cpio->h.zprog);
+	    ERR("%m");
+	else
+	    ERR("%s decompression failed", cpio->h.zprog);
     }
     return ret;
 }
 
-static const signed char hex[256] = {
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-    0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
-};
+// Read exactly n bytes, a short read is reported as "cannot <what>",
+// possibly prefixed with the filename.
+static bool zreadn(struct rpmcpio *cpio, void *buf, size_t n,
+		   const char *fname, const char *what)
+{
+    size_t ret = zread(cpio, buf, n);
+    if (ret == n)
+	return true;
+    if (ret != -1) {
+	if (fname)
+	    ERR("%s: cannot %s", fname, what);
+	else
+	    ERR("cannot %s", what);
+    }
+    return false;
+}
+
+// Point ent->digest at the file's digest from the header, and start hashing
+// the data, if the file comes with any.
+static bool setdigest(struct rpmcpio *cpio)
+{
+    struct header *h = &cpio->h;
+    struct cpioent *ent = &cpio->ent;
+    ent->digest = NULL, ent->digestlen = 0;
+    if (!h->digestlen)
+	return true;
+    const unsigned char *d = h->digests + (size_t) cpio->ix * h->digestlen;
+    // All zeroes, no digest.
+    if (d[0] == 0 && memcmp(d, d + 1, h->digestlen - 1) == 0)
+	return true;
+    ent->digest = d, ent->digestlen = h->digestlen;
+    if (cpio->hdronly || !S_ISREG(ent->mode))
+	return true;
+    // Not the last file in a hardlink set, the data comes later.
+    if (ent->size == 0 && ent->nlink > 1)
+	return true;
+    if (!EVP_DigestInit_ex(cpio->mdctx, cpio->md, NULL))
+	return ERR("%s: cannot initialize file digest", ent->fname);
+    cpio->hashing = true;
+    return true;
+}
 
-// Parse 4-digit hex number, returns < 0 on error.
-static inline int hex4(const char *s)
+static inline bool hash(struct rpmcpio *cpio, const void *buf, size_t n)
 {
-    int v;
-    v  = hex[(unsigned char) s[0]] << 12;
-    v |= hex[(unsigned char) s[1]] << 8;
-    v |= hex[(unsigned char) s[2]] << 4;
-    v |= hex[(unsigned char) s[3]];
-    return v;
+    if (EVP_DigestUpdate(cpio->mdctx, buf, n))
+	return true;
+    return ERR("%s: cannot hash file data", cpio->ent.fname);
 }
 
-// Parse 8-digit hex number.
-static inline unsigned hex8(const char *s, const char *rpmbname)
+// Done with the entry being hashed: hash the rest of its data, which then
+// counts as skipped, and check the digest.
+static bool verify(struct rpmcpio *cpio)
 {
-    int hi = hex4(s);
-    int lo = hex4(s + 4);
-    if ((hi | lo) < 0)
-	die("%s: bad cpio hex number", rpmbname);
-    return hi << 16 | lo;
+    struct cpioent *ent = &cpio->ent;
+    cpio->hashing = false;
+    cpio->st.skip_bytes += cpio->endpos - cpio->curpos;
+    // The data in the window has already been hashed.
+    unsigned long long left = cpio->endpos - cpio->curpos - (cpio->wend - cpio->wpos);
+    if (left) {
+	char *win = getwin(cpio);
+	if (!win)
+	    return false;
+	do {
+	    size_t n = left < WINSIZE ? left : WINSIZE;
+	    if (!zreadn(cpio, win, n, ent->fname, "read cpio file data"))
+		return false;
+	    if (!hash(cpio, win, n))
+		return false;
+	    left -= n;
+	} while (left);
+    }
+    cpio->curpos = cpio->endpos;
+    cpio->wpos = cpio->wend = 0;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned mdlen;
+    if (!EVP_DigestFinal_ex(cpio->mdctx, md, &mdlen))
+	return ERR("%s: cannot finalize file digest", ent->fname);
+    if (mdlen != ent->digestlen || memcmp(md, ent->digest, mdlen))
+	return ERR("%s: file digest mismatch", ent->fname);
+    return true;
 }
 
 // Got an excluded entry, fill cpio->ent from the header.
-static void ent_0X(struct rpmcpio *cpio, unsigned ix)
+static bool ent_0X(struct rpmcpio *cpio, unsigned ix)
 {
     struct header *h = &cpio->h;
     if (ix >= h->fileCount)
-	die("%s: bad cpio entry index", cpio->rpmbname);
+	return ERR("bad cpio entry index");
+    cpio->ix = ix;
     struct fi *fi = &h->ffi[ix];
     struct fx *fx = &h->ffx[ix];
     if (fi->seen)
-	die("%s: %s%s: file listed twice", cpio->rpmbname,
-	    h->src.rpm || h->old.fnames ? "" : h->strtab + fi->dn,
-	    h->strtab + fi->bn);
+	return ERR("%s%s: file listed twice",
+		   h->src.rpm || h->old.fnames ? "" : h->strtab + fi->dn,
+		   h->strtab + fi->bn);
     fi->seen = true;
     struct cpioent *ent = &cpio->ent;
     ent->mode = fi->mode;
@@ -153,35 +916,44 @@ static void ent_0X(struct rpmcpio *cpio, unsigned ix)
     ent->nlink = fx->nlink;
     ent->mtime = fx->mtime;
     ent->size = fx->size;
+    // Not selected, the basename will do.
+    if (fi->skip) {
+	ent->fnamelen = fi->blen;
+	ent->fname = h->strtab + fi->bn;
+	return true;
+    }
     // filename
     if (h->src.rpm || h->old.fnames) {
 	if (fi->blen == 0 || fi->blen >= (h->src.rpm ? 256 : 4096))
-	    die("%s: bad filename length", cpio->rpmbname);
+	    return ERR("bad filename length");
 	ent->fnamelen = fi->blen;
 	ent->fname = h->strtab + fi->bn;
     }
     else {
 	ent->fnamelen = fi->dlen + fi->blen;
 	if (ent->fnamelen >= 4096)
-	    die("%s: bad filename length", cpio->rpmbname);
+	    return ERR("bad filename length");
 	memcpy(cpio->buf,            h->strtab + fi->dn, fi->dlen);
 	memcpy(cpio->buf + fi->dlen, h->strtab + fi->bn, fi->blen + 1);
 	ent->fname = cpio->buf;
     }
+    return true;
 }
 
-// Parse a regular cpio entry, then read filename.
-static bool ent_01(struct rpmcpio *cpio, const char buf[110])
+// Parse a regular cpio entry, then read filename.  Returns 0 on success,
+// 1 when the trailer has been reached, -1 on error.
+static int ent_01(struct rpmcpio *cpio, const char buf[110])
 {
-    if (memcmp(buf, "070701", 6) != 0)
-	die("%s: bad cpio header magic", cpio->rpmbname);
     unsigned v[13];
-    for (int i = 0; i < 13; i++)
-	v[i] = hex8(buf + 6 + 8 * i, cpio->rpmbname);
+    if (!newc_parse(buf, v)) {
+	if (memcmp(buf, "070701", 6) != 0)
+	    return ERR("bad cpio header magic"), -1;
+	return ERR("bad cpio hex number"), -1;
+    }
     struct cpioent *ent = &cpio->ent;
     ent->ino = v[0];
-    if (v[1] > 0xffff) die("%s: bad cpio mode", cpio->rpmbname);
-    if (v[4] > 0xffff) die("%s: bad cpio nlink", cpio->rpmbname);
+    if (v[1] > 0xffff) return ERR("bad cpio mode"), -1;
+    if (v[4] > 0xffff) return ERR("bad cpio nlink"), -1;
     ent->mode = v[1];
     // v[2]: uid, v[3]: gid
     ent->nlink = v[4];
@@ -194,25 +966,26 @@ static bool ent_01(struct rpmcpio *cpio, const char buf[110])
     // The filename may start with "./", or may lack the leading '/'.
     struct header *h = &cpio->h;
     if (ent->fnamelen == 0 || ent->fnamelen >= (h->src.rpm ? 256 + 2 : 4096 + 1))
-	die("%s: bad filename length", cpio->rpmbname);
+	return ERR("bad filename length"), -1;
     // cpio magic is 6 bytes, but filename is padded to a multiple of 4 bytes.
     // So we're going to read at least 2 bytes (minlen=1 + the null byte),
     // and the rest is rounded up to a multiple of 4.
     unsigned fnamesize = ent->fnamelen + 1;
     fnamesize = 2 + ((fnamesize - 2 + 3) & ~3);
     char *fname = cpio->buf + !h->src.rpm;
-    if (zread(cpio, fname, fnamesize) != fnamesize)
-	die("%s: cannot read cpio filename", cpio->rpmbname);
+    if (!zreadn(cpio, fname, fnamesize, NULL, "read cpio filename"))
+	return -1;
     cpio->curpos += fnamesize;
     // The filename must be null-terminated.
     if (fname[ent->fnamelen])
-	die("%s: bad cpio filename", cpio->rpmbname);
+	return ERR("bad cpio filename"), -1;
     // Reached the trailer entry?
-    if (memcmp(fname, "TRAILER!!!", ent->fnamelen) == 0)
-	return true;
+    if (ent->fnamelen == sizeof "TRAILER!!!" - 1 &&
+	    memcmp(fname, "TRAILER!!!", sizeof "TRAILER!!!" - 1) == 0)
+	return 1;
     // No embedded null bytes in the filename.
     if (strlen(fname) != ent->fnamelen)
-	die("%s: bad cpio filename", cpio->rpmbname);
+	return ERR("bad cpio filename"), -1;
     // Adjust the prefix.
     if (memcmp(fname, "./", 2) == 0)
 	fname++, ent->fnamelen--;
@@ -222,74 +995,140 @@ static bool ent_01(struct rpmcpio *cpio, const char buf[110])
 	*--fname = '/', ent->fnamelen++;
     // Recheck the length.
     if (ent->fnamelen == 0 || ent->fnamelen >= (h->src.rpm ? 256 : 4096))
-	die("%s: bad filename length", cpio->rpmbname);
+	return ERR("bad filename length"), -1;
     ent->fname = fname;
 
     // Now match with the header.
     unsigned ix = header_find(&cpio->h, ent->fname, ent->fnamelen);
     if (ix == -1)
-	die("%s: %s: file not in rpm header", cpio->rpmbname, ent->fname);
+	return ERR("%s: file not in rpm header", ent->fname), -1;
+    cpio->ix = ix;
     struct fi *fi = &h->ffi[ix];
     if (fi->seen)
-	die("%s: %s: file listed twice", cpio->rpmbname, ent->fname);
+	return ERR("%s: file listed twice", ent->fname), -1;
     fi->seen = true;
     if (ent->mode != fi->mode)
-	die("%s: %s: bad file mode", cpio->rpmbname, ent->fname);
+	return ERR("%s: bad file mode", ent->fname), -1;
     ent->fflags = fi->fflags;
-    return false;
+    return 0;
 }
 
-const struct cpioent *rpmcpio_next(struct rpmcpio *cpio)
+int rpmcpio_next2(struct rpmcpio *cpio, const struct cpioent **entp)
 {
+    *entp = NULL;
+    if (cpio->errbuf[0])
+	return -1;
+    if (cpio->pending) {
+	cpio->pending = false;
+	*entp = &cpio->ent;
+	return 1;
+    }
+    if (cpio->hashing && !verify(cpio))
+	return -1;
+    // Done with the selected files, the rest of the payload is not needed.
+    if (cpio->left == 0) {
+	release(cpio);
+	return 0;
+    }
+
+    // All the entries, including %ghost files, come straight from ffi[].
+    if (cpio->hdronly) {
+	while (cpio->hix < cpio->h.fileCount && cpio->h.ffi[cpio->hix].skip)
+	    cpio->hix++;
+	if (cpio->hix == cpio->h.fileCount)
+	    return 0;
+	if (!ent_0X(cpio, cpio->hix++) || !setdigest(cpio))
+	    return -1;
+	if (cpio->left != -1)
+	    cpio->left--;
+	*entp = &cpio->ent;
+	return 1;
+    }
+
+again:;
     // Skip the remaining data and read the header.
     // Try to combine it into a single zread call.
+    if (cpio->endpos > cpio->curpos)
+	cpio->st.skip_bytes += cpio->endpos - cpio->curpos;
     unsigned long long nextpos = (cpio->endpos + 3) & ~3;
     unsigned long long skip = nextpos - cpio->curpos;
-    while (skip > sizeof cpio->buf - 110) {
-	size_t n = skip < sizeof cpio->buf ? skip : sizeof cpio->buf;
-	if (zread(cpio, cpio->buf, n) != n)
-	    die("%s: cannot skip cpio bytes", cpio->rpmbname);
-	skip -= n;
+    cpio->entpos = nextpos;
+    // Some data may have already been decompressed by rpmcpio_peek.
+    skip -= cpio->wend - cpio->wpos;
+    cpio->wpos = cpio->wend = 0;
+    // Big chunks of unread data are discarded into the window, so that
+    // the decoder runs in as few calls as possible.  The tail, which is
+    // under sizeof cpio->buf - 110, goes along with the header.
+    if (skip > sizeof cpio->buf - 110) {
+	char *win = getwin(cpio);
+	if (!win)
+	    return -1;
+	do {
+	    size_t n = skip < WINSIZE ? skip : WINSIZE;
+	    if (!zreadn(cpio, win, n, NULL, "skip cpio bytes"))
+		return -1;
+	    skip -= n;
+	} while (skip > sizeof cpio->buf - 110);
     }
     struct header *h = &cpio->h;
-    if (h->ffx) {
+    if (h->longfile.sizes) {
 	// Expecting "07070X" + file index + 2-byte padding.
-	if (zread(cpio, cpio->buf, skip + 16) != skip + 16)
-	    die("%s: cannot read cpio header", cpio->rpmbname);
+	if (!zreadn(cpio, cpio->buf, skip + 16, NULL, "read cpio header"))
+	    return -1;
 	if (memcmp(cpio->buf + skip, "07070X", 6) == 0) {
 	    cpio->curpos = nextpos + 16;
-	    ent_0X(cpio, hex8(cpio->buf + skip + 6, cpio->rpmbname));
+	    unsigned ix;
+	    if (!hex8(cpio->buf + skip + 6, &ix))
+		return ERR("bad cpio hex number"), -1;
+	    if (!ent_0X(cpio, ix))
+		return -1;
 	    goto gotent;
 	}
 	// At least the trailer is still "070701", so read the rest.
-	if (zread(cpio, cpio->buf + skip + 16, 110 - 16) != 110 - 16)
-	    die("%s: cannot read cpio header", cpio->rpmbname);
+	if (!zreadn(cpio, cpio->buf + skip + 16, 110 - 16, NULL, "read cpio header"))
+	    return -1;
     }
-    else if (zread(cpio, cpio->buf, skip + 110) != skip + 110)
-	die("%s: cannot read cpio header", cpio->rpmbname);
+    else if (!zreadn(cpio, cpio->buf, skip + 110, NULL, "read cpio header"))
+	return -1;
     cpio->curpos = nextpos + 110;
 
-    bool eof = ent_01(cpio, cpio->buf + skip);
+    int eof = ent_01(cpio, cpio->buf + skip);
+    if (eof < 0)
+	return -1;
     if (eof) {
 	// Check for trailing garbage.
 	char c;
-	if (zread(cpio, &c, 1) == 1)
-	    die("%s: trailing garbage", cpio->rpmbname);
+	size_t ret = zread(cpio, &c, 1);
+	if (ret == -1)
+	    return -1;
+	if (ret == 1)
+	    return ERR("trailing garbage"), -1;
 	// The trailer shouldn't happen in the middle of a hardlink set.
 	if (cpio->hard.cnt < cpio->hard.nlink)
-	    die("%s: %s: meager hardlink set", cpio->rpmbname, "TRAILER");
-	return NULL;
+	    return ERR("%s: meager hardlink set", "TRAILER"), -1;
+	if (cpio->zverify && !zcheck(cpio))
+	    return -1;
+	return 0;
     }
 
 gotent:;
     struct cpioent *ent = &cpio->ent;
     struct hard *hard = &cpio->hard;
 
+    // With rpmcpio_open_at, the entry comes alone, and its hardlink set
+    // cannot be verified.  Whether the entry has the data is known from
+    // the index (with 07070X, the size is otherwise the actual file size).
+    if (cpio->lone) {
+	if (h->longfile.sizes && !cpio->lonedata)
+	    ent->size = 0;
+	goto symlink;
+    }
+
     // Finalizing an existing hardlink set.
     if (hard->cnt && hard->cnt == hard->nlink) {
 	// This new file is already not part of the preceding set.  Or is it?
 	if (ent->ino == hard->ino)
-	    die("%s: %s: obese hardlink set", cpio->rpmbname, ent->fname);
+	    return ERR("%s: obese hardlink set", ent->fname), -1;
 	hard->nlink = hard->cnt = 0;
     }
 
@@ -303,78 +1142,623 @@ gotent:;
 	// with file types other than regular files or symlinks, because there
 	// is no data attached to those other files.)
 	if (S_ISLNK(ent->mode))
-	    die("%s: %s: hardlinked symlink", cpio->rpmbname, ent->fname);
+	    return ERR("%s: hardlinked symlink", ent->fname), -1;
 	// Starting a new hardlink set?
 	if (hard->cnt == 0) {
 	    // E.g. ext4 has 16-bit i_links_count.
 	    if (ent->nlink > 0xffff)
-		die("%s: %s: bad nlink", cpio->rpmbname, ent->fname);
+		return ERR("%s: bad nlink", ent->fname), -1;
 	    hard->ino = ent->ino, hard->mode = ent->mode;
 	    hard->nlink = ent->nlink, hard->cnt = 1;
 	}
 	// Advancing in the existing hardlink set.
 	else {
 	    if (ent->ino != hard->ino)
-		die("%s: %s: meager hardlink set", cpio->rpmbname, ent->fname);
+		return ERR("%s: meager hardlink set", ent->fname), -1;
 	    if (ent->mode != hard->mode)
-		die("%s: %s: fickle hardlink mode", cpio->rpmbname, ent->fname);
+		return ERR("%s: fickle hardlink mode", ent->fname), -1;
 	    if (ent->nlink != hard->nlink)
-		die("%s: %s: fickle nlink", cpio->rpmbname, ent->fname);
+		return ERR("%s: fickle nlink", ent->fname), -1;
 	    hard->cnt++;
 	}
 	// Non-last hardlink?
 	if (hard->cnt < hard->nlink) {
-	    // With ffx[], we've got the actual file size, so reset it to zero.
-	    if (h->ffx)
+	    // With 07070X, we've got the actual file size, so reset it to zero.
+	    if (h->longfile.sizes)
 		ent->size = 0;
 	    // All but the last hardlink in a set must come with no data.
 	    else if (ent->size)
-		die("%s: %s: non-empty hardlink data", cpio->rpmbname, ent->fname);
+		return ERR("%s: non-empty hardlink data", ent->fname), -1;
 	}
     }
     // Not a hardlink in the middle of the set?
     else if (hard->cnt)
-	die("%s: %s: meager hardlink set", cpio->rpmbname, ent->fname);
+	return ERR("%s: meager hardlink set", ent->fname), -1;
 
+symlink:
     // Validate the size of symlink target.
     if (S_ISLNK(ent->mode)) {
 	if (ent->size == 0)
-	    die("%s: %s: zero-length symlink target", cpio->rpmbname, ent->fname);
+	    return ERR("%s: zero-length symlink target", ent->fname), -1;
 	if (ent->size >= 4096)
-	    die("%s: %s: symlink target too long", cpio->rpmbname, ent->fname);
+	    return ERR("%s: symlink target too long", ent->fname), -1;
     }
 
     cpio->endpos = cpio->curpos + ent->size;
+    // Not selected, on to the next entry.
+    if (h->ffi[cpio->ix].skip)
+	goto again;
+    if (!setdigest(cpio))
+	return -1;
+    if (cpio->left != -1)
+	cpio->left--;
+    *entp = ent;
+    return 1;
+}
+
+const struct cpioent *rpmcpio_next(struct rpmcpio *cpio)
+{
+    const struct cpioent *ent;
+    if (rpmcpio_next2(cpio, &ent) < 0)
+	die("%s", cpio->errbuf);
     return ent;
 }
 
-size_t rpmcpio_read(struct rpmcpio *cpio, void *buf, size_t n)
+ssize_t rpmcpio_read2(struct rpmcpio *cpio, void *buf, size_t n)
 {
     assert(S_ISREG(cpio->ent.mode));
     assert(n > 0);
+    if (cpio->errbuf[0])
+	return -1;
+    if (cpio->hdronly)
+	return ERR("%s: no file data in header-only mode", cpio->ent.fname), -1;
     unsigned long long left = cpio->endpos - cpio->curpos;
     if (n > left)
 	n = left;
     if (n == 0)
 	return 0;
-    if (zread(cpio, buf, n) != n)
-	die("%s: %s: cannot read cpio file data", cpio->rpmbname, cpio->ent.fname);
-    cpio->curpos += n;
+    cpio->st.read_bytes += n;
+    // Take the data left over from rpmcpio_peek first.
+    size_t wn = cpio->wend - cpio->wpos;
+    if (wn) {
+	if (wn > n)
+	    wn = n;
+	memcpy(buf, cpio->win + cpio->wpos, wn);
+	cpio->wpos += wn;
+	cpio->curpos += wn;
+	if (wn == n)
+	    return n;
+	buf = (char *) buf + wn;
+    }
+    if (!zreadn(cpio, buf, n - wn, cpio->ent.fname, "read cpio file data"))
+	return -1;
+    if (cpio->hashing && !hash(cpio, buf, n - wn))
+	return -1;
+    cpio->curpos += n - wn;
     return n;
 }
 
-size_t rpmcpio_readlink(struct rpmcpio *cpio, char *buf)
+size_t rpmcpio_read(struct rpmcpio *cpio, void *buf, size_t n)
+{
+    ssize_t ret = rpmcpio_read2(cpio, buf, n);
+    if (ret < 0)
+	die("%s", cpio->errbuf);
+    return ret;
+}
+
+ssize_t rpmcpio_peek2(struct rpmcpio *cpio, const void **p)
+{
+    assert(S_ISREG(cpio->ent.mode));
+    *p = NULL;
+    if (cpio->errbuf[0])
+	return -1;
+    if (cpio->hdronly)
+	return ERR("%s: no file data in header-only mode", cpio->ent.fname), -1;
+    size_t n = cpio->wend - cpio->wpos;
+    if (n == 0) {
+	unsigned long long left = cpio->endpos - cpio->curpos;
+	if (left == 0)
+	    return 0;
+	// The window never extends past the end of file data.
+	n = left < WINSIZE ? left : WINSIZE;
+	char *win = getwin(cpio);
+	if (!win)
+	    return -1;
+	if (!zreadn(cpio, win, n, cpio->ent.fname, "read cpio file data"))
+	    return -1;
+	if (cpio->hashing && !hash(cpio, win, n))
+	    return -1;
+	cpio->wpos = 0, cpio->wend = n;
+    }
+    *p = cpio->win + cpio->wpos;
+    return n;
+}
+
+const void *rpmcpio_peek(struct rpmcpio *cpio, size_t *sizep)
+{
+    const void *p;
+    ssize_t ret = rpmcpio_peek2(cpio, &p);
+    if (ret < 0)
+	die("%s", cpio->errbuf);
+    *sizep = ret;
+    return p;
+}
+
+void rpmcpio_consume(struct rpmcpio *cpio, size_t n)
+{
+    assert(n <= cpio->wend - cpio->wpos);
+    cpio->wpos += n;
+    cpio->curpos += n;
+    cpio->st.read_bytes += n;
+}
+
+ssize_t rpmcpio_readlink2(struct rpmcpio *cpio, char *buf)
 {
     assert(S_ISLNK(cpio->ent.mode));
+    if (cpio->errbuf[0])
+	return -1;
+    if (cpio->hdronly)
+	return ERR("%s: no symlink target in header-only mode", cpio->ent.fname), -1;
     unsigned long long n = cpio->endpos - cpio->curpos;
     struct cpioent *ent = &cpio->ent;
     assert(n == ent->linklen);
-    if (zread(cpio, buf, n) != n)
-	die("%s: %s: cannot read cpio symlink", cpio->rpmbname, ent->fname);
+    if (!zreadn(cpio, buf, n, ent->fname, "read cpio symlink"))
+	return -1;
     char *s = buf;
     s[n] = '\0';
     if (strlen(s) < n)
-	die("%s: %s: embedded null byte in cpio symlink", cpio->rpmbname, ent->fname);
+	return ERR("%s: embedded null byte in cpio symlink", ent->fname), -1;
     cpio->curpos += n;
+    cpio->st.read_bytes += n;
     return n;
 }
+
+size_t rpmcpio_readlink(struct rpmcpio *cpio, char *buf)
+{
+    ssize_t ret = rpmcpio_readlink2(cpio, buf);
+    if (ret < 0)
+	die("%s", cpio->errbuf);
+    return ret;
+}
+
+// The distance between checkpoints, in terms of uncompressed data.
+#define IDXSPAN (1 << 20)
+
+// The digest which identifies the package in the index.
+static void pkgdigest(const struct header *h, unsigned char digest[16])
+{
+    memset(digest, 0, 16);
+    if (h->hdrmd5)
+	memcpy(digest, h->md5, 16);
+    else if (h->paydigestlen)
+	memcpy(digest, h->paydigest, 16);
+}
+
+// Decompress the whole payload, recording the checkpoints and the offsets
+// of cpio entries.
+static bool mkindex(struct rpmcpio *cpio, struct gzindex *gx,
+		    int dirfd, const char *idxfname)
+{
+    struct header *h = &cpio->h;
+    if (cpio->hdronly)
+	return ERR("no payload in header-only mode");
+    if (!zreader_index(&cpio->z, gx)) {
+	if (errno)
+	    return ERR("cannot index %s payload: %m", h->zprog);
+	return ERR("cannot index %s payload", h->zprog);
+    }
+    struct stat st;
+    if (fstat(cpio->fda.fd, &st) < 0)
+	return ERR("fstat: %m");
+    gx->pkgsize = st.st_size;
+    gx->payload = cpio->in.pos;
+    pkgdigest(h, gx->digest);
+    gx->fileCount = h->fileCount;
+    gx->off = malloc(h->fileCount * sizeof *gx->off + 1);
+    if (!gx->off)
+	return ERR("cannot allocate %zu bytes in %s()",
+		   h->fileCount * sizeof *gx->off + 1, __func__);
+    for (unsigned i = 0; i < h->fileCount; i++)
+	gx->off[i] = -1;
+
+    int rc;
+    const struct cpioent *ent;
+    while ((rc = rpmcpio_next2(cpio, &ent)) > 0) {
+	// All but the last file in a hardlink set come without data.
+	bool nodata = S_ISREG(ent->mode) && ent->nlink > 1 && ent->size == 0;
+	gx->off[cpio->ix] = cpio->entpos | nodata;
+    }
+    if (rc < 0)
+	return false;
+
+    const char *err;
+    if (!gzindex_save(gx, dirfd, idxfname, &err)) {
+	if (err)
+	    return ERR("%s: %s", idxfname, err);
+	return ERR("%s: %m", idxfname);
+    }
+    return true;
+}
+
+int rpmcpio_index_build(int dirfd, const char *rpmfname, const char *idxfname,
+			const struct rpmcpio_opt *opt, char errbuf[RPMCPIO_ERRSIZE])
+{
+    // The index covers all the files, and is built in the same thread.
+    struct rpmcpio_opt xopt = { 0 };
+    if (opt)
+	xopt = *opt, xopt.filter = NULL, xopt.flags &= ~RPMCPIO_PIPELINE;
+    struct rpmcpio *cpio = rpmcpio_open2(dirfd, rpmfname, NULL, &xopt, errbuf);
+    if (!cpio)
+	return -1;
+    struct gzindex gx = { .span = opt && opt->idxspan ? opt->idxspan : IDXSPAN };
+    bool ok = mkindex(cpio, &gx, dirfd, idxfname);
+    if (!ok)
+	memcpy(errbuf, cpio->errbuf, RPMCPIO_ERRSIZE);
+    gzindex_free(&gx);
+    rpmcpio_close(cpio);
+    return ok ? 0 : -1;
+}
+
+// Decompress up to the file's cpio entry at the offset off, which must not
+// be behind, and set up the handle to read the entry alone.
+static bool skipto(struct rpmcpio *cpio, unsigned long long off, char *win)
+{
+    while (cpio->curpos < off) {
+	unsigned long long n = off - cpio->curpos;
+	if (n > WINSIZE)
+	    n = WINSIZE;
+	if (!zreadn(cpio, win, n, NULL, "skip cpio bytes"))
+	    return false;
+	cpio->curpos += n;
+    }
+    cpio->endpos = off;
+    cpio->left = 1;
+    cpio->lone = true;
+    return true;
+}
+
+// Position the handle right before the file's cpio entry, starting
+// decompression at the nearest checkpoint, then read the entry.
+static bool seekent(struct rpmcpio *cpio, const struct gzindex *gx, const char *fname)
+{
+    struct header *h = &cpio->h;
+    if (cpio->hdronly)
+	return ERR("no payload in header-only mode");
+    struct stat st;
+    if (fstat(cpio->fda.fd, &st) < 0)
+	return ERR("fstat: %m");
+    unsigned char digest[16];
+    pkgdigest(h, digest);
+    if (gx->pkgsize != st.st_size || gx->payload != cpio->in.pos ||
+	    memcmp(gx->digest, digest, 16) || gx->fileCount != h->fileCount)
+	return ERR("stale index");
+
+    unsigned ix = header_find(h, fname, strlen(fname));
+    if (ix == -1)
+	return ERR("%s: file not in rpm header", fname);
+    unsigned long long off = gx->off[ix];
+    if (off == -1)
+	return ERR("%s: file not in cpio archive", fname);
+    if (off & 2)
+	return ERR("bad index offset");
+    cpio->lonedata = !(off & 1);
+    off &= ~1ULL;
+
+    char *win = getwin(cpio);
+    if (!win)
+	return false;
+    const struct gzpoint *pt = gzindex_find(gx, off);
+    if (pt) {
+	if (!gzindex_window(gx, pt, win))
+	    return ERR("bad index window");
+	if (pt->in <= cpio->in.pos || !inseek(&cpio->in, pt->in - (pt->bits > 0)))
+	    return ERR("cannot seek to index checkpoint");
+	if (!zreader_resume(&cpio->z, &cpio->in, pt->bits, win, pt->wsize)) {
+	    if (errno)
+		return ERR("cannot resume %s decompression: %m", h->zprog);
+	    return ERR("cannot resume %s decompression", h->zprog);
+	}
+	cpio->curpos = pt->out;
+    }
+
+    // The offset is only trusted once the entry is there.
+    const struct cpioent *ent;
+    if (!skipto(cpio, off, win) || rpmcpio_next2(cpio, &ent) < 0)
+	return false;
+    if (!ent || cpio->ix != ix)
+	return ERR("stale index");
+    cpio->pending = true;
+    return true;
+}
+
+// Read the file's cpio entry off the payload which is decompressed from the
+// beginning, up to the file.
+static bool scanto(struct rpmcpio *cpio, unsigned ix, const char *fname)
+{
+    int rc;
+    const struct cpioent *ent;
+    while ((rc = rpmcpio_next2(cpio, &ent)) > 0)
+	if (cpio->ix == ix) {
+	    cpio->left = 0;
+	    cpio->pending = true;
+	    return true;
+	}
+    if (rc == 0)
+	return ERR("%s: file not in cpio archive", fname);
+    return false;
+}
+
+// Predict the offset of the file's cpio entry in the uncompressed payload,
+// from the sizes in the header, assuming that the archive has been written
+// by rpm: in header order, with "./"-prefixed filenames (except in source
+// packages), and with the data coming with the last file in a hardlink set.
+// Sets *nodata for the other files in the set.
+static unsigned long long predict(struct rpmcpio *cpio, unsigned ix, bool *nodata)
+{
+    struct header *h = &cpio->h;
+    // Hardlink sets in progress: the inode and the number of files seen,
+    // in a hash table with linear probing (cnt == 0 marks an empty slot),
+    // with at least twice as many slots as there are hardlinked files.
+    unsigned nhard = 0;
+    for (unsigned i = 0; i <= ix; i++)
+	if (S_ISREG(h->ffi[i].mode) && h->ffx[i].nlink > 1)
+	    nhard++;
+    unsigned nslot = 64;
+    while (nslot < 2 * nhard)
+	nslot *= 2;
+    struct { unsigned ino, cnt; } *hs = NULL;
+    if (nhard && !(hs = calloc(nslot, sizeof *hs)))
+	return -1;
+    unsigned hmask = nslot - 1;
+    unsigned long long pos = 0;
+    for (unsigned i = 0; ; i++) {
+	struct fi *fi = &h->ffi[i];
+	struct fx *fx = &h->ffx[i];
+	if (fi->fflags & RPMFILE_GHOST)
+	    continue;
+	unsigned long long size = 0;
+	if (S_ISREG(fi->mode) || S_ISLNK(fi->mode))
+	    size = fx->size;
+	if (S_ISREG(fi->mode) && fx->nlink > 1) {
+	    unsigned j = (fx->ino * 2654435761U) & hmask;
+	    while (hs[j].cnt && hs[j].ino != fx->ino)
+		j = (j + 1) & hmask;
+	    hs[j].ino = fx->ino;
+	    if (++hs[j].cnt < fx->nlink)
+		size = 0;
+	}
+	if (i == ix) {
+	    *nodata = S_ISREG(fi->mode) && fx->nlink > 1 && size == 0;
+	    free(hs);
+	    return pos;
+	}
+	if (h->longfile.sizes)
+	    pos += 16;
+	else {
+	    size_t namelen = h->src.rpm ? fi->blen :
+			     h->old.fnames ? 1 + fi->blen : 1 + fi->dlen + fi->blen;
+	    pos += (110 + namelen + 1 + 3) & ~3;
+	}
+	pos += (size + 3) & ~3ULL;
+    }
+}
+
+// Position the handle right before the file's cpio entry using the xz index,
+// if the payload has multiple blocks, then read the entry.
+static bool seekxz(struct rpmcpio *cpio, int dirfd, const char *rpmfname,
+		   const struct rpmcpio_opt *opt, const char *fname)
+{
+    struct header *h = &cpio->h;
+    if (cpio->hdronly)
+	return ERR("no payload in header-only mode");
+    unsigned ix = header_find(h, fname, strlen(fname));
+    if (ix == -1)
+	return ERR("%s: file not in rpm header", fname);
+    if (h->ffi[ix].fflags & RPMFILE_GHOST)
+	return ERR("%s: file not in cpio archive", fname);
+
+    bool nodata;
+    unsigned long long off = predict(cpio, ix, &nodata);
+    if (off == -1)
+	return ERR("cannot allocate memory in %s()", __func__);
+    struct stat st;
+    unsigned long long outpos;
+    if (fstat(cpio->fda.fd, &st) < 0 ||
+	    !zreader_xzseek(&cpio->z, &cpio->in, st.st_size, off, &outpos))
+	return scanto(cpio, ix, fname);
+    if (outpos == 0)
+	return scanto(cpio, ix, fname);
+
+    // Verify the prediction by reading the entry.
+    char *win = getwin(cpio);
+    if (!win)
+	return false;
+    cpio->curpos = outpos;
+    cpio->lonedata = !nodata;
+    const struct cpioent *ent;
+    if (skipto(cpio, off, win) && rpmcpio_next2(cpio, &ent) > 0 && cpio->ix == ix) {
+	cpio->pending = true;
+	return true;
+    }
+
+    // Otherwise, start over: whatever has gone wrong, the payload still
+    // may be all right.
+    if (!reopen(cpio, dirfd, rpmfname, NULL, opt, false))
+	return false;
+    return scanto(cpio, ix, fname);
+}
+
+struct rpmcpio *rpmcpio_open_at(int dirfd, const char *rpmfname,
+				const char *idxfname, const char *fname,
+				const struct rpmcpio_opt *opt,
+				char errbuf[RPMCPIO_ERRSIZE])
+{
+    // The file is already selected, and the decoder is repositioned,
+    // so that the payload cannot be verified.
+    struct rpmcpio_opt xopt = { 0 };
+    if (opt) {
+	xopt = *opt, xopt.filter = NULL;
+	xopt.flags &= ~(RPMCPIO_PIPELINE | RPMCPIO_PAYLOAD_DIGEST);
+    }
+    struct rpmcpio *cpio = create(dirfd, rpmfname, NULL, &xopt, !idxfname, errbuf);
+    if (!cpio)
+	return NULL;
+    bool ok;
+    if (!idxfname)
+	ok = seekxz(cpio, dirfd, rpmfname, &xopt, fname);
+    else {
+	struct gzindex gx;
+	const char *err;
+	ok = gzindex_load(&gx, dirfd, idxfname, &err);
+	if (!ok) {
+	    if (err)
+		ERR("%s: %s", idxfname, err);
+	    else
+		ERR("%s: %m", idxfname);
+	}
+	else
+	    ok = seekent(cpio, &gx, fname);
+	gzindex_free(&gx);
+    }
+    if (!ok) {
+	memcpy(errbuf, cpio->errbuf, RPMCPIO_ERRSIZE);
+	rpmcpio_close(cpio);
+	return NULL;
+    }
+    return cpio;
+}
+
+// Get the tag from the retained header.  Returns the number of elements,
+// 0 if there is no such tag, or -1 on error.
+static ssize_t gettag(struct rpmcpio *cpio, unsigned tag, unsigned type, void **data)
+{
+    *data = NULL;
+    if (cpio->errbuf[0])
+	return -1;
+    if (!cpio->tags)
+	return ERR("no header tags without RPMCPIO_HEADER_TAGS"), -1;
+    unsigned cnt;
+    const char *err;
+    *data = header_tag(&cpio->h, tag, type, &cnt, &err);
+    if (err)
+	return ERR("tag %u: %s", tag, err), -1;
+    return cnt;
+}
+
+ssize_t rpmcpio_tag_int16(struct rpmcpio *cpio, unsigned tag, const unsigned short **v)
+{
+    return gettag(cpio, tag, RPM_INT16_TYPE, (void **) v);
+}
+
+ssize_t rpmcpio_tag_int32(struct rpmcpio *cpio, unsigned tag, const unsigned **v)
+{
+    return gettag(cpio, tag, RPM_INT32_TYPE, (void **) v);
+}
+
+ssize_t rpmcpio_tag_int64(struct rpmcpio *cpio, unsigned tag, const unsigned long long **v)
+{
+    return gettag(cpio, tag, RPM_INT64_TYPE, (void **) v);
+}
+
+ssize_t rpmcpio_tag_strv(struct rpmcpio *cpio, unsigned tag, const char *const **v)
+{
+    return gettag(cpio, tag, RPM_STRING_ARRAY_TYPE, (void **) v);
+}
+
+ssize_t rpmcpio_tag_bin(struct rpmcpio *cpio, unsigned tag, const void **p)
+{
+    return gettag(cpio, tag, RPM_BIN_TYPE, (void **) p);
+}
+
+const char *rpmcpio_tag_str(struct rpmcpio *cpio, unsigned tag)
+{
+    const char *const *v;
+    if (rpmcpio_tag_strv(cpio, tag, &v) <= 0)
+	return NULL;
+    return v[0];
+}
+
+// Per-file tags must have an element for each file.
+static bool entcnt(struct rpmcpio *cpio, unsigned tag, ssize_t cnt)
+{
+    assert(cpio->ix != -1);
+    if (cnt != cpio->h.fileCount)
+	return ERR("tag %u: bad tag count", tag);
+    return true;
+}
+
+const char *rpmcpio_ent_str(struct rpmcpio *cpio, unsigned tag)
+{
+    const char *const *v;
+    ssize_t cnt = rpmcpio_tag_strv(cpio, tag, &v);
+    if (cnt <= 0 || !entcnt(cpio, tag, cnt))
+	return NULL;
+    return v[cpio->ix];
+}
+
+int rpmcpio_ent_int(struct rpmcpio *cpio, unsigned tag, unsigned *v)
+{
+    ssize_t cnt;
+    // Either INT16 or INT32, whichever the header has.
+    if (cpio->tags && header_tagtype(&cpio->h, tag) == RPM_INT16_TYPE) {
+	const unsigned short *v16;
+	cnt = rpmcpio_tag_int16(cpio, tag, &v16);
+	if (cnt > 0 && entcnt(cpio, tag, cnt))
+	    return *v = v16[cpio->ix], 1;
+    }
+    else {
+	const unsigned *v32;
+	cnt = rpmcpio_tag_int32(cpio, tag, &v32);
+	if (cnt > 0 && entcnt(cpio, tag, cnt))
+	    return *v = v32[cpio->ix], 1;
+    }
+    return cpio->errbuf[0] ? -1 : 0;
+}
+
+#define RPMTAG_FILEDIGESTS    1035
+#define RPMTAG_FILEUSERNAME   1039
+#define RPMTAG_FILEGROUPNAME  1040
+#define RPMTAG_FILECOLORS     1140
+#define RPMTAG_FILECLASS      1141
+#define RPMTAG_CLASSDICT      1142
+#define RPMTAG_FILECAPS       5010
+
+const char *rpmcpio_ent_owner(struct rpmcpio *cpio)
+{
+    return rpmcpio_ent_str(cpio, RPMTAG_FILEUSERNAME);
+}
+
+const char *rpmcpio_ent_group(struct rpmcpio *cpio)
+{
+    return rpmcpio_ent_str(cpio, RPMTAG_FILEGROUPNAME);
+}
+
+const char *rpmcpio_ent_digest(struct rpmcpio *cpio)
+{
+    return rpmcpio_ent_str(cpio, RPMTAG_FILEDIGESTS);
+}
+
+const char *rpmcpio_ent_caps(struct rpmcpio *cpio)
+{
+    return rpmcpio_ent_str(cpio, RPMTAG_FILECAPS);
+}
+
+unsigned rpmcpio_ent_color(struct rpmcpio *cpio)
+{
+    unsigned color;
+    return rpmcpio_ent_int(cpio, RPMTAG_FILECOLORS, &color) > 0 ? color : 0;
+}
+
+const char *rpmcpio_ent_class(struct rpmcpio *cpio)
+{
+    unsigned ix;
+    if (rpmcpio_ent_int(cpio, RPMTAG_FILECLASS, &ix) <= 0)
+	return NULL;
+    const char *const *dict;
+    ssize_t cnt = rpmcpio_tag_strv(cpio, RPMTAG_CLASSDICT, &dict);
+    if (cnt <= 0)
+	return NULL;
+    if (ix >= cnt)
+	return ERR("tag %u: bad class index", RPMTAG_FILECLASS), NULL;
+    return dict[ix];
+}
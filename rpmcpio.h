@@ -19,6 +19,7 @@
 // SOFTWARE.
 
 #pragma once
+#include <sys/types.h> // ssize_t
 #ifndef __cplusplus
 #include <stddef.h>
 #else
@@ -36,6 +37,116 @@ extern "C" {
 struct rpmcpio *rpmcpio_open(int dirfd, const char *rpmfname, unsigned *nent);
 void rpmcpio_close(struct rpmcpio *cpio);
 
+// Additional options for rpmcpio_openx.  The structure should be
+// zero-initialized, and then only the fields of interest need to be set.
+struct rpmcpio_opt {
+    // Bitwise OR of RPMCPIO_* flags, see below.
+    unsigned flags;
+    // Decode xz payloads with up to this many threads.  Only multi-block
+    // streams, such as those created with xz -T, can be decoded in parallel;
+    // other streams are decoded in a single thread, as with xzthreads=0.
+    unsigned xzthreads;
+    // With xzthreads, the memory limit for the threaded decoder, in bytes;
+    // fewer threads are used when the limit would be exceeded.  The default
+    // (xzmemlimit=0) is a quarter of physical memory.
+    unsigned long long xzmemlimit;
+    // With rpmcpio_index_build, the distance between checkpoints, in bytes
+    // of uncompressed data.  The default (idxspan=0) is 1M.
+    unsigned long long idxspan;
+    // Only return the files selected by the filter, see below.
+    const struct rpmcpio_filter *filter;
+};
+
+// The filter is matched against the file list in the rpm header, when the
+// package is opened.  The files which are not selected are skipped by
+// rpmcpio_next (their data is still decompressed, but their filenames are
+// not necessarily built).  Once the last selected file has been returned,
+// the next rpmcpio_next call returns NULL without decompressing the rest
+// of the payload (which is therefore not verified), and the package file
+// is closed.  In a hardlink set, only the last file comes with the data,
+// so it is also returned whenever another file from the set is selected.
+// A file is selected if all of the following holds:
+struct rpmcpio_filter {
+    // The filename matches any of the patterns, a NULL-terminated list
+    // (fnames=NULL selects all filenames).  A pattern which ends with '/'
+    // is a prefix, e.g. "/usr/share/doc/" selects everything under the
+    // directory.  Other patterns are fnmatch(3) globs, in which '*' also
+    // matches '/', e.g. "/usr/lib*/*.so*".
+    const char *const *fnames;
+    // The file has all of the fflags bits in fflags_set, and none of those
+    // in fflags_clear, e.g. fflags_set = RPMFILE_CONFIG = 1 << 0.
+    unsigned fflags_set, fflags_clear;
+    // The file is of one of the types, a bitwise OR of RPMCPIO_TYPE(S_IFREG),
+    // RPMCPIO_TYPE(S_IFLNK) etc.; types=0 selects all file types.
+    unsigned types;
+};
+
+#define RPMCPIO_TYPE(ifmt) (1U << ((ifmt) >> 12 & 15))
+
+// Memory-map the package, so that the header and the compressed payload
+// are read directly from the mapping, without read(2) calls and buffering.
+// Only applies to regular files, otherwise the flag is silently ignored.
+#define RPMCPIO_MMAP (1 << 0)
+
+// List the files from the package header, without opening the payload.
+// rpmcpio_next returns all the files in header order, %ghost files included
+// (RPMFILE_GHOST = 1 << 6 in ent->fflags), with stat info from the header.
+// In this mode, each file in a hardlink set has its actual size, and file
+// data cannot be read: rpmcpio_read, rpmcpio_peek and rpmcpio_readlink fail.
+#define RPMCPIO_HEADER_ONLY (1 << 1)
+
+// Decompress the payload in a background thread, which runs ahead of the
+// caller and passes the data through a ring buffer, so that decompression
+// overlaps with whatever the caller does with the entries and file data.
+// Pays off with slow decoders (xz) when the data is processed, e.g. hashed;
+// otherwise the extra copy and thread handoffs only make it slower.
+// Ignored by rpmcpio_index_build and rpmcpio_open_at.
+#define RPMCPIO_PIPELINE (1 << 2)
+
+// Measure the time spent in the decoder, see rpmcpio_stats.  Each call to
+// the decoder is timed, which costs some 20-50ns.
+#define RPMCPIO_TIMING (1 << 3)
+
+// Verify file data against the digests in the rpm header (MD5, SHA256, etc.,
+// per FILEDIGESTALGO).  The data of regular files is hashed as it goes
+// through the library, whether it is read by the caller or skipped by
+// rpmcpio_next, and the digest is checked once the handle moves past the
+// file: a mismatch is reported by the next rpmcpio_next call, as an error.
+// Files which are not selected by the filter are not verified, neither is
+// the last file if the caller stops short of the end of the archive.
+// With RPMCPIO_HEADER_ONLY, the digests are only exposed in cpioent.
+#define RPMCPIO_DIGEST (1 << 4)
+
+// Verify the compressed payload against its digest in the rpm header
+// (PAYLOADDIGEST), or, with older packages which have none, against the
+// MD5 of the header plus the payload in the signature header.  The payload
+// is hashed as the decoder takes it, and checked when the trailer is reached,
+// along with the payload size, also from the signature header: a corrupt or
+// truncated package fails the rpmcpio_next call which would return NULL,
+// with no separate pass over the file (such as rpm -K).  Stopping short of
+// the trailer (e.g. with a filter) skips the check.  The MD5 requires the
+// header to be read again, which is not possible with a pipe, in which case
+// the payload is not verified.  Ignored by rpmcpio_open_at.
+#define RPMCPIO_PAYLOAD_DIGEST (1 << 5)
+
+// Retain the rpm header, so that any of its tags can be accessed with
+// rpmcpio_tag_* and rpmcpio_ent_*, see below.  The header is then read into
+// memory as a whole, rather than streamed through, and stays there until
+// the handle is reopened or closed.
+#define RPMCPIO_HEADER_TAGS (1 << 6)
+
+// Same as rpmcpio_open, with additional options (opt can be NULL).
+struct rpmcpio *rpmcpio_openx(int dirfd, const char *rpmfname, unsigned *nent,
+			      const struct rpmcpio_opt *opt);
+
+// Re-target the handle at another package, as if it were closed and opened
+// anew, only faster: the decoder state and the memory allocated for the rpm
+// header and file data are reused.  This helps with scanning a lot of small
+// packages.  Dies on error.  (rpmcpio_reopen2, which returns -1 on error,
+// can be called on a handle which has failed, see below.)
+void rpmcpio_reopen(struct rpmcpio *cpio, int dirfd, const char *rpmfname,
+		    unsigned *nent, const struct rpmcpio_opt *opt);
+
 // Archive entries are exposed through this structure:
 struct cpioent {
     // Each file in the archive is identified by its inode number.
@@ -68,6 +179,11 @@ struct cpioent {
     // basename-only filenames with no slashes in them.  Binary packages have
     // absolute pathnames which start with '/'.
     const char *fname;
+    // With RPMCPIO_DIGEST, the expected digest of file data, as recorded
+    // in the rpm header, digestlen bytes (e.g. 32 with SHA256); NULL if the
+    // file has no digest (e.g. if it is not a regular file).
+    const unsigned char *digest;
+    unsigned digestlen;
 };
 
 // Iterate the archive entries, until NULL is returned.  Dies on error.
@@ -80,6 +196,17 @@ const struct cpioent *rpmcpio_next(struct rpmcpio *cpio);
 // Piecemeal reads are okay, no need to read the data in one fell swoop.
 size_t rpmcpio_read(struct rpmcpio *cpio, void *buf, size_t size);
 
+// Access file data in place, without copying it to the caller's buffer.
+// The entry must be S_ISREG(ent->mode).  Returns a pointer to the next chunk
+// of decompressed file data, its size returned via sizep.  Returns NULL with
+// *sizep = 0 when there is no more data.  Dies on error.  The data stays valid
+// until the next call that advances the handle.  The call does not consume
+// the data: repeated calls return the same chunk, until some of its bytes are
+// consumed with rpmcpio_consume (n must not exceed *sizep).  Can be mixed
+// with rpmcpio_read, which takes the bytes left in the chunk first.
+const void *rpmcpio_peek(struct rpmcpio *cpio, size_t *sizep);
+void rpmcpio_consume(struct rpmcpio *cpio, size_t n);
+
 // The rules for reading the target of a symbolic link.  The entry must be
 // S_ISLNK(ent->mode).  The strlen of the target, without the trailing '\0',
 // is ent->linklen.  The caller must provide a buffer of at least linklen + 1
@@ -87,6 +214,266 @@ size_t rpmcpio_read(struct rpmcpio *cpio, void *buf, size_t size);
 // returned.  There will be no embedded null bytes in the string.
 size_t rpmcpio_readlink(struct rpmcpio *cpio, char *buf);
 
+// The functions above die on the first error, which is inadequate for
+// a long-running process that scans a whole repository: one corrupt package
+// shouldn't take it down.  The following functions report errors instead.
+// The error message, prefixed with the package basename, is written to the
+// caller's errbuf (on open) or stored in the handle (and can be retrieved
+// with rpmcpio_strerror).  The message fits into RPMCPIO_ERRSIZE bytes.
+#define RPMCPIO_ERRSIZE 1024
+
+// Returns NULL on error; the error message is placed into errbuf.
+struct rpmcpio *rpmcpio_open2(int dirfd, const char *rpmfname, unsigned *nent,
+			      const struct rpmcpio_opt *opt,
+			      char errbuf[RPMCPIO_ERRSIZE]);
+
+// Returns 1 with *ent set, or 0 at the end of the archive (*ent = NULL),
+// or -1 on error.
+int rpmcpio_next2(struct rpmcpio *cpio, const struct cpioent **ent);
+
+// Return the number of bytes read, or -1 on error.
+ssize_t rpmcpio_read2(struct rpmcpio *cpio, void *buf, size_t size);
+ssize_t rpmcpio_readlink2(struct rpmcpio *cpio, char *buf);
+
+// Returns the size of the chunk, with *p pointing to the data, or 0 when
+// there is no more data, or -1 on error.
+ssize_t rpmcpio_peek2(struct rpmcpio *cpio, const void **p);
+
+// Returns 0 on success, -1 on error.
+int rpmcpio_reopen2(struct rpmcpio *cpio, int dirfd, const char *rpmfname,
+		    unsigned *nent, const struct rpmcpio_opt *opt);
+
+// Open the package from a file descriptor, such as a pipe or stdin, which
+// is read from its current offset; or from a buffer in memory, e.g. from
+// a cache, which the header parser and the decoders then read in place,
+// with no copies, just as with RPMCPIO_MMAP.  The fd is not closed by the
+// library, and its offset is left unspecified, because of read-ahead.  The
+// buffer must stay valid until the handle is reopened or closed.  Since
+// there is no filename, the error messages are prefixed with the name,
+// which can be anything, e.g. "stdin" or a URL.  RPMCPIO_MMAP applies if
+// the fd refers to a regular file; with a pipe, the MD5 of old packages
+// cannot be verified.  Returns NULL on error; the error message is placed
+// into errbuf.
+struct rpmcpio *rpmcpio_fdopen(int fd, const char *name, unsigned *nent,
+			       const struct rpmcpio_opt *opt,
+			       char errbuf[RPMCPIO_ERRSIZE]);
+struct rpmcpio *rpmcpio_memopen(const void *buf, size_t size, const char *name,
+				unsigned *nent, const struct rpmcpio_opt *opt,
+				char errbuf[RPMCPIO_ERRSIZE]);
+
+// Same as rpmcpio_reopen2, with a file descriptor or a buffer.
+int rpmcpio_fdreopen(struct rpmcpio *cpio, int fd, const char *name,
+		     unsigned *nent, const struct rpmcpio_opt *opt);
+int rpmcpio_memreopen(struct rpmcpio *cpio, const void *buf, size_t size,
+		      const char *name, unsigned *nent, const struct rpmcpio_opt *opt);
+
+// After an error, the handle cannot proceed: all further calls return -1,
+// and the only things left to do are rpmcpio_reopen2 and rpmcpio_close.
+// The error message is retained until then; NULL is returned if there was
+// no error.  If rpmcpio_reopen2 fails, the handle still can be reopened.
+const char *rpmcpio_strerror(struct rpmcpio *cpio);
+
+// Access to the rpm header tags, with RPMCPIO_HEADER_TAGS, without librpm.
+// A tag's data is decoded when the tag is first requested, and stays valid
+// until the handle is reopened or closed.  The functions return the number
+// of elements (bytes with binary data), 0 if the header has no such tag,
+// or -1 on error, the tag being of another type being an error.  Integers
+// come in host byte order.  Strings come as an array of pointers, and STRING,
+// STRING_ARRAY and I18NSTRING tags can be requested alike (with I18NSTRING,
+// the first string is the untranslated one).  rpmcpio_tag_str returns the
+// first string, or NULL if there is no such tag or on error.
+ssize_t rpmcpio_tag_int16(struct rpmcpio *cpio, unsigned tag, const unsigned short **v);
+ssize_t rpmcpio_tag_int32(struct rpmcpio *cpio, unsigned tag, const unsigned **v);
+ssize_t rpmcpio_tag_int64(struct rpmcpio *cpio, unsigned tag, const unsigned long long **v);
+ssize_t rpmcpio_tag_strv(struct rpmcpio *cpio, unsigned tag, const char *const **v);
+ssize_t rpmcpio_tag_bin(struct rpmcpio *cpio, unsigned tag, const void **p);
+const char *rpmcpio_tag_str(struct rpmcpio *cpio, unsigned tag);
+
+// Per-file tags for the entry last returned by rpmcpio_next, which is looked
+// up by its position in the header's file list (rather than by filename).
+// rpmcpio_ent_str returns NULL if the header has no such tag, or on error
+// (see rpmcpio_strerror), e.g. FILELINKTOS = 1036 gives the symlink target
+// in the header-only mode.  rpmcpio_ent_int takes INT16 or INT32 tags, and
+// returns 1 with *v set, 0 if there is no such tag, or -1 on error.
+const char *rpmcpio_ent_str(struct rpmcpio *cpio, unsigned tag);
+int rpmcpio_ent_int(struct rpmcpio *cpio, unsigned tag, unsigned *v);
+
+// The shorthands for the usual per-file tags: the owner and the group names,
+// the hex digest ("" for files other than regular files), the file(1) class,
+// the capabilities (as with cap_to_text, "" if none), and the color (1 for
+// ELF32, 2 for ELF64, 0 if unknown).  Where the header has no such tag,
+// the functions return NULL (or 0).
+const char *rpmcpio_ent_owner(struct rpmcpio *cpio);
+const char *rpmcpio_ent_group(struct rpmcpio *cpio);
+const char *rpmcpio_ent_digest(struct rpmcpio *cpio);
+const char *rpmcpio_ent_class(struct rpmcpio *cpio);
+const char *rpmcpio_ent_caps(struct rpmcpio *cpio);
+unsigned rpmcpio_ent_color(struct rpmcpio *cpio);
+
+// Extract the remaining entries to the directory tree under dirfd (dirfd
+// can be AT_FDCWD).  The leading slashes are stripped from the filenames,
+// and the missing directories are created.  The files get their modes and
+// mtimes (but not the owners); existing files are replaced.  Regular files
+// are preallocated with fallocate, and hardlink sets are created with linkat.
+// The directories get their modes and mtimes when done, so that they stay
+// writable.  Device files and sockets cannot be extracted.  Symlinks which
+// come with the package are resolved as if dirfd were the root directory,
+// provided that the kernel supports openat2 (Linux 5.6).  The file data
+// is written through io_uring, in batches, so that the decoder does not
+// wait for the writes to complete; if io_uring is not available, plain
+// syscalls are used.  Entries not selected by the filter are skipped.
+// Returns 0 on success, or -1 on error (see rpmcpio_strerror), with the
+// tree left as it is.
+int rpmcpio_extract(struct rpmcpio *cpio, int dirfd, unsigned flags);
+
+// Instead of preallocating regular files, skip 4K blocks of zeros,
+// leaving holes.
+#define RPMCPIO_EXTRACT_SPARSE (1 << 0)
+// Use plain syscalls even if io_uring is available.
+#define RPMCPIO_EXTRACT_NOURING (1 << 1)
+// Hand the regular files over to a pool of n writer threads (n < 256), so
+// that the decompressing thread does not wait on filesystem latency, such as
+// with close on XFS or overlayfs.  Directories and symlinks are still made
+// by the decompressing thread, before the files under them are handed over.
+// The data is queued in 64K chunks, up to 16M in total, after which the
+// decompressing thread waits for the writers to catch up.  Takes precedence
+// over io_uring.
+#define RPMCPIO_EXTRACT_WRITERS(n) ((n) << 8)
+
+// Push-style parsing, for packages which come piecemeal, e.g. from a socket
+// in an event loop, where the reads must not block.  Rather than reading
+// the package itself, the handle is fed with whatever bytes have arrived,
+// and goes as far as they allow: the header, the decoder and the cpio
+// entries are all parsed incrementally, the state being kept in between
+// the calls.  The entries and the file data are reported through callbacks,
+// which are run from within rpmcpio_feed (on a stack of the library's own,
+// 1M in size), and which must not advance the handle, though they can
+// use rpmcpio_tag_* and rpmcpio_ent_*.
+struct rpmcpio_push {
+    // Called for each entry, as returned by rpmcpio_next2.  Return 0 to get
+    // the file data (of regular files, and the targets of symlinks) through
+    // the data callback, 1 to skip it, or -1 to stop parsing, which fails
+    // the package.  Can be NULL.
+    int (*entry)(void *arg, struct rpmcpio *cpio, const struct cpioent *ent);
+    // The file data, in chunks of up to 256K, which are only valid during
+    // the call.  Return 0 to continue, or -1 to stop.  Can be NULL.
+    int (*data)(void *arg, struct rpmcpio *cpio, const void *buf, size_t size);
+    // Called once, at the end of the archive (err=NULL), or on error, with
+    // the same message as rpmcpio_strerror.  Can be NULL.
+    void (*done)(void *arg, struct rpmcpio *cpio, const char *err);
+    void *arg;
+};
+
+// Create a push handle.  The name only serves to prefix the error messages,
+// as with rpmcpio_fdopen.  The options are applied when the header
+// has been fed (the filter must stay valid until then); RPMCPIO_MMAP and
+// RPMCPIO_PIPELINE are ignored, and the MD5 of old packages cannot be
+// verified with RPMCPIO_PAYLOAD_DIGEST, as with a pipe.  Returns NULL on
+// error, the error message is placed into errbuf.
+struct rpmcpio *rpmcpio_push_open(const char *name, const struct rpmcpio_opt *opt,
+				  const struct rpmcpio_push *cb,
+				  char errbuf[RPMCPIO_ERRSIZE]);
+
+// Feed the next len bytes of the package, which are parsed right away,
+// with no copies made.  Returns the number of bytes consumed, which is
+// len unless a callback has called rpmcpio_pause, in which case the rest
+// has to be fed again (e.g. once the event loop has had its turn); or -1
+// on error.  The end of the package is signaled with len=0.  Once the
+// done callback has been called, the bytes which follow are accepted and
+// ignored.  The amount of work done per call is thereby bounded by len,
+// and, since the payload can be highly compressed, by pausing.
+ssize_t rpmcpio_feed(struct rpmcpio *cpio, const void *data, size_t len);
+void rpmcpio_pause(struct rpmcpio *cpio);
+
+// Performance counters, for the package last opened with the handle
+// (they are reset by rpmcpio_reopen), which tell where the time goes.
+struct rpmcpio_stats {
+    // The sizes of the compressed payload and of the uncompressed cpio
+    // archive, according to the signature header; 0 if unknown.  Against
+    // zbytes and bytes below, these tell the progress.
+    unsigned long long payload_zsize, payload_size;
+    // Compressed bytes consumed by the decoder (from the package file,
+    // possibly read ahead), and uncompressed bytes produced.
+    unsigned long long zbytes, bytes;
+    // File data read by the caller (with rpmcpio_read, rpmcpio_consume
+    // or rpmcpio_readlink), and skipped by rpmcpio_next.
+    unsigned long long read_bytes, skip_bytes;
+    // Calls to the decoder, and refills of the file buffer (there are
+    // no refills with RPMCPIO_MMAP).
+    unsigned long long zread_calls, refills;
+    // How cpio entries were matched against the file list in the header:
+    // the entry followed the previous one (the fast path), or else the
+    // list was searched, either with binary search or, once the payload
+    // order has proved to diverge from the header, with a hash table.
+    unsigned long long find_hits, find_bsearch, find_hash;
+    // The number of binary search iterations.
+    unsigned long long find_steps;
+    // With RPMCPIO_TIMING, the time spent in the decoder, including reads
+    // from the package file, in nanoseconds.  With RPMCPIO_PIPELINE, this
+    // is the time spent by the background thread, which is always measured.
+    unsigned long long decode_ns;
+    // With rpmcpio_extract, the time spent in the filesystem calls, either
+    // by the calling thread or, with the writer threads, summed over them
+    // (plus the directories and symlinks, made by the calling thread);
+    // and the time the calling thread was held up waiting for the writes
+    // to complete (for io_uring completions, or for the writer threads to
+    // catch up), in nanoseconds.  Against decode_ns, these tell whether
+    // the decoder is kept busy.
+    unsigned long long write_ns, wait_ns;
+};
+void rpmcpio_stats(struct rpmcpio *cpio, struct rpmcpio_stats *st);
+
+// Random access to gzip payloads.  To extract a single file, the payload
+// normally has to be decompressed up to the file.  rpmcpio_index_build makes
+// a pass through the payload and writes an index file, with checkpoints at
+// which decompression can be restarted (each takes some 10K).  Then
+// rpmcpio_open_at opens the package at the checkpoint nearest to the file,
+// and the handle yields only that file: the first rpmcpio_next2 call
+// returns its entry, the next returns 0.  The fname must be spelled as in
+// cpioent.  As with the sequential access, only the last file in a hardlink
+// set comes with data.  The index file is relative to dirfd, same as
+// rpmfname.  Both functions return -1 or NULL on error, with the message
+// in errbuf.  Not supported with ISA-L (make INFLATE=isal).  The filter
+// in opt, if any, is ignored.
+//
+// With idxfname=NULL, rpmcpio_open_at needs no index file.  xz payloads
+// compressed in multiple blocks (xz -T, --block-size) carry their own index,
+// and decompression starts at the block which holds the file (the file's
+// offset being computed from the sizes in the rpm header).  Other payloads
+// are decompressed from the beginning, up to the file.
+int rpmcpio_index_build(int dirfd, const char *rpmfname, const char *idxfname,
+			const struct rpmcpio_opt *opt,
+			char errbuf[RPMCPIO_ERRSIZE]);
+struct rpmcpio *rpmcpio_open_at(int dirfd, const char *rpmfname,
+				const char *idxfname, const char *fname,
+				const struct rpmcpio_opt *opt,
+				char errbuf[RPMCPIO_ERRSIZE]);
+
+// Process a batch of packages in parallel.  Each thread has its own handle,
+// which is reopened for each package.  The packages are scheduled by their
+// compressed size, largest first, and idle threads steal work from the busy
+// ones, so that a few big packages do not hold up the run.
+struct rpmcpio_batch {
+    // Called for each entry, from the worker threads: concurrently, but
+    // in order for any given package (pkg is the index into rpmfnames).
+    // File data can be read from cpio, as usual.  Returns 0 to continue,
+    // 1 to skip the rest of the package, -1 to stop the batch.
+    int (*entry)(void *arg, unsigned pkg, struct rpmcpio *cpio,
+		 const struct cpioent *ent);
+    // Optional, called when done with a package, with err=NULL on success,
+    // otherwise with the error message.
+    void (*done)(void *arg, unsigned pkg, const char *err);
+    void *arg;
+    // The number of threads, 0 means the number of online CPUs.
+    unsigned nthreads;
+};
+
+// Returns the number of packages which failed, or -1 with errno set:
+// to ECANCELED if the batch was stopped, or to ENOMEM.
+int rpmcpio_batch_run(int dirfd, const char *const *rpmfnames, unsigned n,
+		      const struct rpmcpio_opt *opt,
+		      const struct rpmcpio_batch *batch);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,139 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Scan many packages in parallel, with rpmcpio_batch_run.
+//
+// rpmscan [-j N] [-q] RPM|DIR...
+//	List the entries as "package<TAB>filename<TAB>size", in no particular
+//	order across the packages.  Directories are scanned for *.rpm files
+//	(not recursively).  With -q, only the totals are printed.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "rpmcpio.h"
+
+#define PROG "rpmscan"
+#define warn(fmt, args...) fprintf(stderr, PROG ": " fmt "\n", ##args)
+#define die(fmt, args...) warn(fmt, ##args), exit(128)
+
+static const char **rpms;
+static unsigned nrpm;
+
+static void add(const char *rpmfname)
+{
+    static unsigned alloc;
+    if (nrpm == alloc) {
+	alloc = alloc ? 2 * alloc : 1024;
+	rpms = realloc(rpms, alloc * sizeof *rpms);
+	if (!rpms)
+	    die("cannot allocate memory");
+    }
+    rpms[nrpm++] = rpmfname;
+}
+
+static int cmpstr(const void *a, const void *b)
+{
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+static void adddir(const char *dname)
+{
+    DIR *dir = opendir(dname);
+    if (!dir)
+	die("%s: %m", dname);
+    unsigned start = nrpm;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+	size_t len = strlen(de->d_name);
+	if (len <= 4 || strcmp(de->d_name + len - 4, ".rpm"))
+	    continue;
+	char *fname;
+	if (asprintf(&fname, "%s/%s", dname, de->d_name) < 0)
+	    die("cannot allocate memory");
+	add(fname);
+    }
+    closedir(dir);
+    qsort(rpms + start, nrpm - start, sizeof *rpms, cmpstr);
+}
+
+static bool quiet;
+static unsigned long long nent, size;
+
+static int entry(void *arg, unsigned pkg, struct rpmcpio *cpio,
+		 const struct cpioent *ent)
+{
+    if (quiet) {
+	__atomic_fetch_add(&nent, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&size, ent->size, __ATOMIC_RELAXED);
+    }
+    else
+	printf("%s\t%s\t%llu\n", rpms[pkg], ent->fname,
+	       (unsigned long long) ent->size);
+    return 0;
+}
+
+static void done(void *arg, unsigned pkg, const char *err)
+{
+    if (err)
+	warn("%s", err);
+}
+
+int main(int argc, char **argv)
+{
+    struct rpmcpio_batch b = { entry, done };
+    int c;
+    while ((c = getopt(argc, argv, "j:q")) != -1)
+	switch (c) {
+	case 'j':
+	    b.nthreads = atoi(optarg);
+	    break;
+	case 'q':
+	    quiet = true;
+	    break;
+	default:
+	    goto usage;
+	}
+    argc -= optind, argv += optind;
+    if (argc < 1) {
+usage:	fprintf(stderr, "Usage: " PROG " [-j N] [-q] RPM|DIR...\n");
+	return 2;
+    }
+    for (int i = 0; i < argc; i++) {
+	struct stat st;
+	if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+	    adddir(argv[i]);
+	else
+	    add(argv[i]);
+    }
+    int failed = rpmcpio_batch_run(AT_FDCWD, rpms, nrpm, NULL, &b);
+    if (failed < 0)
+	die("%m");
+    if (quiet)
+	printf("%u packages, %llu entries, %.1f MB\n", nrpm, nent, size / 1e6);
+    return failed > 0;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
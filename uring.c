@@ -0,0 +1,135 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+bool uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    memset(u, 0, sizeof *u);
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+	return false;
+    u->sqmapsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqmapsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    // With IORING_FEAT_SINGLE_MMAP, the rings could share a mapping,
+    // but mapping them separately works with any kernel.
+    u->sqmap = mmap(NULL, u->sqmapsize, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cqmap = mmap(NULL, u->cqmapsize, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqesize, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqmap == MAP_FAILED || u->cqmap == MAP_FAILED || u->sqes == MAP_FAILED) {
+	int saved_errno = errno;
+	if (u->sqmap == MAP_FAILED) u->sqmap = NULL;
+	if (u->cqmap == MAP_FAILED) u->cqmap = NULL;
+	if (u->sqes == MAP_FAILED) u->sqes = NULL;
+	uring_fini(u);
+	return errno = saved_errno, false;
+    }
+    char *sq = u->sqmap, *cq = u->cqmap;
+    u->sqhead = (unsigned *)(sq + p.sq_off.head);
+    u->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    u->sqarray = (unsigned *)(sq + p.sq_off.array);
+    u->sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->cqhead = (unsigned *)(cq + p.cq_off.head);
+    u->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    u->cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sqentries = p.sq_entries;
+    u->cqentries = p.cq_entries;
+    u->features = p.features;
+    // The sqes are used in order, so the indirection array is fixed.
+    for (unsigned i = 0; i < p.sq_entries; i++)
+	u->sqarray[i] = i;
+    return true;
+}
+
+void uring_fini(struct uring *u)
+{
+    if (u->sqes)
+	munmap(u->sqes, u->sqesize);
+    if (u->cqmap)
+	munmap(u->cqmap, u->cqmapsize);
+    if (u->sqmap)
+	munmap(u->sqmap, u->sqmapsize);
+    if (u->fd >= 0)
+	close(u->fd);
+    memset(u, 0, sizeof *u);
+    u->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+    if (u->queued == u->sqentries || u->inflight == u->cqentries)
+	return NULL;
+    // Only this thread writes the tail, and the kernel has consumed
+    // all the submitted sqes by the time io_uring_enter returns.
+    unsigned tail = *u->sqtail + u->queued;
+    struct io_uring_sqe *sqe = &u->sqes[tail & u->sqmask];
+    memset(sqe, 0, sizeof *sqe);
+    u->queued++, u->inflight++;
+    return sqe;
+}
+
+bool uring_submit(struct uring *u, bool wait)
+{
+    unsigned n = u->queued;
+    if (n)
+	__atomic_store_n(u->sqtail, *u->sqtail + n, __ATOMIC_RELEASE);
+    u->queued = 0;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    while (n || wait) {
+	int ret = syscall(__NR_io_uring_enter, u->fd, n, wait, flags, NULL, 0);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	n -= ret < n ? ret : n;
+	if (!n)
+	    break;
+    }
+    return true;
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *u)
+{
+    unsigned head = *u->cqhead;
+    if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+	return NULL;
+    return &u->cqes[head & u->cqmask];
+}
+
+void uring_seen(struct uring *u)
+{
+    __atomic_store_n(u->cqhead, *u->cqhead + 1, __ATOMIC_RELEASE);
+    u->inflight--;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,64 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+#pragma GCC visibility push(hidden)
+
+// A bare-bones io_uring, set up with the raw syscalls (there is no liburing
+// dependency).  Used by rpmcpio_extract to batch the file writes.
+struct uring {
+    int fd;
+    unsigned *sqhead, *sqtail, *sqarray, sqmask;
+    unsigned *cqhead, *cqtail, cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqmap, *cqmap;
+    size_t sqmapsize, cqmapsize, sqesize;
+    unsigned sqentries, cqentries;
+    // IORING_FEAT_* bits supported by the kernel.
+    unsigned features;
+    // The sqes filled but not yet submitted, and the number of requests
+    // whose completions have not been reaped, including the former.
+    unsigned queued, inflight;
+};
+
+// Returns false with errno set, e.g. to ENOSYS, or to EPERM if io_uring
+// is disabled with sysctl kernel.io_uring_disabled.
+bool uring_init(struct uring *u, unsigned entries);
+void uring_fini(struct uring *u);
+
+// Get an sqe to fill, or NULL if either the submission queue is full, or
+// the completion queue would overflow.  Then the caller should reap some
+// completions, with uring_wait.
+struct io_uring_sqe *uring_sqe(struct uring *u);
+
+// Submit the queued sqes, and wait until at least one completion is
+// available (unless wait=false).  Returns false with errno set.
+bool uring_submit(struct uring *u, bool wait);
+
+// Peek at the next completion, NULL if there is none yet.
+// Each completion must be released with uring_seen.
+struct io_uring_cqe *uring_cqe(struct uring *u);
+void uring_seen(struct uring *u);
+
+#pragma GCC visibility pop
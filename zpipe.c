@@ -0,0 +1,222 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "reada.h"
+#include "input.h"
+#include "zreader.h"
+#include "zpipe.h"
+
+// The producer fills the ring in chunks, which are big enough for
+// the decoders to run at full speed, and for the threads to seldom wait.
+#define RINGSIZE (1 << 20)
+#define CHUNK (64 << 10)
+
+struct zpipe {
+    // The number of bytes produced and consumed so far, each on its own
+    // cache line.  head - tail is the amount of data in the ring.
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+    // Set by a thread which is about to sleep, waiting for the other side.
+    int cwait __attribute__((aligned(64)));
+    int pwait;
+    // Set by the producer after the last chunk: 1 on EOF, -1 on error.
+    int done;
+    int err;
+    // Set by the consumer to stop the producer.
+    bool stop;
+    bool running;
+    // Updated by the producer after each chunk, see zpipe_stats.
+    unsigned long long inpos, nfill, ns;
+    pthread_t thread;
+    struct zreader *z;
+    struct input *in;
+    char *ring;
+};
+
+static inline void futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#define load(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define store(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+
+// Wake up the other side, if it's sleeping.
+static inline void wake(int *wait)
+{
+    if (__atomic_exchange_n(wait, 0, __ATOMIC_SEQ_CST))
+	futex_wake(wait);
+}
+
+static inline unsigned long long nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *producer(void *arg)
+{
+    struct zpipe *zp = arg;
+    size_t head = zp->head;
+    while (!load(&zp->stop)) {
+	// Need room for a whole chunk.  Since the reads are never short
+	// until EOF, the chunks never wrap around the ring.
+	size_t tail = load(&zp->tail);
+	if (RINGSIZE - (head - tail) < CHUNK) {
+	    store(&zp->pwait, 1);
+	    if (load(&zp->tail) == tail && !load(&zp->stop))
+		futex_wait(&zp->pwait, 1);
+	    store(&zp->pwait, 0);
+	    continue;
+	}
+	unsigned long long start = nsec();
+	size_t ret = zreader_read(zp->z, zp->in, zp->ring + head % RINGSIZE, CHUNK);
+	__atomic_store_n(&zp->ns, zp->ns + nsec() - start, __ATOMIC_RELAXED);
+	__atomic_store_n(&zp->inpos, zp->in->pos, __ATOMIC_RELAXED);
+	__atomic_store_n(&zp->nfill, zp->in->nfill, __ATOMIC_RELAXED);
+	if (ret == -1) {
+	    zp->err = errno;
+	    store(&zp->done, -1);
+	}
+	else {
+	    head += ret;
+	    store(&zp->head, head);
+	    if (ret < CHUNK)
+		store(&zp->done, 1);
+	}
+	wake(&zp->cwait);
+	if (load(&zp->done))
+	    break;
+    }
+    return NULL;
+}
+
+struct zpipe *zpipe_new(void)
+{
+    struct zpipe *zp = aligned_alloc(64, sizeof *zp);
+    if (!zp)
+	return NULL;
+    memset(zp, 0, sizeof *zp);
+    zp->ring = aligned_alloc(64, RINGSIZE);
+    if (!zp->ring) {
+	free(zp);
+	return NULL;
+    }
+    return zp;
+}
+
+void zpipe_free(struct zpipe *zp)
+{
+    if (!zp)
+	return;
+    zpipe_stop(zp);
+    free(zp->ring);
+    free(zp);
+}
+
+size_t zpipe_read(struct zpipe *zp, struct zreader *z, struct input *in,
+		  void *buf, size_t size)
+{
+    if (!zp->running) {
+	zp->z = z, zp->in = in;
+	zp->inpos = in->pos, zp->nfill = in->nfill, zp->ns = 0;
+	int rc = pthread_create(&zp->thread, NULL, producer, zp);
+	if (rc)
+	    return errno = rc, -1;
+	zp->running = true;
+    }
+    size_t total = 0;
+    size_t tail = zp->tail;
+    while (size) {
+	// The head is final once done is set.
+	int done = load(&zp->done);
+	size_t head = load(&zp->head);
+	if (head == tail) {
+	    if (done < 0)
+		return errno = zp->err, -1;
+	    if (done)
+		break;
+	    store(&zp->cwait, 1);
+	    if (load(&zp->head) == head && !load(&zp->done))
+		futex_wait(&zp->cwait, 1);
+	    store(&zp->cwait, 0);
+	    continue;
+	}
+	size_t off = tail % RINGSIZE;
+	size_t n = head - tail;
+	if (n > RINGSIZE - off)
+	    n = RINGSIZE - off;
+	if (n > size)
+	    n = size;
+	memcpy(buf, zp->ring + off, n);
+	buf = (char *) buf + n, size -= n, total += n;
+	tail += n;
+	store(&zp->tail, tail);
+	// The producer waits for a whole chunk.
+	if (RINGSIZE - (head - tail) >= CHUNK)
+	    wake(&zp->pwait);
+    }
+    return total;
+}
+
+bool zpipe_stats(struct zpipe *zp, unsigned long long *inpos,
+		 unsigned long long *nfill, unsigned long long *ns)
+{
+    if (!zp->running)
+	return false;
+    *inpos = __atomic_load_n(&zp->inpos, __ATOMIC_RELAXED);
+    *nfill = __atomic_load_n(&zp->nfill, __ATOMIC_RELAXED);
+    *ns = __atomic_load_n(&zp->ns, __ATOMIC_RELAXED);
+    return true;
+}
+
+unsigned long long zpipe_stop(struct zpipe *zp)
+{
+    unsigned long long ns = 0;
+    if (zp->running) {
+	store(&zp->stop, true);
+	wake(&zp->pwait);
+	pthread_join(zp->thread, NULL);
+	zp->running = false;
+	ns = zp->ns;
+    }
+    zp->head = zp->tail = 0;
+    zp->cwait = zp->pwait = 0;
+    zp->done = zp->err = 0;
+    zp->stop = false;
+    return ns;
+}
+
+// ex:set ts=8 sts=4 sw=4 noet:
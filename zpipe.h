@@ -0,0 +1,57 @@
+// Copyright (c) 2019 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#pragma GCC visibility push(hidden)
+
+// Pipelined decompression: the decoder runs in a background thread, ahead
+// of the consumer, and the uncompressed data is passed through a ring buffer.
+// The ring has a single producer and a single consumer, and the data path
+// is lock-free; the threads only go to sleep (on a futex) when the ring is
+// full or empty.
+struct zpipe;
+
+struct zpipe *zpipe_new(void);
+void zpipe_free(struct zpipe *zp);
+
+// Same as zreader_read.  The thread is started on the first call, and then
+// owns both z and in, until zpipe_stop.  Returns -1 with errno set if the
+// thread cannot be started.
+struct zreader;
+struct input;
+size_t zpipe_read(struct zpipe *zp, struct zreader *z, struct input *in,
+		  void *buf, size_t size);
+
+// Stop the thread, if it was started, and make the pipe ready to be used
+// with another stream.  The decoder is left in an unspecified state.
+// Returns the time the thread spent in zreader_read, in nanoseconds.
+unsigned long long zpipe_stop(struct zpipe *zp);
+
+// While the thread is running, in->pos and in->nfill can only be read
+// through the pipe, as of the last chunk decoded; the time spent in
+// zreader_read so far is also reported.  Returns false if the thread
+// is not running, in which case in can be accessed directly.
+bool zpipe_stats(struct zpipe *zp, unsigned long long *inpos,
+		 unsigned long long *nfill, unsigned long long *ns);
+
+#pragma GCC visibility pop
@@ -19,15 +19,51 @@
 // SOFTWARE.
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
 #include "reada.h"
+#include "input.h"
 #include "zreader.h"
+#include "gzindex.h"
 
 // Decompresson error, as opposed to a system error.
 #define ZREAD_ERR (errno = 0, -1)
 
-static size_t read_gzip(struct zreader *z, struct fda *fda, void *buf, size_t size)
+#ifndef ZREADER_ISAL
+#ifdef ZREADER_ZLIBNG
+// The native zlib-ng API only differs by the zng_ prefix.
+#define z_stream zng_stream
+#define inflateInit2 zng_inflateInit2
+#define inflateReset zng_inflateReset
+#define inflateReset2 zng_inflateReset2
+#define inflatePrime zng_inflatePrime
+#define inflateSetDictionary zng_inflateSetDictionary
+#define inflateGetDictionary zng_inflateGetDictionary
+#define inflateEnd zng_inflateEnd
+#define inflate zng_inflate
+#endif
+
+// Record a checkpoint, if it's time to.  n is the number of bytes just
+// decompressed, zret is what inflate returned.
+static bool addpoint(struct zreader *z, struct input *in, size_t n, int zret)
+{
+    struct gzindex *gx = z->gx;
+    z_stream *strm = &z->u.strm;
+    gx->out += n;
+    // At the end of a block, but not the last one in the stream?
+    if (zret == Z_STREAM_END || (strm->data_type & (128|64)) != 128)
+	return true;
+    if (gx->out - gx->last < gx->span)
+	return true;
+    unsigned char win[32 << 10];
+    unsigned wsize = sizeof win;
+    if (inflateGetDictionary(strm, win, &wsize) != Z_OK)
+	return errno = 0, false;
+    return gzindex_add(gx, in->pos, strm->data_type & 7, win, wsize);
+}
+
+static size_t read_gzip(struct zreader *z, struct input *in, void *buf, size_t size)
 {
     assert(size + 1 > 1);
 
@@ -36,8 +72,8 @@ static size_t read_gzip(struct zreader *z, struct fda *fda, void *buf, size_t si
 
     do {
 	// Prefill the internal buffer.
-	unsigned long w;
-	ssize_t ret = peeka(fda, &w, sizeof w);
+	const char *p;
+	ssize_t ret = inpeek(in, &p);
 	if (ret <= 0) {
 	    // expected vs unexpected EOF
 	    if (ret == 0) {
@@ -60,12 +96,13 @@ static size_t read_gzip(struct zreader *z, struct fda *fda, void *buf, size_t si
 	}
 
 	// The inflate call is imminent.
-	strm->next_in = (void *) fda->cur;
-	strm->avail_in = fda->end - fda->cur;
+	strm->next_in = (void *) p;
+	strm->avail_in = ret;
 	strm->next_out = buf;
 	strm->avail_out = size;
 
-	int zret = inflate(strm, Z_NO_FLUSH);
+	// When building the index, stop at the end of each deflate block.
+	int zret = inflate(strm, z->gx ? Z_BLOCK : Z_NO_FLUSH);
 	if (zret == Z_STREAM_END)
 	    z->eos = true;
 	else if (zret != Z_OK)
@@ -75,13 +112,26 @@ static size_t read_gzip(struct zreader *z, struct fda *fda, void *buf, size_t si
 	    return ZREAD_ERR;
 
 	// See how many bytes have been consumed.
-	fda->cur = fda->end - strm->avail_in;
-	assert(fda->cur == (void *) strm->next_in);
+	inconsume(in, ret - strm->avail_in);
 
 	// See how many bytes have been recovered.
 	size_t n = size - strm->avail_out;
 	size = strm->avail_out, buf = (char *) buf + n;
 	total += n;
+
+	if (z->gx && !addpoint(z, in, n, zret))
+	    return -1;
+
+	// Resumed at a checkpoint, the raw deflate stream has just ended.
+	// The gzip trailer cannot be verified, only skipped, and the next
+	// member, if any, is decoded as usual.
+	if (z->eos && z->raw) {
+	    if (inskip(in, 8) != 8)
+		return ZREAD_ERR;
+	    z->raw = false;
+	    if (inflateReset2(strm, 15 + 16) != Z_OK)
+		return ZREAD_ERR;
+	}
     } while (size);
 
     return total;
@@ -112,7 +162,136 @@ static bool init_gzip(struct zreader *z)
     return true;
 }
 
-static size_t read_lzma(struct zreader *z, struct fda *fda, void *buf, size_t size)
+static bool reset_gzip(struct zreader *z)
+{
+    // Possibly in raw mode, see zreader_resume.
+    return inflateReset2(&z->u.strm, 15 + 16) == Z_OK;
+}
+
+bool zreader_index(struct zreader *z, struct gzindex *gx)
+{
+    if (z->read != read_gzip)
+	return errno = 0, false;
+    z->gx = gx;
+    return true;
+}
+
+bool zreader_resume(struct zreader *z, struct input *in, unsigned bits,
+		    const void *win, unsigned wsize)
+{
+    if (z->read != read_gzip)
+	return errno = 0, false;
+    z_stream *strm = &z->u.strm;
+    // The checkpoint is within a deflate stream, past the gzip header.
+    if (inflateReset2(strm, -15) != Z_OK)
+	return errno = 0, false;
+    if (bits) {
+	unsigned char c;
+	if (inread(in, &c, 1) != 1)
+	    return errno = 0, false;
+	if (inflatePrime(strm, bits, c >> (8 - bits)) != Z_OK)
+	    return errno = 0, false;
+    }
+    if (inflateSetDictionary(strm, win, wsize) != Z_OK)
+	return errno = 0, false;
+    z->raw = true;
+    z->eos = false;
+    return true;
+}
+#else
+// Intel ISA-L, much faster on x86_64.  Its inflate_state is too big
+// to be embedded in struct zreader.
+static size_t read_gzip(struct zreader *z, struct input *in, void *buf, size_t size)
+{
+    assert(size + 1 > 1);
+
+    size_t total = 0;
+    struct inflate_state *state = z->u.isal;
+
+    do {
+	const char *p;
+	ssize_t ret = inpeek(in, &p);
+	if (ret <= 0) {
+	    if (ret == 0) {
+		if (z->eos)
+		    return total;
+		errno = 0;
+	    }
+	    return -1;
+	}
+
+	// Concatenate the next gzip member, see read_gzip above.
+	if (z->eos) {
+	    z->eos = false;
+	    isal_inflate_reset(state);
+	    state->crc_flag = ISAL_GZIP;
+	}
+
+	state->next_in = (void *) p;
+	state->avail_in = ret;
+	state->next_out = buf;
+	state->avail_out = size;
+
+	// The gzip header and trailer are parsed, and crc32 verified,
+	// by isal_inflate itself.
+	int zret = isal_inflate(state);
+	if (zret != ISAL_DECOMP_OK)
+	    return ZREAD_ERR;
+	if (state->block_state == ISAL_BLOCK_FINISH)
+	    z->eos = true;
+
+	inconsume(in, ret - state->avail_in);
+
+	size_t n = size - state->avail_out;
+	size = state->avail_out, buf = (char *) buf + n;
+	total += n;
+    } while (size);
+
+    return total;
+}
+
+static void fini_gzip(struct zreader *z)
+{
+    free(z->u.isal);
+}
+
+static bool init_gzip(struct zreader *z)
+{
+    struct inflate_state *state = malloc(sizeof *state);
+    if (!state)
+	return false;
+    isal_inflate_init(state);
+    state->crc_flag = ISAL_GZIP;
+
+    z->u.isal = state;
+    z->read = read_gzip;
+    z->fini = fini_gzip;
+    return true;
+}
+
+static bool reset_gzip(struct zreader *z)
+{
+    isal_inflate_reset(z->u.isal);
+    z->u.isal->crc_flag = ISAL_GZIP;
+    return true;
+}
+
+// ISA-L cannot prime the bit buffer, so there is no random access.
+bool zreader_index(struct zreader *z, struct gzindex *gx)
+{
+    (void) z, (void) gx;
+    return errno = ENOTSUP, false;
+}
+
+bool zreader_resume(struct zreader *z, struct input *in, unsigned bits,
+		    const void *win, unsigned wsize)
+{
+    (void) z, (void) in, (void) bits, (void) win, (void) wsize;
+    return errno = ENOTSUP, false;
+}
+#endif
+
+static size_t read_lzma(struct zreader *z, struct input *in, void *buf, size_t size)
 {
     assert(size + 1 > 1);
 
@@ -120,8 +299,8 @@ static size_t read_lzma(struct zreader *z, struct fda *fda, void *buf, size_t si
     lzma_stream *lzma = &z->u.lzma;
 
     do {
-	unsigned long w;
-	ssize_t ret = peeka(fda, &w, sizeof w);
+	const char *p;
+	ssize_t ret = inpeek(in, &p);
 	if (ret <= 0) {
 	    if (ret == 0) {
 		if (z->eos)
@@ -138,19 +317,18 @@ static size_t read_lzma(struct zreader *z, struct fda *fda, void *buf, size_t si
 	if (z->eos)
 	    return ZREAD_ERR;
 
-	lzma->next_in = (void *) fda->cur;
-	lzma->avail_in = fda->end - fda->cur;
+	lzma->next_in = (void *) p;
+	lzma->avail_in = ret;
 	lzma->next_out = buf;
 	lzma->avail_out = size;
 
 	lzma_ret zret = lzma_code(lzma, LZMA_RUN);
-	if (zret == Z_STREAM_END)
+	if (zret == LZMA_STREAM_END)
 	    z->eos = true;
 	else if (zret != LZMA_OK)
 	    return ZREAD_ERR;
 
-	fda->cur = fda->end - lzma->avail_in;
-	assert(fda->cur == (void *) lzma->next_in);
+	inconsume(in, ret - lzma->avail_in);
 
 	size_t n = size - lzma->avail_out;
 	size = lzma->avail_out, buf = (char *) buf + n;
@@ -160,7 +338,7 @@ static size_t read_lzma(struct zreader *z, struct fda *fda, void *buf, size_t si
     return total;
 }
 
-static size_t read_xz(struct zreader *z, struct fda *fda, void *buf, size_t size)
+static size_t read_xz(struct zreader *z, struct input *in, void *buf, size_t size)
 {
     assert(size + 1 > 1);
 
@@ -168,8 +346,8 @@ static size_t read_xz(struct zreader *z, struct fda *fda, void *buf, size_t size
     lzma_stream *lzma = &z->u.lzma;
 
     do {
-	unsigned long w;
-	ssize_t ret = peeka(fda, &w, sizeof w);
+	const char *p;
+	ssize_t ret = inpeek(in, &p);
 	if (ret <= 0) {
 	    if (ret < 0)
 		return -1;
@@ -185,7 +363,7 @@ static size_t read_xz(struct zreader *z, struct fda *fda, void *buf, size_t size
 	    lzma->avail_out = size;
 
 	    lzma_ret zret = lzma_code(lzma, LZMA_FINISH);
-	    if (zret == Z_STREAM_END)
+	    if (zret == LZMA_STREAM_END)
 		z->eos = true;
 	    else
 		return ZREAD_ERR;
@@ -200,8 +378,8 @@ static size_t read_xz(struct zreader *z, struct fda *fda, void *buf, size_t size
 	if (z->eos)
 	    return ZREAD_ERR;
 
-	lzma->next_in = (void *) fda->cur;
-	lzma->avail_in = fda->end - fda->cur;
+	lzma->next_in = (void *) p;
+	lzma->avail_in = ret;
 	lzma->next_out = buf;
 	lzma->avail_out = size;
 
@@ -209,8 +387,7 @@ static size_t read_xz(struct zreader *z, struct fda *fda, void *buf, size_t size
 	if (zret != LZMA_OK)
 	    return ZREAD_ERR;
 
-	fda->cur = fda->end - lzma->avail_in;
-	assert(fda->cur == (void *) lzma->next_in);
+	inconsume(in, ret - lzma->avail_in);
 
 	size_t n = size - lzma->avail_out;
 	size = lzma->avail_out, buf = (char *) buf + n;
@@ -225,10 +402,14 @@ static void fini_lzma(struct zreader *z)
     lzma_end(&z->u.lzma);
 }
 
-static bool init_lzma(struct zreader *z)
+// With reinit, the lzma_stream is already initialized, and the memory
+// allocated by the previous decoder is reused by liblzma, provided that
+// the decoder is of the same kind.
+static bool init_lzma(struct zreader *z, bool reinit)
 {
     lzma_stream *lzma = &z->u.lzma;
-    *lzma = (lzma_stream) LZMA_STREAM_INIT;
+    if (!reinit)
+	*lzma = (lzma_stream) LZMA_STREAM_INIT;
 
     // 100M is rpm's default limit, we follow suit.
     lzma_ret zret = lzma_alone_decoder(lzma, 100<<20);
@@ -240,12 +421,111 @@ static bool init_lzma(struct zreader *z)
     return true;
 }
 
-static bool init_xz(struct zreader *z)
+static size_t read_zstd(struct zreader *z, struct input *in, void *buf, size_t size)
 {
-    lzma_stream *lzma = &z->u.lzma;
-    *lzma = (lzma_stream) LZMA_STREAM_INIT;
+    assert(size + 1 > 1);
 
-    lzma_ret zret = lzma_stream_decoder(lzma, 100<<20, LZMA_CONCATENATED);
+    size_t total = 0;
+    ZSTD_DStream *zstd = z->u.zstd;
+
+    do {
+	ZSTD_inBuffer zin = { NULL, 0, 0 };
+	ZSTD_outBuffer out = { buf, size, 0 };
+
+	const char *p;
+	ssize_t ret = inpeek(in, &p);
+	if (ret < 0)
+	    return -1;
+	if (ret == 0) {
+	    if (z->eos)
+		return total;
+	    // The last call may have filled the output buffer, with more
+	    // data still pending in the decoder.  Flush it, with no input.
+	    size_t zret = ZSTD_decompressStream(zstd, &out, &zin);
+	    if (ZSTD_isError(zret) || out.pos == 0)
+		return ZREAD_ERR;
+	    z->eos = zret == 0;
+	}
+	else {
+	    // Zstd frames are concatenated naturally: after a frame is done,
+	    // the decoder expects the next one.  Skippable frames are fine.
+	    // Anything else is trailing garbage, which fails to decode.
+	    zin.src = p;
+	    zin.size = ret;
+
+	    size_t zret = ZSTD_decompressStream(zstd, &out, &zin);
+	    if (ZSTD_isError(zret))
+		return ZREAD_ERR;
+	    // Zero means that a frame has been completely decoded and flushed.
+	    z->eos = zret == 0;
+
+	    inconsume(in, zin.pos);
+	}
+
+	size_t n = out.pos;
+	size -= n, buf = (char *) buf + n;
+	total += n;
+    } while (size);
+
+    return total;
+}
+
+static void fini_zstd(struct zreader *z)
+{
+    ZSTD_freeDStream(z->u.zstd);
+}
+
+static bool init_zstd(struct zreader *z)
+{
+    ZSTD_DStream *zstd = ZSTD_createDStream();
+    if (!zstd)
+	return errno = ENOMEM, false;
+    if (ZSTD_isError(ZSTD_initDStream(zstd))) {
+	ZSTD_freeDStream(zstd);
+	return errno = 0, false;
+    }
+
+    z->u.zstd = zstd;
+    z->read = read_zstd;
+    z->fini = fini_zstd;
+    return true;
+}
+
+static bool reset_zstd(struct zreader *z)
+{
+    size_t zret = ZSTD_DCtx_reset(z->u.zstd, ZSTD_reset_session_only);
+    return !ZSTD_isError(zret);
+}
+
+static bool init_xz(struct zreader *z, const struct zopt *opt, bool reinit)
+{
+    lzma_stream *lzma = &z->u.lzma;
+    if (!reinit)
+	*lzma = (lzma_stream) LZMA_STREAM_INIT;
+
+    lzma_ret zret;
+#if LZMA_VERSION >= 50040002
+    if (opt && opt->threads > 1) {
+	// Blocks are decoded in parallel only if their sizes are stored
+	// in the block headers, which is what xz -T does.  Otherwise, e.g.
+	// with a single-block stream, the decoder runs in a single thread.
+	lzma_mt mt = {
+	    .flags = LZMA_CONCATENATED,
+	    .threads = opt->threads,
+	    .memlimit_threading = opt->memlimit,
+	};
+	// Like xz(1), use up to a quarter of RAM by default.
+	if (mt.memlimit_threading == 0)
+	    mt.memlimit_threading = lzma_physmem() / 4;
+	// Fewer threads are used when memlimit_threading would be exceeded.
+	// The hard limit, beyond which decoding fails, is still at least 100M.
+	mt.memlimit_stop = mt.memlimit_threading > (100<<20) ?
+			   mt.memlimit_threading : (100<<20);
+	zret = lzma_stream_decoder_mt(lzma, &mt);
+    }
+    else
+#endif
+	zret = lzma_stream_decoder(lzma, 100<<20, LZMA_CONCATENATED);
     if (zret != LZMA_OK)
 	return false;
 
@@ -254,9 +534,172 @@ static bool init_xz(struct zreader *z)
     return true;
 }
 
-bool zreader_init(struct zreader *z, const char *zprog)
+#if LZMA_VERSION >= 50040002
+// Resumed at a block by zreader_xzseek, the stream is decoded block by block,
+// z->eos being set between the blocks.  When the stream's index is reached,
+// the rest of the stream is skipped, and any further streams are handled
+// by the regular decoder.
+static size_t read_xzblk(struct zreader *z, struct input *in, void *buf, size_t size)
 {
-    z->eos = false;
+    assert(size + 1 > 1);
+
+    size_t total = 0;
+    lzma_stream *lzma = &z->u.lzma;
+
+    do {
+	if (z->eos) {
+	    // The block header, or the index indicator.
+	    unsigned char hdr[LZMA_BLOCK_HEADER_SIZE_MAX];
+	    ssize_t ret = inread(in, hdr, 1);
+	    if (ret != 1)
+		return ret < 0 ? -1 : ZREAD_ERR;
+	    if (hdr[0] == 0) {
+		if (!inseek(in, z->xzend))
+		    return ZREAD_ERR;
+		z->raw = false;
+		if (!init_xz(z, NULL, true))
+		    return ZREAD_ERR;
+		const char *p;
+		ret = inpeek(in, &p);
+		if (ret <= 0)
+		    return ret < 0 ? -1 : total;
+		z->eos = false;
+		size_t n = read_xz(z, in, buf, size);
+		return n == -1 ? n : total + n;
+	    }
+	    // The filter options are copied by the decoder, and can be freed.
+	    lzma_filter *filters = z->xzfilters;
+	    lzma_block *block = &z->xzblock;
+	    *block = (lzma_block) {
+		.version = 0,
+		.header_size = lzma_block_header_size_decode(hdr[0]),
+		.check = z->xzcheck,
+		.filters = filters,
+	    };
+	    size_t hsize = block->header_size - 1;
+	    ret = inread(in, hdr + 1, hsize);
+	    if (ret != hsize)
+		return ret < 0 ? -1 : ZREAD_ERR;
+	    if (lzma_block_header_decode(block, NULL, hdr) != LZMA_OK)
+		return ZREAD_ERR;
+	    lzma_ret zret = lzma_block_decoder(lzma, block);
+	    for (int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+		free(filters[i].options), filters[i].options = NULL;
+	    if (zret != LZMA_OK)
+		return ZREAD_ERR;
+	    z->eos = false;
+	}
+
+	const char *p;
+	ssize_t ret = inpeek(in, &p);
+	if (ret <= 0) {
+	    // The stream cannot end in the middle of a block.
+	    if (ret == 0)
+		errno = 0;
+	    return -1;
+	}
+
+	lzma->next_in = (void *) p;
+	lzma->avail_in = ret;
+	lzma->next_out = buf;
+	lzma->avail_out = size;
+
+	lzma_ret zret = lzma_code(lzma, LZMA_RUN);
+	if (zret == LZMA_STREAM_END)
+	    z->eos = true;
+	else if (zret != LZMA_OK)
+	    return ZREAD_ERR;
+
+	inconsume(in, ret - lzma->avail_in);
+
+	size_t n = size - lzma->avail_out;
+	size = lzma->avail_out, buf = (char *) buf + n;
+	total += n;
+    } while (size);
+
+    return total;
+}
+
+// Decode the index of the xz file which spans the input from in->pos
+// to the offset end, reading it with inpread.
+static lzma_index *xzindex(struct input *in, unsigned long long end)
+{
+    unsigned long long start = in->pos;
+    lzma_stream fi = LZMA_STREAM_INIT;
+    lzma_index *idx = NULL;
+    if (lzma_file_info_decoder(&fi, &idx, UINT64_MAX, end - start) != LZMA_OK)
+	return NULL;
+    unsigned char buf[8192];
+    unsigned long long pos = start;
+    lzma_ret zret;
+    do {
+	if (fi.avail_in == 0) {
+	    ssize_t n = inpread(in, buf, sizeof buf, pos);
+	    if (n <= 0)
+		break;
+	    fi.next_in = buf;
+	    fi.avail_in = n;
+	    pos += n;
+	}
+	zret = lzma_code(&fi, LZMA_RUN);
+	// The decoder reads the stream footers and indexes, going backwards.
+	if (zret == LZMA_SEEK_NEEDED) {
+	    pos = start + fi.seek_pos;
+	    fi.avail_in = 0;
+	    zret = LZMA_OK;
+	}
+    } while (zret == LZMA_OK);
+    lzma_end(&fi);
+    return zret == LZMA_STREAM_END ? idx : NULL;
+}
+
+bool zreader_xzseek(struct zreader *z, struct input *in, unsigned long long end,
+		    unsigned long long target, unsigned long long *outpos)
+{
+    *outpos = 0;
+    if (z->read != read_xz)
+	return errno = 0, false;
+    lzma_index *idx = xzindex(in, end);
+    if (!idx)
+	return errno = 0, false;
+
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, idx);
+    if (lzma_index_iter_locate(&iter, target)) {
+	lzma_index_end(idx, NULL);
+	return errno = 0, false;
+    }
+    unsigned long long start = in->pos;
+    unsigned long long blkpos = start + iter.block.compressed_file_offset;
+    *outpos = iter.block.uncompressed_file_offset;
+    z->xzcheck = iter.stream.flags->check;
+    z->xzend = start + iter.stream.compressed_offset +
+	       iter.stream.compressed_size + iter.stream.padding;
+    lzma_index_end(idx, NULL);
+
+    // Within the first block, the decoder simply starts from the beginning.
+    if (*outpos == 0)
+	return true;
+    if (!inseek(in, blkpos))
+	return *outpos = 0, errno = 0, false;
+    z->read = read_xzblk;
+    z->raw = true;
+    z->eos = true;
+    return true;
+}
+#else
+bool zreader_xzseek(struct zreader *z, struct input *in, unsigned long long end,
+		    unsigned long long target, unsigned long long *outpos)
+{
+    *outpos = 0;
+    return errno = ENOTSUP, false;
+}
+#endif
+
+bool zreader_init(struct zreader *z, const char *zprog, const struct zopt *opt)
+{
+    z->eos = z->raw = false;
+    z->gx = NULL;
     switch (*zprog) {
     case 'g':
 	if (strcmp(zprog, "gzip") == 0)
@@ -264,20 +707,55 @@ bool zreader_init(struct zreader *z, const char *zprog)
 	break;
     case 'l':
 	if (strcmp(zprog, "lzma") == 0)
-	    return init_lzma(z);
+	    return init_lzma(z, false);
 	break;
     case 'x':
 	if (strcmp(zprog, "xz") == 0)
-	    return init_xz(z);
+	    return init_xz(z, opt, false);
+	break;
+    case 'z':
+	if (strcmp(zprog, "zstd") == 0)
+	    return init_zstd(z);
 	break;
     }
     errno = 0;
     return false;
 }
 
+bool zreader_reinit(struct zreader *z, const char *zprog, const struct zopt *opt)
+{
+    bool ok;
+    z->eos = z->raw = false;
+    z->gx = NULL;
+    // Same method, the decoder state can be reset in place.
+    if (strcmp(zprog, "gzip") == 0 && z->fini == fini_gzip)
+	ok = reset_gzip(z);
+    else if (strcmp(zprog, "zstd") == 0 && z->fini == fini_zstd)
+	ok = reset_zstd(z);
+    // Both lzma and xz run on the same lzma_stream.
+    else if (strcmp(zprog, "lzma") == 0 && z->fini == fini_lzma)
+	ok = init_lzma(z, true);
+    else if (strcmp(zprog, "xz") == 0 && z->fini == fini_lzma)
+	ok = init_xz(z, opt, true);
+    else {
+	zreader_fini(z);
+	z->fini = NULL;
+	ok = zreader_init(z, zprog, opt);
+    }
+    if (!ok) {
+	int saved_errno = errno;
+	zreader_fini(z);
+	z->fini = NULL;
+	errno = saved_errno;
+    }
+    return ok;
+}
+
 #ifdef ZREADER_MAIN
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #define PROG "zreader"
 #define warn(fmt, args...) fprintf(stderr, PROG ": " fmt "\n", ##args)
@@ -285,8 +763,23 @@ bool zreader_init(struct zreader *z, const char *zprog)
 
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-usage:	fprintf(stderr, "Usage: " PROG " COMPRESSION-METHOD < COMPRESSED-INPUT\n");
+    struct zopt opt = { 0 };
+    int c;
+    while ((c = getopt(argc, argv, "T:M:")) != -1)
+	switch (c) {
+	case 'T':
+	    opt.threads = atoi(optarg);
+	    break;
+	case 'M':
+	    opt.memlimit = strtoull(optarg, NULL, 0) << 20;
+	    break;
+	default:
+	    goto usage;
+	}
+    argc -= optind, argv += optind;
+    if (argc != 1) {
+usage:	fprintf(stderr, "Usage: " PROG " [-T THREADS] [-M MEMLIMIT-MB] "
+			"COMPRESSION-METHOD < COMPRESSED-INPUT\n");
 	return 2;
     }
     if (isatty(0)) {
@@ -296,14 +789,15 @@ usage:	fprintf(stderr, "Usage: " PROG " COMPRESSION-METHOD < COMPRESSED-INPUT\n"
 
     char fdabuf[NREADA];
     struct fda fda = { 0, fdabuf };
+    struct input in = { &fda };
 
     struct zreader z;
-    if (!zreader_init(&z, argv[1]))
-	die("cannot initialize %s decoder", argv[1]);
+    if (!zreader_init(&z, argv[0], &opt))
+	die("cannot initialize %s decoder", argv[0]);
 
     char buf[BUFSIZ];
     size_t size;
-    while ((size = zreader_read(&z, &fda, buf, sizeof buf)) + 1 > 1)
+    while ((size = zreader_read(&z, &in, buf, sizeof buf)) + 1 > 1)
 	if (fwrite_unlocked(buf, 1, size, stdout) != size)
 	    die("fwrite: %m");
 
@@ -311,7 +805,7 @@ usage:	fprintf(stderr, "Usage: " PROG " COMPRESSION-METHOD < COMPRESSED-INPUT\n"
 	if (errno)
 	    die("read: %m");
 	else
-	    die("%s decompression failed", argv[1]);
+	    die("%s decompression failed", argv[0]);
     }
 
     return 0;
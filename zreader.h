@@ -18,42 +18,111 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+// The inflate engine for gzip payloads is selected at build time.
+#if defined(ZREADER_ISAL)
+#include <isa-l/igzip_lib.h>
+#elif defined(ZREADER_ZLIBNG)
+#include <zlib-ng.h>
+#else
 #include <zlib.h>
+#endif
 #include <lzma.h>
+#include <zstd.h>
 
 #pragma GCC visibility push(hidden)
 
 struct zreader {
     union {
+#if defined(ZREADER_ISAL)
+	struct inflate_state *isal;
+#elif defined(ZREADER_ZLIBNG)
+	zng_stream strm;
+#else
 	z_stream strm;
+#endif
 	lzma_stream lzma;
+	ZSTD_DStream *zstd;
     } u;
-    size_t (*read)(struct zreader *z, struct fda *fda, void *buf, size_t size);
+    size_t (*read)(struct zreader *z, struct input *in, void *buf, size_t size);
     void (*fini)(struct zreader *z);
     bool eos; // end of compressed stream
+    // Resumed at a gzip checkpoint or at an xz block, in the middle
+    // of a gzip member / xz stream.
+    bool raw;
+    // xz only: the check type and the end offset of the stream resumed at,
+    // and the block being decoded, which lzma_block_decoder keeps pointing
+    // to (the sizes and the check are verified at the end of the block).
+    unsigned char xzcheck;
+    unsigned long long xzend;
+    lzma_block xzblock;
+    lzma_filter xzfilters[LZMA_FILTERS_MAX + 1];
+    // gzip only: the index being built, see gzindex.h.
+    struct gzindex *gx;
+};
+
+// Decoder tuning, opt=NULL means all zeroes.
+struct zopt {
+    // With xz, decode multi-block streams with up to this many threads;
+    // 0 or 1 selects the plain single-threaded decoder.
+    unsigned threads;
+    // With threads, the memory limit which determines the actual
+    // number of threads; 0 means a quarter of physical memory.
+    unsigned long long memlimit;
 };
 
 // Initialize the decompressor.  The compression method must be known
 // in advance, and zprog set accordingly to either of the following:
-// gzip, lzma, xz.  Returns false on failure.  If the decompression method
+// gzip, lzma, xz, zstd.  Returns false on failure.  If the decompression method
 // wasn't recognized, errno is set to 0.  Otherwise, errno is most probably
 // set to ENOMEM by an underlying library call.
-bool zreader_init(struct zreader *z, const char *zprog);
+bool zreader_init(struct zreader *z, const char *zprog, const struct zopt *opt);
+
+// Re-initialize the decompressor for the next stream, possibly with another
+// method.  The zreader must have been initialized with zreader_init, or else
+// have z->fini = NULL.  With the same method, the decoder is reset in place,
+// and its memory is reused.  On failure, errno is set as with zreader_init,
+// and z->fini is set to NULL.
+bool zreader_reinit(struct zreader *z, const char *zprog, const struct zopt *opt);
+
+// Random access to gzip streams.  zreader_index starts recording checkpoints
+// into gx (with gx->span and gx->out set), while the stream is decompressed
+// from the beginning.  zreader_resume restarts the decoder at a checkpoint:
+// the input must be positioned at pt->in, or at pt->in - 1 if pt->bits > 0,
+// and the window is the checkpoint's decompressed window.  Both return false
+// for methods other than gzip, with errno set to 0, or to ENOTSUP if the
+// inflate engine does not support random access.
+struct gzindex;
+bool zreader_index(struct zreader *z, struct gzindex *gx);
+bool zreader_resume(struct zreader *z, struct input *in, unsigned bits,
+		    const void *win, unsigned wsize);
+
+// Random access to xz streams, using their own index.  The stream(s) must
+// span the input from in->pos up to the offset end, and the decoder must be
+// just initialized.  The index is read with inpread, and the block which
+// contains the uncompressed offset target is located; the input is then
+// positioned at the block, and decoding starts there.  *outpos is set to
+// the uncompressed offset at which the decoder resumes (0 if the target is
+// in the first block, in which case the input is left as is).  Returns false
+// if the stream has no usable index, or with methods other than xz, errno
+// being set to 0, or to ENOTSUP if liblzma is too old (before 5.4).
+bool zreader_xzseek(struct zreader *z, struct input *in, unsigned long long end,
+		    unsigned long long target, unsigned long long *outpos);
 
 // Free internal buffers in z->u.
 static inline void zreader_fini(struct zreader *z)
 {
-    z->fini(z);
+    if (z->fini)
+	z->fini(z);
 }
 
 // Read as much as possible, compressed frames concatenated automatically.
 // Returns the number of bytes read, 0 on EOF, (size_t) -1 on error.
 // errno is set to 0 on decompression failure.  Otherwise, errno indicates
 // a disk read error.
-static inline size_t zreader_read(struct zreader *z, struct fda *fda,
+static inline size_t zreader_read(struct zreader *z, struct input *in,
 				  void *buf, size_t size)
 {
-    return z->read(z, fda, buf, size);
+    return z->read(z, in, buf, size);
 }
 
 #pragma GCC visibility pop